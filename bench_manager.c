@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+#include "manager.h"
+#include "cluster-protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+// Производительность раздачи задач Управляющим узлом в зависимости от количества рабочих узлов.
+// Рабочие узлы имитируются одним потоком: каждый узел с одним ядром сразу возвращает номер задачи,
+// поэтому время работы определяется накладными расходами Управляющего узла на одно событие.
+
+#define NUM_TASKS 200000
+#define MAX_TIME 60
+
+static const size_t bench_workers[] = {1, 4, 16, 64, 256, 1024};
+
+struct bench_cluster {
+    const char *addr;
+    const char *port;
+    size_t num_workers;
+    int ret;
+};
+
+static int bench_connect(struct addrinfo *res)
+{
+    // Управляющий узел начинает слушать только внутри start_manager_sink.
+    for (int attempt = 0; attempt < 5000; ++attempt) {
+        int fd = socket(res->ai_family, SOCK_STREAM, 0);
+        if (fd == -1) {
+            return -1;
+        }
+        if (connect(fd, res->ai_addr, res->ai_addrlen) == 0) {
+            // Как и настоящий рабочий узел, результаты отправляются без задержки.
+            int nodelay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            return fd;
+        }
+        close(fd);
+        usleep(1000);
+    }
+    return -1;
+}
+
+static bool bench_recv_all(int fd, void *buf, size_t size)
+{
+    while (size != 0) {
+        ssize_t bytes_read = recv(fd, buf, size, MSG_WAITALL);
+        if (bytes_read <= 0) {
+            return false;
+        }
+        buf = (char *)buf + bytes_read;
+        size -= bytes_read;
+    }
+    return true;
+}
+
+// Обработка одного пакета задач; false - признак завершения или разрыв соединения.
+static bool bench_serve_batch(int fd, char **buf, size_t *buf_size)
+{
+    size_t header[2];
+    if (!bench_recv_all(fd, &header[0], sizeof(header[0])) || header[0] == 0) {
+        return false;
+    }
+    size_t num_tasks = header[0];
+    if (!bench_recv_all(fd, &header[1], sizeof(header[1]))) {
+        return false;
+    }
+    size_t size = num_tasks * sizeof(size_t) + header[1];
+    if (size > *buf_size) {
+        char *new_buf = realloc(*buf, size);
+        if (new_buf == NULL) {
+            return false;
+        }
+        *buf = new_buf;
+        *buf_size = size;
+    }
+    if (!bench_recv_all(fd, *buf, size)) {
+        return false;
+    }
+    size_t *task_ids = (size_t *)*buf;
+    for (size_t i = 0; i < num_tasks; ++i) {
+        RESULT_HEADER result = { .task_id = task_ids[i], .size = sizeof(double) };
+        double value = (double)task_ids[i];
+        struct iovec iov[2] = {
+            { .iov_base = &result, .iov_len = sizeof(result) },
+            { .iov_base = &value, .iov_len = sizeof(value) },
+        };
+        if (!cluster_sendv_all(fd, iov, 2)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void *bench_cluster_run(void *arg)
+{
+    struct bench_cluster *cluster = arg;
+    cluster->ret = -1;
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *res;
+    if (getaddrinfo(cluster->addr, cluster->port, &hints, &res) != 0) {
+        return NULL;
+    }
+    int epoll_fd = epoll_create1(0);
+    char *buf = NULL;
+    size_t buf_size = 0;
+    size_t active = 0;
+    if (epoll_fd == -1) {
+        goto clear;
+    }
+    for (size_t i = 0; i < cluster->num_workers; ++i) {
+        int fd = bench_connect(res);
+        // Узел не поддерживает сжатие и разделяемую память: измеряются накладные расходы на TCP.
+        NODE_INFO info = { .n_cores = 1, .codecs = 1UL << CLUSTER_CODEC_NONE };
+        NODE_CONFIG config;
+        if (fd == -1 || send(fd, &info, sizeof(info), MSG_NOSIGNAL) != sizeof(info) ||
+            !bench_recv_all(fd, &config, sizeof(config))) {
+            fprintf(stderr, "Unable to connect worker %lu\n", i);
+            goto clear;
+        }
+        struct epoll_event event = { .events = EPOLLIN, .data.fd = fd };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            close(fd);
+            goto clear;
+        }
+        ++active;
+    }
+    struct epoll_event events[64];
+    while (active != 0) {
+        int num_events = epoll_wait(epoll_fd, events, 64, -1);
+        if (num_events == -1) {
+            goto clear;
+        }
+        for (int i = 0; i < num_events; ++i) {
+            int fd = events[i].data.fd;
+            if (!bench_serve_batch(fd, &buf, &buf_size)) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+                close(fd);
+                --active;
+            }
+        }
+    }
+    cluster->ret = 0;
+clear:
+    free(buf);
+    if (epoll_fd != -1) {
+        close(epoll_fd);
+    }
+    freeaddrinfo(res);
+    return NULL;
+}
+
+// Источник задач: NUM_TASKS одинаковых задач по 8 байт, формируемых по требованию.
+static int bench_next_task(void *ctx, const char **data, size_t *size)
+{
+    static const uint64_t task = 0;
+    size_t *left = ctx;
+    if (*left == 0) {
+        return 0;
+    }
+    *data = (const char *)&task;
+    *size = sizeof(task);
+    --*left;
+    return 1;
+}
+
+// Приёмник результатов: проверяет, что результат задачи - её номер.
+struct bench_sink {
+    size_t num_results;
+    bool wrong;
+};
+
+static bool bench_on_result(void *ctx, size_t task_index, const char *data, size_t size)
+{
+    struct bench_sink *sink = ctx;
+    double value;
+    if (size != sizeof(value)) {
+        sink->wrong = true;
+        return false;
+    }
+    memcpy(&value, data, sizeof(value));
+    sink->wrong |= value != (double)task_index;
+    sink->num_results++;
+    return true;
+}
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <address> <port>\n", argv[0]);
+        return 1;
+    }
+    // Каждому узлу нужны два дескриптора: у Управляющего узла и у имитирующего потока.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    int ret = 1;
+    printf("%10s %12s %14s\n", "workers", "time, s", "tasks/s");
+    for (size_t k = 0; k < sizeof(bench_workers) / sizeof(bench_workers[0]); ++k) {
+        size_t num_workers = bench_workers[k];
+        if (2 * num_workers + 16 > limit.rlim_cur) {
+            fprintf(stderr, "Skip %lu workers: not enough file descriptors\n", num_workers);
+            continue;
+        }
+        INFO_MANAGER manager;
+        info_manager_init(&manager, argv[1], argv[2], MAX_TIME, num_workers);
+        struct bench_cluster cluster = { .addr = argv[1], .port = argv[2], .num_workers = num_workers };
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, bench_cluster_run, &cluster) != 0) {
+            printf("Unable to start workers!\n");
+            goto clear;
+        }
+        // Задачи формируются по требованию, результаты проверяются по мере поступления.
+        size_t tasks_left = NUM_TASKS;
+        TASK_SOURCE source = { .next = bench_next_task, .release = NULL, .ctx = &tasks_left };
+        struct bench_sink sink_ctx = { 0 };
+        RESULT_SINK sink = { .on_result = bench_on_result, .ctx = &sink_ctx };
+        double start = bench_now();
+        int manager_ret = start_manager_sink(&manager, &source, &sink);
+        double time = bench_now() - start;
+        pthread_join(thread, NULL);
+        if (manager_ret < 0 || cluster.ret < 0) {
+            printf("Error in start manager!\n");
+            goto clear;
+        }
+        if (sink_ctx.wrong || sink_ctx.num_results != NUM_TASKS) {
+            printf("Wrong results!\n");
+            goto clear;
+        }
+        printf("%10lu %12.3f %14.0f\n", num_workers, time, NUM_TASKS / time);
+        fflush(stdout);
+    }
+    ret = 0;
+clear:
+    return ret;
+}
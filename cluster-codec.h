@@ -0,0 +1,177 @@
+//================
+// Сжатие данных кадров (кодек CLUSTER_CODEC_LZ).
+//================
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Блок сжатых данных - последовательность записей:
+//     uint8_t token               - старшие 4 бита: количество литералов, младшие: длина совпадения - 4;
+//     [байты продолжения]         - значение 15 в поле token продолжается байтами, пока байт равен 255;
+//     литералы;
+//     uint16_t offset             - расстояние до совпадения (little-endian), отсутствует в последней записи;
+//     [байты продолжения длины совпадения].
+// Размер исходных данных передаётся отдельно, по нему распаковка определяет конец блока.
+
+// Количество разрядов хеша четырёх байт (размер таблицы поиска совпадений).
+#define CLUSTER_LZ_HASH_BITS 12
+// Наименьшая длина совпадения и наибольшее расстояние до него.
+#define CLUSTER_LZ_MIN_MATCH 4
+#define CLUSTER_LZ_MAX_OFFSET 0xFFFF
+
+// Запись длины len, не поместившейся в поле token (len >= 15), байтами продолжения.
+static inline bool cluster_lz_put_length(uint8_t *dst, size_t capacity, size_t *out, size_t len)
+{
+    len -= 15;
+    while (true) {
+        if (*out == capacity) {
+            return false;
+        }
+        if (len < 255) {
+            dst[(*out)++] = (uint8_t)len;
+            return true;
+        }
+        dst[(*out)++] = 255;
+        len -= 255;
+    }
+}
+
+// Запись литералов src[0..num_literals) и совпадения длины match_len на расстоянии offset
+// (match_len == 0 - последняя запись блока без совпадения).
+static inline bool cluster_lz_put_sequence(uint8_t *dst, size_t capacity, size_t *out, const uint8_t *literals,
+                                           size_t num_literals, size_t offset, size_t match_len)
+{
+    size_t match_code = match_len == 0 ? 0 : match_len - CLUSTER_LZ_MIN_MATCH;
+    if (*out == capacity) {
+        return false;
+    }
+    dst[(*out)++] = (uint8_t)(((num_literals < 15 ? num_literals : 15) << 4) | (match_code < 15 ? match_code : 15));
+    if (num_literals >= 15 && !cluster_lz_put_length(dst, capacity, out, num_literals)) {
+        return false;
+    }
+    if (capacity - *out < num_literals) {
+        return false;
+    }
+    memcpy(dst + *out, literals, num_literals);
+    *out += num_literals;
+    if (match_len == 0) {
+        return true;
+    }
+    if (capacity - *out < 2) {
+        return false;
+    }
+    dst[(*out)++] = (uint8_t)(offset & 0xFF);
+    dst[(*out)++] = (uint8_t)(offset >> 8);
+    return match_code < 15 || cluster_lz_put_length(dst, capacity, out, match_code);
+}
+
+// Сжатие size байт src в dst ёмкостью capacity байт.
+// Возвращает размер сжатых данных или 0, если они не помещаются в capacity (данные несжимаемы).
+static inline size_t cluster_lz_compress(const char *src, size_t size, char *dst, size_t capacity)
+{
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *out_buf = (uint8_t *)dst;
+    // Позиции последних вхождений четырёх байт по их хешу; позиции хранятся в 32 разрядах.
+    uint32_t table[1 << CLUSTER_LZ_HASH_BITS];
+    if (size == 0 || size > UINT32_MAX) {
+        return 0;
+    }
+    memset(table, 0, sizeof(table));
+    size_t out = 0;
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + CLUSTER_LZ_MIN_MATCH <= size) {
+        uint32_t seq;
+        memcpy(&seq, in + pos, sizeof(seq));
+        uint32_t hash = (seq * 2654435761U) >> (32 - CLUSTER_LZ_HASH_BITS);
+        size_t candidate = table[hash];
+        table[hash] = (uint32_t)pos;
+        if (candidate >= pos || pos - candidate > CLUSTER_LZ_MAX_OFFSET ||
+            memcmp(in + candidate, in + pos, CLUSTER_LZ_MIN_MATCH) != 0) {
+            // На несжимаемых участках шаг поиска растёт, чтобы не тратить время на каждый байт.
+            pos += 1 + ((pos - anchor) >> 6);
+            continue;
+        }
+        size_t len = CLUSTER_LZ_MIN_MATCH;
+        while (pos + len < size && in[candidate + len] == in[pos + len]) {
+            ++len;
+        }
+        if (!cluster_lz_put_sequence(out_buf, capacity, &out, in + anchor, pos - anchor, pos - candidate, len)) {
+            return 0;
+        }
+        pos += len;
+        anchor = pos;
+    }
+    if (anchor != size && !cluster_lz_put_sequence(out_buf, capacity, &out, in + anchor, size - anchor, 0, 0)) {
+        return 0;
+    }
+    return out;
+}
+
+// Чтение длины с байтами продолжения; false при выходе за пределы блока.
+static inline bool cluster_lz_get_length(const uint8_t *src, size_t size, size_t *in, size_t *len)
+{
+    uint8_t byte;
+    do {
+        if (*in == size) {
+            return false;
+        }
+        byte = src[(*in)++];
+        if (*len > SIZE_MAX - byte) {
+            return false;
+        }
+        *len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// Распаковка size байт сжатых данных src в raw_size байт dst.
+// Возвращает false, если данные повреждены (не распаковываются ровно в raw_size байт).
+static inline bool cluster_lz_decompress(const char *src, size_t size, char *dst, size_t raw_size)
+{
+    const uint8_t *in_buf = (const uint8_t *)src;
+    uint8_t *out_buf = (uint8_t *)dst;
+    size_t in = 0;
+    size_t out = 0;
+    while (in < size) {
+        uint8_t token = in_buf[in++];
+        size_t num_literals = token >> 4;
+        if (num_literals == 15 && !cluster_lz_get_length(in_buf, size, &in, &num_literals)) {
+            return false;
+        }
+        if (num_literals > size - in || num_literals > raw_size - out) {
+            return false;
+        }
+        memcpy(out_buf + out, in_buf + in, num_literals);
+        in += num_literals;
+        out += num_literals;
+        if (in == size) {
+            break;
+        }
+        if (size - in < 2) {
+            return false;
+        }
+        size_t offset = in_buf[in] | ((size_t)in_buf[in + 1] << 8);
+        in += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !cluster_lz_get_length(in_buf, size, &in, &match_len)) {
+            return false;
+        }
+        match_len += CLUSTER_LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || match_len > raw_size - out) {
+            return false;
+        }
+        // Совпадение может перекрываться с записываемыми данными, поэтому копируется побайтно.
+        const uint8_t *match = out_buf + out - offset;
+        if (offset >= match_len) {
+            memcpy(out_buf + out, match, match_len);
+        } else {
+            for (size_t i = 0; i < match_len; ++i) {
+                out_buf[out + i] = match[i];
+            }
+        }
+        out += match_len;
+    }
+    return out == raw_size;
+}
@@ -0,0 +1,72 @@
+//================
+// Гистограммы задержек статистики Управляющего и рабочих узлов.
+// Подключается из manager.h и worker.h, поэтому защищён от повторного включения.
+//================
+#ifndef CLUSTER_HISTOGRAM_H
+#define CLUSTER_HISTOGRAM_H
+#include <stddef.h>
+#include <stdio.h>
+
+//! Количество интервалов гистограмм задержек: интервал 0 - меньше 1 мкс, интервал i - от 2^(i-1)
+//! до 2^i мкс, в последний попадают и все большие значения.
+#define CLUSTER_HIST_BUCKETS 32
+
+//! Гистограмма задержек (в микросекундах).
+typedef struct
+{
+    //! Количество измерений, их сумма и наибольшее значение.
+    size_t count;
+    size_t sum_us;
+    size_t max_us;
+    //! Количество измерений в каждом интервале.
+    size_t buckets[CLUSTER_HIST_BUCKETS];
+} CLUSTER_HISTOGRAM;
+
+// Интервал гистограммы для задержки us (в микросекундах).
+static inline size_t cluster_hist_bucket(size_t us)
+{
+    size_t bucket = us == 0 ? 0 : 64 - (size_t)__builtin_clzl(us);
+    return bucket < CLUSTER_HIST_BUCKETS ? bucket : CLUSTER_HIST_BUCKETS - 1;
+}
+
+// Учёт задержки us (в микросекундах) в гистограмме.
+static inline void cluster_hist_add(CLUSTER_HISTOGRAM *hist, size_t us)
+{
+    hist->count++;
+    hist->sum_us += us;
+    if (us > hist->max_us) {
+        hist->max_us = us;
+    }
+    hist->buckets[cluster_hist_bucket(us)]++;
+}
+
+// Добавление гистограммы src к сумме dst.
+static inline void cluster_hist_merge(CLUSTER_HISTOGRAM *dst, const CLUSTER_HISTOGRAM *src)
+{
+    dst->count += src->count;
+    dst->sum_us += src->sum_us;
+    if (src->max_us > dst->max_us) {
+        dst->max_us = src->max_us;
+    }
+    for (size_t i = 0; i < CLUSTER_HIST_BUCKETS; ++i) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+// Запись гистограммы полем JSON "name":{...}.
+static inline void cluster_hist_write(FILE *file, const char *name, const CLUSTER_HISTOGRAM *hist)
+{
+    // Пустые интервалы в конце гистограммы не записываются.
+    size_t num_buckets = CLUSTER_HIST_BUCKETS;
+    while (num_buckets != 0 && hist->buckets[num_buckets - 1] == 0) {
+        --num_buckets;
+    }
+    fprintf(file, "\"%s\":{\"count\":%lu,\"sum_us\":%lu,\"max_us\":%lu,\"buckets\":[",
+            name, hist->count, hist->sum_us, hist->max_us);
+    for (size_t i = 0; i < num_buckets; ++i) {
+        fprintf(file, i == 0 ? "%lu" : ",%lu", hist->buckets[i]);
+    }
+    fprintf(file, "]}");
+}
+
+#endif
@@ -0,0 +1,135 @@
+//================
+// Формат сообщений между Управляющим и рабочими узлами.
+//================
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Подключение: рабочий узел отправляет NODE_INFO, Управляющий узел отвечает NODE_CONFIG -
+// кодеком сжатия, выбранным из поддерживаемых узлом (CLUSTER_CODEC_NONE, если сжатие не используется),
+// и способом передачи данных. При CLUSTER_TRANSPORT_SHM все дальнейшие данные идут через сегмент
+// разделяемой памяти узла (cluster-shm.h), а по сокету передаются только пробуждения.
+// По показаниям часов в NODE_CONFIG узел оценивает разность своих часов и часов Управляющего узла
+// (половина времени между отправкой NODE_INFO и получением ответа считается задержкой ответа).
+// Пакет задач (Управляющий узел -> рабочий узел):
+//     size_t num_tasks            - количество задач, 0 означает завершение работы;
+//     size_t size_data            - размер задач пакета в байтах;
+//     size_t task_ids[num_tasks]  - номера задач в исходном массиве задач;
+//     задачи в формате create_task_structure: size_t size, size байт данных.
+// Результат (рабочий узел -> Управляющий узел): RESULT_HEADER и size байт данных.
+// Если кодек выбран, в size_data и RESULT_HEADER.size может быть установлен флаг CLUSTER_COMPRESSED:
+// тогда вместо данных передаются size_t raw_size (размер исходных данных) и данные, сжатые кодеком;
+// size без флага - размер передаваемых данных вместе с raw_size.
+
+//! Кодеки сжатия данных кадров.
+#define CLUSTER_CODEC_NONE 0 //!< данные передаются без сжатия
+#define CLUSTER_CODEC_LZ 1   //!< быстрый словарный кодек (cluster-codec.h)
+//! Маска кодеков, поддерживаемых этой версией протокола (бит 1 << codec).
+#define CLUSTER_CODECS ((1UL << CLUSTER_CODEC_NONE) | (1UL << CLUSTER_CODEC_LZ))
+//! Флаг сжатых данных в размере пакета задач или результата.
+#define CLUSTER_COMPRESSED (1UL << 63)
+//! Данные меньшего размера (в байтах) не сжимаются: выигрыш не окупает затрат.
+#define CLUSTER_CODEC_MIN_SIZE 256
+
+//! Способы передачи данных после подключения.
+#define CLUSTER_TRANSPORT_SOCKET 0 //!< данные передаются через сокет соединения
+#define CLUSTER_TRANSPORT_SHM 1    //!< данные передаются через разделяемую память узла
+
+//! Наибольшая длина имени сегмента разделяемой памяти (вместе с завершающим нулём).
+#define CLUSTER_SHM_NAME_SIZE 64
+
+//! Информация о рабочем узле, передаваемая при подключении.
+typedef struct
+{
+    //! Количество ядер узла.
+    size_t n_cores;
+    //! Маска поддерживаемых кодеков сжатия (бит 1 << codec).
+    size_t codecs;
+    //! Проверочное число сегмента разделяемой памяти узла.
+    uint64_t shm_nonce;
+    //! Имя сегмента разделяемой памяти, созданного узлом ("" - узел не предлагает разделяемую память).
+    char shm_name[CLUSTER_SHM_NAME_SIZE];
+} NODE_INFO;
+
+//! Параметры соединения, выбранные Управляющим узлом (ответ на NODE_INFO).
+typedef struct
+{
+    //! Кодек сжатия данных кадров.
+    size_t codec;
+    //! Способ передачи данных (CLUSTER_TRANSPORT_SOCKET или CLUSTER_TRANSPORT_SHM).
+    size_t transport;
+    //! Номер узла в порядке подключения к сессии Управляющего узла.
+    size_t node_id;
+    //! Часы Управляющего узла (CLOCK_MONOTONIC в микросекундах) при отправке ответа.
+    uint64_t clock_us;
+} NODE_CONFIG;
+
+//! Заголовок кадра с результатом одной задачи (рабочий узел -> Управляющий узел).
+typedef struct
+{
+    //! Номер задачи в исходном массиве задач (из task_ids пакета).
+    size_t task_id;
+    //! Размер результата в байтах, следующего сразу за заголовком.
+    size_t size;
+} RESULT_HEADER;
+
+// Сдвиг iov на bytes уже отправленных байт.
+static inline void cluster_iov_advance(struct iovec **iov, size_t *iovcnt, size_t bytes)
+{
+    while (*iovcnt != 0 && bytes >= (*iov)->iov_len) {
+        bytes -= (*iov)->iov_len;
+        ++*iov;
+        --*iovcnt;
+    }
+    if (*iovcnt != 0) {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + bytes;
+        (*iov)->iov_len -= bytes;
+    }
+}
+
+// Отправка данных iov без блокировки: отправляется столько, сколько помещается в буфер сокета,
+// iov и iovcnt указывают на неотправленный остаток. flags добавляются к флагам sendmsg (например, MSG_ZEROCOPY).
+// Возвращает false только при ошибке соединения.
+static inline bool cluster_sendv_some(int fd, struct iovec **iov, size_t *iovcnt, int flags)
+{
+    while (*iovcnt != 0) {
+        struct msghdr msg = {
+            .msg_iov = *iov,
+            .msg_iovlen = *iovcnt < IOV_MAX ? *iovcnt : IOV_MAX,
+        };
+        ssize_t bytes_written = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | flags);
+        if (bytes_written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        cluster_iov_advance(iov, iovcnt, (size_t)bytes_written);
+    }
+    return true;
+}
+
+// Отправка всех данных iov с учётом частичной записи; SIGPIPE при разрыве соединения не возникает.
+static inline bool cluster_sendv_all(int fd, struct iovec *iov, size_t iovcnt)
+{
+    while (iovcnt != 0) {
+        struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX,
+        };
+        ssize_t bytes_written = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (bytes_written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        cluster_iov_advance(&iov, &iovcnt, (size_t)bytes_written);
+    }
+    return true;
+}
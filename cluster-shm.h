@@ -0,0 +1,398 @@
+//================
+// Передача данных через разделяемую память (рабочий узел на одном хосте с Управляющим узлом).
+// Подключается после cluster-protocol.h.
+//================
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/random.h>
+#include <sys/uio.h>
+#include <linux/futex.h>
+
+// Сегмент создаёт рабочий узел и передаёт его имя в NODE_INFO. Управляющий узел открывает сегмент
+// (это удаётся, только если узлы работают на одном хосте) и отвечает CLUSTER_TRANSPORT_SHM.
+// Дальше пакеты задач и результаты в прежнем формате идут через два кольцевых буфера сегмента
+// с одним производителем и одним потребителем; TCP-соединение остаётся для пробуждения стороны,
+// ожидающей в poll/epoll, и для обнаружения разрыва. Сторона, ожидающая в блокирующем вызове,
+// спит на futex в самом сегменте.
+
+//! Признак сегмента.
+#define CLUSTER_SHM_MAGIC 0x434c55535445524dUL
+//! Размер кольцевого буфера одного направления в байтах (степень двойки).
+#define CLUSTER_SHM_RING_SIZE (1UL << 22)
+//! Смещение данных колец от начала сегмента.
+#define CLUSTER_SHM_DATA_OFFSET 4096
+//! Размер строки кэша, по которому разделены поля сторон кольца.
+#define CLUSTER_SHM_CACHE_LINE 64
+//! Период проверки соединения при ожидании на futex (в миллисекундах).
+#define CLUSTER_SHM_CHECK_MS 100
+
+//! Способ ожидания стороны кольца.
+#define CLUSTER_SHM_AWAKE 0       //!< сторона не ждёт
+#define CLUSTER_SHM_WAIT_SOCKET 1 //!< ждёт данных на сокете: будится байтом, отправленным по сокету
+#define CLUSTER_SHM_WAIT_FUTEX 2  //!< спит на futex поля ожидания
+
+//! Управляющие поля кольцевого буфера; поля сторон лежат в разных строках кэша.
+typedef struct
+{
+    //! Количество записанных байт (пишет производитель).
+    _Alignas(CLUSTER_SHM_CACHE_LINE) _Atomic size_t head;
+    //! Способ ожидания производителем свободного места.
+    _Atomic uint32_t producer_waiting;
+    //! Количество прочитанных байт (пишет потребитель).
+    _Alignas(CLUSTER_SHM_CACHE_LINE) _Atomic size_t tail;
+    //! Способ ожидания потребителем новых данных.
+    _Atomic uint32_t consumer_waiting;
+} CLUSTER_SHM_RING;
+
+//! Заголовок сегмента; данные колец следуют с CLUSTER_SHM_DATA_OFFSET.
+typedef struct
+{
+    uint64_t magic;
+    //! Случайное число из NODE_INFO: подтверждает, что открыт сегмент именно этого узла.
+    uint64_t nonce;
+    //! Размер кольцевого буфера одного направления.
+    uint64_t ring_size;
+    //! rings[0]: Управляющий узел -> рабочий узел, rings[1]: рабочий узел -> Управляющий узел.
+    CLUSTER_SHM_RING rings[2];
+} CLUSTER_SHM_HEADER;
+
+_Static_assert(sizeof(CLUSTER_SHM_HEADER) <= CLUSTER_SHM_DATA_OFFSET, "Shared memory header is too large");
+
+//! Сторона соединения через разделяемую память.
+typedef struct CLUSTER_SHM
+{
+    //! Отображённый сегмент и его размер.
+    CLUSTER_SHM_HEADER *header;
+    size_t map_size;
+    //! Кольцо исходящих данных и кольцо входящих данных этой стороны.
+    CLUSTER_SHM_RING *tx;
+    char *tx_data;
+    CLUSTER_SHM_RING *rx;
+    char *rx_data;
+    size_t ring_size;
+    //! Сокет соединения: по нему передаются пробуждения и обнаруживается разрыв.
+    int sock;
+} CLUSTER_SHM;
+
+// Размер сегмента с кольцами по ring_size байт.
+static inline size_t cluster_shm_map_size(size_t ring_size)
+{
+    return CLUSTER_SHM_DATA_OFFSET + 2 * ring_size;
+}
+
+// Назначение колец стороне: Управляющий узел пишет в rings[0], рабочий узел - в rings[1].
+static inline void cluster_shm_bind(CLUSTER_SHM *shm, bool manager)
+{
+    char *data = (char *)shm->header + CLUSTER_SHM_DATA_OFFSET;
+    size_t tx = manager ? 0 : 1;
+    shm->ring_size = shm->header->ring_size;
+    shm->tx = &shm->header->rings[tx];
+    shm->tx_data = data + tx * shm->ring_size;
+    shm->rx = &shm->header->rings[1 - tx];
+    shm->rx_data = data + (1 - tx) * shm->ring_size;
+}
+
+// Создание сегмента рабочим узлом. Имя сегмента записывается в name (name_size байт), проверочное
+// число - в *nonce. Сегмент должен быть удалён shm_unlink после ответа Управляющего узла.
+static inline bool cluster_shm_create(CLUSTER_SHM *shm, char *name, size_t name_size, uint64_t *nonce)
+{
+    if (getrandom(nonce, sizeof(*nonce), GRND_NONBLOCK) != sizeof(*nonce)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        *nonce = ((uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec) ^ ((uint64_t)getpid() << 32);
+    }
+    snprintf(name, name_size, "/cluster-%d-%016lx", (int)getpid(), *nonce);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return false;
+    }
+    shm->map_size = cluster_shm_map_size(CLUSTER_SHM_RING_SIZE);
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, shm->map_size) == 0) {
+        map = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        shm_unlink(name);
+        return false;
+    }
+    // Новый сегмент заполнен нулями: кольца пусты, стороны не ждут.
+    shm->header = map;
+    shm->header->magic = CLUSTER_SHM_MAGIC;
+    shm->header->nonce = *nonce;
+    shm->header->ring_size = CLUSTER_SHM_RING_SIZE;
+    cluster_shm_bind(shm, false);
+    shm->sock = -1;
+    return true;
+}
+
+// Открытие сегмента рабочего узла Управляющим узлом. false - сегмент недоступен (узел на другом хосте)
+// или не совпадает с описанием узла.
+static inline bool cluster_shm_attach(CLUSTER_SHM *shm, const char *name, uint64_t nonce)
+{
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat st;
+    shm->map_size = cluster_shm_map_size(CLUSTER_SHM_RING_SIZE);
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size == shm->map_size) {
+        map = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    shm->header = map;
+    if (shm->header->magic != CLUSTER_SHM_MAGIC || shm->header->nonce != nonce ||
+        shm->header->ring_size != CLUSTER_SHM_RING_SIZE) {
+        munmap(map, shm->map_size);
+        shm->header = NULL;
+        return false;
+    }
+    cluster_shm_bind(shm, true);
+    shm->sock = -1;
+    return true;
+}
+
+static inline void cluster_shm_detach(CLUSTER_SHM *shm)
+{
+    if (shm->header != NULL) {
+        munmap(shm->header, shm->map_size);
+        shm->header = NULL;
+    }
+}
+
+// Приём байтов пробуждения из сокета. Возвращает false, если другая сторона закрыла соединение.
+static inline bool cluster_shm_drain(int sock)
+{
+    char buf[64];
+    while (true) {
+        ssize_t bytes_read = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+        if (bytes_read > 0) {
+            continue;
+        }
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        return bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+}
+
+// Пробуждение стороны, ожидающей способом, записанным в *waiting.
+// Вызывается после публикации head или tail: барьер упорядочивает публикацию и чтение *waiting
+// так же, как ожидающая сторона упорядочивает запись *waiting и повторную проверку кольца.
+static inline void cluster_shm_wake(CLUSTER_SHM *shm, _Atomic uint32_t *waiting)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed) == CLUSTER_SHM_AWAKE) {
+        return;
+    }
+    uint32_t mode = atomic_exchange_explicit(waiting, CLUSTER_SHM_AWAKE, memory_order_relaxed);
+    if (mode == CLUSTER_SHM_WAIT_SOCKET) {
+        // Если буфер сокета полон, в нём уже есть непрочитанные пробуждения.
+        char byte = 0;
+        send(shm->sock, &byte, sizeof(byte), MSG_NOSIGNAL | MSG_DONTWAIT);
+    } else if (mode == CLUSTER_SHM_WAIT_FUTEX) {
+        syscall(SYS_futex, (uint32_t *)waiting, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+// Сон на futex поля *waiting. Возвращает false, если за время ожидания другая сторона закрыла соединение.
+static inline bool cluster_shm_sleep(CLUSTER_SHM *shm, _Atomic uint32_t *waiting)
+{
+    struct timespec timeout = { .tv_sec = 0, .tv_nsec = CLUSTER_SHM_CHECK_MS * 1000000L };
+    if (syscall(SYS_futex, (uint32_t *)waiting, FUTEX_WAIT, CLUSTER_SHM_WAIT_FUTEX, &timeout, NULL, 0) == -1 &&
+        errno == ETIMEDOUT) {
+        return cluster_shm_drain(shm->sock);
+    }
+    return true;
+}
+
+// Проверка наличия данных во входящем кольце. Если данных нет и mode != CLUSTER_SHM_AWAKE,
+// сторона отмечается ожидающей способом mode: появление данных её разбудит.
+static inline bool cluster_shm_rx_ready(CLUSTER_SHM *shm, uint32_t mode)
+{
+    CLUSTER_SHM_RING *ring = shm->rx;
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (atomic_load_explicit(&ring->head, memory_order_acquire) != tail) {
+        return true;
+    }
+    if (mode == CLUSTER_SHM_AWAKE) {
+        return false;
+    }
+    atomic_store_explicit(&ring->consumer_waiting, mode, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+        return false;
+    }
+    atomic_store_explicit(&ring->consumer_waiting, CLUSTER_SHM_AWAKE, memory_order_relaxed);
+    return true;
+}
+
+// Проверка наличия места в исходящем кольце; ожидание отмечается так же, как в cluster_shm_rx_ready.
+static inline bool cluster_shm_tx_ready(CLUSTER_SHM *shm, uint32_t mode)
+{
+    CLUSTER_SHM_RING *ring = shm->tx;
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) < shm->ring_size) {
+        return true;
+    }
+    if (mode == CLUSTER_SHM_AWAKE) {
+        return false;
+    }
+    atomic_store_explicit(&ring->producer_waiting, mode, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= shm->ring_size) {
+        return false;
+    }
+    atomic_store_explicit(&ring->producer_waiting, CLUSTER_SHM_AWAKE, memory_order_relaxed);
+    return true;
+}
+
+// Запись в исходящее кольцо данных iov, сколько помещается; iov и iovcnt указывают на остаток.
+// Возвращает false, если управляющие поля кольца повреждены.
+static inline bool cluster_shm_write(CLUSTER_SHM *shm, struct iovec **iov, size_t *iovcnt)
+{
+    CLUSTER_SHM_RING *ring = shm->tx;
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t used = head - atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (used > shm->ring_size) {
+        return false;
+    }
+    size_t space = shm->ring_size - used;
+    size_t written = 0;
+    while (*iovcnt != 0 && space != 0) {
+        size_t len = (*iov)->iov_len < space ? (*iov)->iov_len : space;
+        size_t offset = (head + written) & (shm->ring_size - 1);
+        size_t first = shm->ring_size - offset < len ? shm->ring_size - offset : len;
+        memcpy(shm->tx_data + offset, (*iov)->iov_base, first);
+        memcpy(shm->tx_data, (char *)(*iov)->iov_base + first, len - first);
+        written += len;
+        space -= len;
+        cluster_iov_advance(iov, iovcnt, len);
+    }
+    if (written != 0) {
+        atomic_store_explicit(&ring->head, head + written, memory_order_release);
+        cluster_shm_wake(shm, &ring->consumer_waiting);
+    }
+    return true;
+}
+
+// Чтение из входящего кольца не более len байт; *bytes_read - количество прочитанных байт.
+// Возвращает false, если управляющие поля кольца повреждены.
+static inline bool cluster_shm_read(CLUSTER_SHM *shm, char *buf, size_t len, size_t *bytes_read)
+{
+    CLUSTER_SHM_RING *ring = shm->rx;
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t avail = atomic_load_explicit(&ring->head, memory_order_acquire) - tail;
+    if (avail > shm->ring_size) {
+        return false;
+    }
+    *bytes_read = avail < len ? avail : len;
+    if (*bytes_read == 0) {
+        return true;
+    }
+    size_t offset = tail & (shm->ring_size - 1);
+    size_t first = shm->ring_size - offset < *bytes_read ? shm->ring_size - offset : *bytes_read;
+    memcpy(buf, shm->rx_data + offset, first);
+    memcpy(buf + first, shm->rx_data, *bytes_read - first);
+    atomic_store_explicit(&ring->tail, tail + *bytes_read, memory_order_release);
+    cluster_shm_wake(shm, &ring->producer_waiting);
+    return true;
+}
+
+// Отправка без блокировки (аналог cluster_sendv_some): если место в кольце кончилось,
+// сторона ждёт его освобождения на сокете. Возвращает false, если кольцо повреждено.
+static inline bool cluster_shm_sendv_some(CLUSTER_SHM *shm, struct iovec **iov, size_t *iovcnt)
+{
+    while (true) {
+        if (!cluster_shm_write(shm, iov, iovcnt)) {
+            errno = EPROTO;
+            return false;
+        }
+        if (*iovcnt == 0 || !cluster_shm_tx_ready(shm, CLUSTER_SHM_WAIT_SOCKET)) {
+            return true;
+        }
+    }
+}
+
+// Приём без блокировки (аналог recv с MSG_DONTWAIT): если данных нет, сторона ждёт их на сокете.
+// Закрытие соединения (0) сообщается только после того, как прочитаны все данные кольца.
+static inline ssize_t cluster_shm_recv_some(CLUSTER_SHM *shm, char *buf, size_t len)
+{
+    size_t bytes_read;
+    if (!cluster_shm_read(shm, buf, len, &bytes_read)) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (bytes_read != 0) {
+        return bytes_read;
+    }
+    // Пробуждения принимаются до отметки ожидания: пробуждение, отправленное после неё, не теряется.
+    bool closed = !cluster_shm_drain(shm->sock);
+    if (cluster_shm_rx_ready(shm, CLUSTER_SHM_WAIT_SOCKET)) {
+        if (!cluster_shm_read(shm, buf, len, &bytes_read)) {
+            errno = EPROTO;
+            return -1;
+        }
+        return bytes_read;
+    }
+    if (closed) {
+        return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+// Отправка всех данных iov с ожиданием места на futex (аналог cluster_sendv_all).
+static inline bool cluster_shm_sendv_all(CLUSTER_SHM *shm, struct iovec *iov, size_t iovcnt)
+{
+    while (true) {
+        if (!cluster_shm_write(shm, &iov, &iovcnt)) {
+            errno = EPROTO;
+            return false;
+        }
+        if (iovcnt == 0) {
+            return true;
+        }
+        if (!cluster_shm_tx_ready(shm, CLUSTER_SHM_WAIT_FUTEX) && !cluster_shm_sleep(shm, &shm->tx->producer_waiting)) {
+            errno = EPIPE;
+            return false;
+        }
+    }
+}
+
+// Приём size байт с ожиданием данных на futex.
+static inline bool cluster_shm_recv_all(CLUSTER_SHM *shm, char *buf, size_t size)
+{
+    while (size != 0) {
+        size_t bytes_read;
+        if (!cluster_shm_read(shm, buf, size, &bytes_read)) {
+            errno = EPROTO;
+            return false;
+        }
+        buf += bytes_read;
+        size -= bytes_read;
+        if (size != 0 && bytes_read == 0 && !cluster_shm_rx_ready(shm, CLUSTER_SHM_WAIT_FUTEX) &&
+            !cluster_shm_sleep(shm, &shm->rx->consumer_waiting)) {
+            errno = EPIPE;
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,230 @@
+//================
+// Трассировка выполнения в формате Chrome trace-event (chrome://tracing, ui.perfetto.dev).
+//================
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// Каждый поток записывает события в собственный буфер без блокировок: буфер потока регистрируется
+// в трассировке один раз (атомарной вставкой в список), дальше его изменяет только этот поток.
+// Буферы читаются при записи файла, когда потоки, писавшие события, уже остановлены.
+// Время событий - CLOCK_MONOTONIC в микросекундах. Рабочий узел при подключении оценивает разность
+// своих часов и часов Управляющего узла и записывает события уже по часам Управляющего узла,
+// поэтому файлы узлов кластера объединяются слиянием массивов traceEvents, например:
+//     jq -s '{traceEvents: map(.traceEvents) | add}' manager.json worker-*.json > cluster.json
+
+//! Количество событий в одном блоке буфера потока.
+#define CLUSTER_TRACE_BLOCK_EVENTS 4096
+//! Наибольшая длина имени потока (вместе с завершающим нулём).
+#define CLUSTER_TRACE_NAME_SIZE 32
+
+//! Интервал выполнения (событие "X"): имя и имена аргументов - строковые константы.
+typedef struct
+{
+    const char *name;
+    uint64_t start_us;
+    uint64_t duration_us;
+    //! Не более двух числовых аргументов (имя NULL - аргумента нет).
+    const char *arg_names[2];
+    uint64_t args[2];
+} CLUSTER_TRACE_EVENT;
+
+typedef struct CLUSTER_TRACE_BLOCK
+{
+    struct CLUSTER_TRACE_BLOCK *next;
+    size_t count;
+    CLUSTER_TRACE_EVENT events[CLUSTER_TRACE_BLOCK_EVENTS];
+} CLUSTER_TRACE_BLOCK;
+
+//! Буфер событий одного потока.
+typedef struct CLUSTER_TRACE_THREAD
+{
+    struct CLUSTER_TRACE_THREAD *next;
+    long tid;
+    char name[CLUSTER_TRACE_NAME_SIZE];
+    CLUSTER_TRACE_BLOCK *first;
+    CLUSTER_TRACE_BLOCK *last;
+    //! Количество событий, потерянных из-за нехватки памяти.
+    size_t dropped;
+} CLUSTER_TRACE_THREAD;
+
+typedef struct CLUSTER_TRACE
+{
+    //! Уникальный номер трассировки: по нему поток находит свой буфер.
+    uint64_t id;
+    //! Буферы потоков, писавших события.
+    _Atomic(CLUSTER_TRACE_THREAD *) threads;
+} CLUSTER_TRACE;
+
+static _Atomic uint64_t cluster_trace_next_id = 1;
+
+// Буфер текущего потока в трассировке trace_id.
+static _Thread_local struct
+{
+    uint64_t trace_id;
+    CLUSTER_TRACE_THREAD *thread;
+} cluster_trace_local;
+
+static inline uint64_t cluster_trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// Начало интервала: текущее время или 0, если трассировка выключена (trace == NULL).
+static inline uint64_t cluster_trace_begin(const CLUSTER_TRACE *trace)
+{
+    return trace != NULL ? cluster_trace_now() : 0;
+}
+
+static inline CLUSTER_TRACE *cluster_trace_create(void)
+{
+    CLUSTER_TRACE *trace = calloc(1, sizeof(*trace));
+    if (trace == NULL) {
+        fprintf(stderr, "[cluster_trace_create] No memory for trace\n");
+        return NULL;
+    }
+    trace->id = atomic_fetch_add(&cluster_trace_next_id, 1);
+    atomic_init(&trace->threads, NULL);
+    return trace;
+}
+
+// Буфер текущего потока; при первом обращении потока он создаётся и регистрируется в трассировке.
+// NULL при нехватке памяти.
+static inline CLUSTER_TRACE_THREAD *cluster_trace_thread(CLUSTER_TRACE *trace)
+{
+    if (cluster_trace_local.trace_id == trace->id) {
+        return cluster_trace_local.thread;
+    }
+    CLUSTER_TRACE_THREAD *thread = calloc(1, sizeof(*thread));
+    if (thread == NULL) {
+        return NULL;
+    }
+    thread->tid = syscall(SYS_gettid);
+    thread->next = atomic_load_explicit(&trace->threads, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&trace->threads, &thread->next, thread,
+                                                  memory_order_release, memory_order_relaxed));
+    cluster_trace_local.trace_id = trace->id;
+    cluster_trace_local.thread = thread;
+    return thread;
+}
+
+// Имя текущего потока в трассировке.
+static inline void cluster_trace_name_thread(CLUSTER_TRACE *trace, const char *name)
+{
+    CLUSTER_TRACE_THREAD *thread = trace != NULL ? cluster_trace_thread(trace) : NULL;
+    if (thread != NULL) {
+        snprintf(thread->name, sizeof(thread->name), "%s", name);
+    }
+}
+
+// Запись интервала name от start_us (результат cluster_trace_begin) до текущего момента
+// с аргументами arg0 и arg1 (имя NULL - аргумент не записывается).
+static inline void cluster_trace_span(CLUSTER_TRACE *trace, const char *name, uint64_t start_us,
+                                      const char *arg0, uint64_t value0, const char *arg1, uint64_t value1)
+{
+    if (trace == NULL) {
+        return;
+    }
+    uint64_t end_us = cluster_trace_now();
+    CLUSTER_TRACE_THREAD *thread = cluster_trace_thread(trace);
+    if (thread == NULL) {
+        return;
+    }
+    CLUSTER_TRACE_BLOCK *block = thread->last;
+    if (block == NULL || block->count == CLUSTER_TRACE_BLOCK_EVENTS) {
+        block = malloc(sizeof(*block));
+        if (block == NULL) {
+            thread->dropped++;
+            return;
+        }
+        block->next = NULL;
+        block->count = 0;
+        if (thread->last != NULL) {
+            thread->last->next = block;
+        } else {
+            thread->first = block;
+        }
+        thread->last = block;
+    }
+    CLUSTER_TRACE_EVENT *event = &block->events[block->count++];
+    event->name = name;
+    event->start_us = start_us;
+    event->duration_us = end_us > start_us ? end_us - start_us : 0;
+    event->arg_names[0] = arg0;
+    event->args[0] = value0;
+    event->arg_names[1] = arg1;
+    event->args[1] = value1;
+}
+
+// Запись трассировки в файл path (файл перезаписывается). События процесса pid с именем process_name
+// сдвигаются на offset_us микросекунд (разность часов Управляющего узла и этого узла).
+// Вызывается, когда потоки, писавшие события, уже не работают с трассировкой.
+static inline bool cluster_trace_write(CLUSTER_TRACE *trace, const char *path, int pid, const char *process_name,
+                                       int64_t offset_us)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "[cluster_trace_write] Unable to open %s\n", path);
+        return false;
+    }
+    size_t dropped = 0;
+    CLUSTER_TRACE_THREAD *threads = atomic_load_explicit(&trace->threads, memory_order_acquire);
+    for (CLUSTER_TRACE_THREAD *thread = threads; thread != NULL; thread = thread->next) {
+        dropped += thread->dropped;
+    }
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"clock_offset_us\":%ld,\"dropped_events\":%lu},\n"
+            "\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"%s\"}}",
+            (long)offset_us, dropped, pid, process_name);
+    for (CLUSTER_TRACE_THREAD *thread = threads; thread != NULL; thread = thread->next) {
+        if (thread->name[0] != '\0') {
+            fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"%s\"}}",
+                    pid, thread->tid, thread->name);
+        }
+        for (CLUSTER_TRACE_BLOCK *block = thread->first; block != NULL; block = block->next) {
+            for (size_t i = 0; i < block->count; ++i) {
+                const CLUSTER_TRACE_EVENT *event = &block->events[i];
+                fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,\"ts\":%ld,\"dur\":%lu,\"args\":{",
+                        event->name, pid, thread->tid, (long)((int64_t)event->start_us + offset_us), event->duration_us);
+                for (size_t arg = 0; arg < 2 && event->arg_names[arg] != NULL; ++arg) {
+                    fprintf(file, arg == 0 ? "\"%s\":%lu" : ",\"%s\":%lu", event->arg_names[arg], event->args[arg]);
+                }
+                fprintf(file, "}}");
+            }
+        }
+    }
+    fprintf(file, "\n]}\n");
+    if (fclose(file) != 0) {
+        fprintf(stderr, "[cluster_trace_write] Unable to write %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+static inline void cluster_trace_destroy(CLUSTER_TRACE *trace)
+{
+    if (trace == NULL) {
+        return;
+    }
+    CLUSTER_TRACE_THREAD *thread = atomic_load_explicit(&trace->threads, memory_order_acquire);
+    while (thread != NULL) {
+        CLUSTER_TRACE_THREAD *next_thread = thread->next;
+        CLUSTER_TRACE_BLOCK *block = thread->first;
+        while (block != NULL) {
+            CLUSTER_TRACE_BLOCK *next_block = block->next;
+            free(block);
+            block = next_block;
+        }
+        free(thread);
+        thread = next_thread;
+    }
+    free(trace);
+}
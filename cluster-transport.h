@@ -0,0 +1,388 @@
+//================
+// Транспорты соединений между Управляющим и рабочими узлами.
+// Подключается после cluster-protocol.h.
+//================
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+
+// Транспорт выбирается по строке адреса:
+//     "unix:/path/to/socket"  - потоковый сокет AF_UNIX в файловой системе (порт не используется);
+//     "unix:@name"            - сокет AF_UNIX в абстрактном пространстве имён;
+//     "tcp:host", "host"      - TCP, host - имя узла, адрес IPv4 или IPv6 (можно в скобках: "[::1]").
+// Транспорт отвечает за создание и настройку сокетов; данные по сокетам всех транспортов
+// передаются в одном формате (cluster-protocol.h).
+
+//! Префиксы строки адреса.
+#define CLUSTER_UNIX_PREFIX "unix:"
+#define CLUSTER_TCP_PREFIX "tcp:"
+
+//! Операции транспорта.
+typedef struct CLUSTER_TRANSPORT
+{
+    //! Название транспорта для сообщений.
+    const char *name;
+    //! Неблокирующий слушающий сокет на адресе addr с очередью подключений backlog; -1 при ошибке.
+    int (*listen)(const struct sockaddr *addr, socklen_t addr_len, int backlog);
+    //! Приём подключения: неблокирующий сокет соединения или -1 (errno EAGAIN - подключений больше нет,
+    //! ECONNABORTED - подключение принято, но не настроено, и уже закрыто).
+    int (*accept)(int listen_fd);
+    //! Подключение к адресу addr: блокирующий сокет соединения или -1.
+    int (*connect)(const struct sockaddr *addr, socklen_t addr_len);
+    //! Отправка без блокировки (см. cluster_sendv_some).
+    bool (*sendv_some)(int fd, struct iovec **iov, size_t *iovcnt, int flags);
+    //! Отправка всех данных (см. cluster_sendv_all).
+    bool (*sendv_all)(int fd, struct iovec *iov, size_t iovcnt);
+    //! Приём данных (как recv).
+    ssize_t (*recv)(int fd, void *buf, size_t len, int flags);
+    //! Закрытие сокета; для слушающего сокета передаётся его адрес (иначе addr == NULL).
+    int (*close)(int fd, const struct sockaddr *addr, socklen_t addr_len);
+    //! Разрешение передачи без копирования (MSG_ZEROCOPY) для сокета соединения;
+    //! false, если транспорт или ядро её не поддерживают.
+    bool (*zerocopy_enable)(int fd);
+    //! Один вызов отправки без блокировки и без копирования данных iov (результат - как у sendmsg).
+    //! Каждый вызов, отправивший данные, получает очередной номер уведомления о завершении
+    //! (нумерация с 0 для каждого сокета); до уведомления ядро может читать отправленные данные.
+    ssize_t (*zerocopy_send)(int fd, const struct iovec *iov, size_t iovcnt);
+    //! Чтение одного уведомления о завершении отправок без копирования из очереди ошибок сокета:
+    //! 1 - отправки с номерами до *done (не включая) завершены, *copied - ядро скопировало данные;
+    //! 0 - уведомлений нет; -1 - ошибка соединения.
+    int (*zerocopy_completion)(int fd, uint32_t *done, bool *copied);
+} CLUSTER_TRANSPORT;
+
+// Настройка сокета TCP-соединения: данные отправляются без задержки, разрыв обнаруживается Keep-Alive.
+static inline bool cluster_tcp_setup(int fd)
+{
+    // Результаты, завершившиеся в разное время, отправляются сразу: при крупных пакетах задач
+    // Управляющий узел не отвечает на каждый результат, и алгоритм Нейгла задерживал бы их до подтверждения.
+    int setsockopt_arg = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &setsockopt_arg, sizeof(setsockopt_arg)) == -1) {
+        fprintf(stderr, "[cluster_tcp_setup] Unable to enable TCP_NODELAY socket option\n");
+        return false;
+    }
+    setsockopt_arg = 0;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &setsockopt_arg, sizeof(setsockopt_arg)) == -1) {
+        fprintf(stderr, "[cluster_tcp_setup] Unable to disable TCP_CORK socket option\n");
+        return false;
+    }
+    setsockopt_arg = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &setsockopt_arg, sizeof(setsockopt_arg)) == -1) {
+        fprintf(stderr, "[cluster_tcp_setup] Unable to enable TCP Keep-Alive socket option\n");
+        return false;
+    }
+    setsockopt_arg = 5;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &setsockopt_arg, sizeof(setsockopt_arg)) == -1) {
+        fprintf(stderr, "[cluster_tcp_setup] Unable to enable TCP KeepIdle socket option\n");
+        return false;
+    }
+    setsockopt_arg = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &setsockopt_arg, sizeof(setsockopt_arg)) == -1) {
+        fprintf(stderr, "[cluster_tcp_setup] Unable to enable TCP KeepINTVL socket option\n");
+        return false;
+    }
+    setsockopt_arg = 3;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &setsockopt_arg, sizeof(setsockopt_arg)) == -1) {
+        fprintf(stderr, "[cluster_tcp_setup] Unable to enable TCP TCP_KEEPCNT socket option\n");
+        return false;
+    }
+    return true;
+}
+
+// Слушающий сокет потокового транспорта; reuse_addr - разрешить повторное использование адреса TCP.
+static inline int cluster_stream_listen(const struct sockaddr *addr, socklen_t addr_len, int backlog, bool reuse_addr)
+{
+    int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        fprintf(stderr, "[cluster_stream_listen] Unable to create socket!\n");
+        return -1;
+    }
+    // Запрещаем перевод слушающего сокета в состояние TIME_WAIT.
+    int setsockopt_yes = 1;
+    if (reuse_addr && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &setsockopt_yes, sizeof(setsockopt_yes)) == -1) {
+        fprintf(stderr, "[cluster_stream_listen] Unable to set SO_REUSEADDR socket option\n");
+        goto error_close;
+    }
+    if (bind(fd, addr, addr_len) == -1) {
+        fprintf(stderr, "[cluster_stream_listen] Unable to bind\n");
+        goto error_close;
+    }
+    // Активируем очередь запросов на подключение.
+    if (listen(fd, backlog) == -1) {
+        fprintf(stderr, "[cluster_stream_listen] Unable to listen() on a socket\n");
+        goto error_close;
+    }
+    return fd;
+error_close:
+    close(fd);
+    return -1;
+}
+
+// Подключение потокового сокета к адресу addr.
+static inline int cluster_stream_connect(const struct sockaddr *addr, socklen_t addr_len)
+{
+    int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, addr, addr_len) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static inline int cluster_tcp_listen(const struct sockaddr *addr, socklen_t addr_len, int backlog)
+{
+    return cluster_stream_listen(addr, addr_len, backlog, true);
+}
+
+static inline int cluster_tcp_accept(int listen_fd)
+{
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd != -1 && !cluster_tcp_setup(fd)) {
+        close(fd);
+        errno = ECONNABORTED;
+        return -1;
+    }
+    return fd;
+}
+
+static inline int cluster_tcp_connect(const struct sockaddr *addr, socklen_t addr_len)
+{
+    int fd = cluster_stream_connect(addr, addr_len);
+    if (fd != -1 && !cluster_tcp_setup(fd)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static inline bool cluster_tcp_zerocopy_enable(int fd)
+{
+    int setsockopt_arg = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &setsockopt_arg, sizeof(setsockopt_arg)) == 0;
+}
+
+static inline ssize_t cluster_tcp_zerocopy_send(int fd, const struct iovec *iov, size_t iovcnt)
+{
+    struct msghdr msg = {
+        .msg_iov = (struct iovec *)iov,
+        .msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX,
+    };
+    return sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | MSG_ZEROCOPY);
+}
+
+static inline int cluster_tcp_zerocopy_completion(int fd, uint32_t *done, bool *copied)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    struct msghdr msg = {
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    while (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+        if (errno != EINTR) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+            !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+            continue;
+        }
+        struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+        if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) {
+            return -1;
+        }
+        // Уведомление сообщает о завершении отправок с номерами ee_info..ee_data.
+        *done = err->ee_data + 1;
+        *copied = (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+        return 1;
+    }
+    return -1;
+}
+
+// Сокеты AF_UNIX не поддерживают MSG_ZEROCOPY: данные всегда копируются.
+static inline bool cluster_unix_zerocopy_enable(int fd)
+{
+    (void)fd;
+    return false;
+}
+
+static inline ssize_t cluster_unix_zerocopy_send(int fd, const struct iovec *iov, size_t iovcnt)
+{
+    (void)fd;
+    (void)iov;
+    (void)iovcnt;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+static inline int cluster_unix_zerocopy_completion(int fd, uint32_t *done, bool *copied)
+{
+    (void)fd;
+    (void)done;
+    (void)copied;
+    return 0;
+}
+
+static inline ssize_t cluster_stream_recv(int fd, void *buf, size_t len, int flags)
+{
+    return recv(fd, buf, len, flags);
+}
+
+static inline int cluster_stream_close(int fd, const struct sockaddr *addr, socklen_t addr_len)
+{
+    (void)addr;
+    (void)addr_len;
+    return close(fd);
+}
+
+// Сокет AF_UNIX из адреса addr находится в файловой системе (а не в абстрактном пространстве имён).
+static inline bool cluster_unix_is_path(const struct sockaddr *addr, socklen_t addr_len)
+{
+    const struct sockaddr_un *un = (const struct sockaddr_un *)addr;
+    return addr_len > offsetof(struct sockaddr_un, sun_path) && un->sun_path[0] != '\0';
+}
+
+// Удаление файла сокета path. Файл другого типа не удаляется: путь, скорее всего, указан ошибочно.
+// Возвращает false, если по пути path находится не сокет.
+static inline bool cluster_unix_unlink(const char *path)
+{
+    struct stat st;
+    if (lstat(path, &st) == -1) {
+        return errno == ENOENT;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "[cluster_unix_unlink] %s exists and is not a socket\n", path);
+        return false;
+    }
+    return unlink(path) == 0 || errno == ENOENT;
+}
+
+static inline int cluster_unix_listen(const struct sockaddr *addr, socklen_t addr_len, int backlog)
+{
+    // Файл сокета, оставшийся от предыдущего запуска, мешает bind.
+    if (cluster_unix_is_path(addr, addr_len) && !cluster_unix_unlink(((const struct sockaddr_un *)addr)->sun_path)) {
+        return -1;
+    }
+    return cluster_stream_listen(addr, addr_len, backlog, false);
+}
+
+static inline int cluster_unix_accept(int listen_fd)
+{
+    return accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+static inline int cluster_unix_close(int fd, const struct sockaddr *addr, socklen_t addr_len)
+{
+    if (addr != NULL && cluster_unix_is_path(addr, addr_len)) {
+        cluster_unix_unlink(((const struct sockaddr_un *)addr)->sun_path);
+    }
+    return close(fd);
+}
+
+//! TCP поверх IPv4 или IPv6.
+static const CLUSTER_TRANSPORT cluster_transport_tcp = {
+    .name = "tcp",
+    .listen = cluster_tcp_listen,
+    .accept = cluster_tcp_accept,
+    .connect = cluster_tcp_connect,
+    .sendv_some = cluster_sendv_some,
+    .sendv_all = cluster_sendv_all,
+    .recv = cluster_stream_recv,
+    .close = cluster_stream_close,
+    .zerocopy_enable = cluster_tcp_zerocopy_enable,
+    .zerocopy_send = cluster_tcp_zerocopy_send,
+    .zerocopy_completion = cluster_tcp_zerocopy_completion,
+};
+
+//! Потоковые сокеты AF_UNIX (узлы на одном хосте).
+static const CLUSTER_TRANSPORT cluster_transport_unix = {
+    .name = "unix",
+    .listen = cluster_unix_listen,
+    .accept = cluster_unix_accept,
+    .connect = cluster_stream_connect,
+    .sendv_some = cluster_sendv_some,
+    .sendv_all = cluster_sendv_all,
+    .recv = cluster_stream_recv,
+    .close = cluster_unix_close,
+    .zerocopy_enable = cluster_unix_zerocopy_enable,
+    .zerocopy_send = cluster_unix_zerocopy_send,
+    .zerocopy_completion = cluster_unix_zerocopy_completion,
+};
+
+// Разбор строки адреса addr (port используется только TCP). passive - адрес для прослушивания.
+// В *transport записывается транспорт, в addr_out и *addr_len - адрес сокета.
+// Возвращает false, если адрес не разобран (сообщение выводится в stderr).
+static inline bool cluster_address_parse(const char *addr, const char *port, bool passive,
+                                         const CLUSTER_TRANSPORT **transport,
+                                         struct sockaddr_storage *addr_out, socklen_t *addr_len)
+{
+    memset(addr_out, 0, sizeof(*addr_out));
+    if (strncmp(addr, CLUSTER_UNIX_PREFIX, strlen(CLUSTER_UNIX_PREFIX)) == 0) {
+        const char *path = addr + strlen(CLUSTER_UNIX_PREFIX);
+        struct sockaddr_un *un = (struct sockaddr_un *)addr_out;
+        size_t len = strlen(path);
+        if (len == 0 || len >= sizeof(un->sun_path)) {
+            fprintf(stderr, "[cluster_address_parse] Invalid unix socket path: %s\n", addr);
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, path, len);
+        // Имя абстрактного сокета начинается с нулевого байта и не завершается нулём.
+        if (path[0] == '@') {
+            un->sun_path[0] = '\0';
+            *addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+        } else {
+            *addr_len = offsetof(struct sockaddr_un, sun_path) + len + 1;
+        }
+        *transport = &cluster_transport_unix;
+        return true;
+    }
+    if (strncmp(addr, CLUSTER_TCP_PREFIX, strlen(CLUSTER_TCP_PREFIX)) == 0) {
+        addr += strlen(CLUSTER_TCP_PREFIX);
+    }
+    // Адрес IPv6 может быть записан в скобках.
+    char host[NI_MAXHOST];
+    size_t len = strlen(addr);
+    if (len >= 2 && addr[0] == '[' && addr[len - 1] == ']') {
+        addr++;
+        len -= 2;
+    }
+    if (len >= sizeof(host)) {
+        fprintf(stderr, "[cluster_address_parse] Host name is too long: %s\n", addr);
+        return false;
+    }
+    memcpy(host, addr, len);
+    host[len] = '\0';
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    int status = getaddrinfo(host, port, &hints, &res);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status));
+        return false;
+    }
+    // Используется первый адрес: обе стороны получают их от распознавателя в одном порядке.
+    memcpy(addr_out, res->ai_addr, res->ai_addrlen);
+    *addr_len = res->ai_addrlen;
+    *transport = &cluster_transport_tcp;
+    freeaddrinfo(res);
+    return true;
+}
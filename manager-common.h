@@ -14,6 +14,7 @@
 #include <netinet/tcp.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <poll.h>
 #include <signal.h>
 #include <errno.h>
 #include <endian.h>
@@ -21,27 +22,259 @@
 #include <time.h>
 #include <math.h>
 #include "manager.h"
+#include "cluster-protocol.h"
+#include "cluster-codec.h"
+#include "cluster-shm.h"
+#include "cluster-transport.h"
+#include "cluster-trace.h"
 #include <netdb.h>
 
+_Static_assert(MANAGER_CODEC_NONE == CLUSTER_CODEC_NONE && MANAGER_CODEC_LZ == CLUSTER_CODEC_LZ,
+               "Public codec numbers must match the protocol");
+
+// Номер задачи, передаваемый рабочему узлу, содержит номер задания в разрядах начиная с MANAGER_JOB_ID_SHIFT:
+// результаты задач завершённого задания не путаются с задачами следующего задания сессии.
+#define MANAGER_JOB_ID_SHIFT 40
+#define MANAGER_JOB_ID_MASK ((1UL << (64 - MANAGER_JOB_ID_SHIFT)) - 1)
+
+// Продолжительность интервала измерения скорости рабочего узла (в секундах занятости узла).
+#define MANAGER_RATE_INTERVAL 0.05
+// Вес нового измерения в сглаженной скорости рабочего узла.
+#define MANAGER_RATE_ALPHA 0.3
+// Время (в секундах), за которое рабочий узел должен принять недосланный пакет завершённого задания
+// или, при закрытии соединения, остаток пакета и признак завершения; иначе соединение закрывается.
+#define MANAGER_FLUSH_SECONDS 5.0
+
 typedef enum
 {
     CONNECTION_EMPTY,
     GET_INFO,   // -> WAIT_TASK
     WAIT_TASK, //-> WAIT_ANS, WORK_FINISHED 
-    WAIT_ANS, // -> WAIT_TASK
-    WORK_FINISHED
+    WAIT_ANS, // -> WAIT_ANS, WAIT_TASK, WORK_FAILED
+    WORK_FINISHED,
+    WORK_FAILED // соединение разорвано, задачи узла возвращены в очередь
 } WORK_STATE;
 
+// Задача, отправленная рабочим узлам и ожидающая результата.
+typedef struct TASK_ENTRY
+{
+    // Номер задачи в исходном массиве задач.
+    size_t index;
+    // Номер задачи, передаваемый рабочему узлу (номер задания и index).
+    size_t task_id;
+    // Задание, которому принадлежит задача.
+    struct MANAGER_JOB *job;
+    // Данные задачи, полученные из источника, и их размер (передаётся перед данными).
+    const char *data;
+    size_t size;
+    // Количество рабочих узлов, выполняющих задачу в данный момент.
+    size_t copies;
+    // Количество отправок данных задачи с MSG_ZEROCOPY, о завершении которых ядро ещё не сообщило:
+    // до этого запись не используется повторно, а данные не возвращаются источнику.
+    size_t zerocopy_pins;
+    // Флаг получения результата задачи.
+    bool done;
+    // Флаг нахождения задачи в очереди повторной отправки.
+    bool retry_queued;
+    // Флаг приёма результата задачи от одного из узлов (остальные копии результата отбрасываются).
+    bool receiving;
+    // Оценка стоимости задачи (1, если оценки не заданы).
+    double cost;
+    // Соседи в списке невыполненных задач (в порядке первой отправки).
+    struct TASK_ENTRY *prev;
+    struct TASK_ENTRY *next;
+    // Следующая задача в очереди повторной отправки.
+    struct TASK_ENTRY *retry_next;
+} TASK_ENTRY;
+
+// Количество записей задач, выделяемых за один раз.
+#define TASK_ENTRY_CHUNK 64
+
+// Блок записей задач; записи освобождаются вместе с заданием.
+typedef struct TASK_ENTRY_BLOCK
+{
+    struct TASK_ENTRY_BLOCK *next;
+    TASK_ENTRY entries[TASK_ENTRY_CHUNK];
+} TASK_ENTRY_BLOCK;
+
+// Состояние выполнения задания.
+typedef struct MANAGER_JOB
+{
+    // Номер задания в сессии.
+    size_t id;
+    // Приоритет задания: свободные ядра получают задачи задания с наибольшим приоритетом.
+    int priority;
+    // Вес задания среди выполняемых заданий того же приоритета.
+    double weight;
+    // Виртуальное время задания: стоимость отправленных задач, делённая на вес.
+    // Из заданий равного приоритета задачи отправляются заданию с наименьшим виртуальным временем.
+    double vtime;
+    // Номер раздачи, при которой для задания не нашлось задач (см. manager_dispatch).
+    size_t dispatch_mark;
+    // Соседи в списке выполняемых заданий цикла событий.
+    struct MANAGER_JOB *run_prev;
+    struct MANAGER_JOB *run_next;
+    // Источник задач.
+    TASK_SOURCE source;
+    // Флаг окончания задач источника.
+    bool source_done;
+    // Количество задач, полученных из источника (и отправленных хотя бы один раз).
+    size_t num_tasks_send;
+    // Количество полученных результатов.
+    size_t num_ans_get;
+    // Общее количество задач источника, 0 - неизвестно.
+    size_t num_tasks_total;
+    // Порядок отправки: i-я задача источника имеет номер order[i] (NULL - номера по порядку).
+    const size_t *order;
+    // Оценки стоимости задач по номерам (NULL - все задачи стоят 1).
+    const double *costs;
+    // Суммарная стоимость задач источника и стоимость задач, уже полученных из источника.
+    double cost_total;
+    double cost_send;
+    // Буфер ответов (при slots == NULL - позиция следующего ответа).
+    char *ans;
+    // Таблица размещения результатов, может быть NULL.
+    RESULT_SLOT *slots;
+    // Приёмник результатов; если задан, ans и slots не используются.
+    RESULT_SINK sink;
+    // Невыполненные задачи в порядке первой отправки (самая старая - первая).
+    TASK_ENTRY *pending_first;
+    TASK_ENTRY *pending_last;
+    // Задачи отказавших рабочих узлов, ожидающие повторной отправки.
+    TASK_ENTRY *retry_first;
+    TASK_ENTRY *retry_last;
+    // Освобождённые записи для повторного использования.
+    TASK_ENTRY *free_entries;
+    // Ошибка задания, при которой продолжение вычислений невозможно.
+    bool failed;
+    // Количество ссылок соединений на записи и данные задания: недосланные пакеты и отправки
+    // с MSG_ZEROCOPY, о завершении которых ядро ещё не сообщило. Пока оно не 0, задание не освобождается.
+    size_t tx_refs;
+    // Все выделенные блоки записей.
+    TASK_ENTRY_BLOCK *blocks;
+} MANAGER_JOB;
+
+// Отправка данных задачи с MSG_ZEROCOPY, ожидающая уведомления о завершении.
 typedef struct
+{
+    // Номер уведомления отправки (CLUSTER_TRANSPORT::zerocopy_send).
+    uint32_t seq;
+    // Задача, данные которой отправлены.
+    TASK_ENTRY *entry;
+} ZEROCOPY_PIN;
+
+// Состояние приёма данных от рабочего узла.
+typedef enum
+{
+    RX_HEADER,  // приём информации об узле или заголовка результата
+    RX_PAYLOAD, // приём результата в буфер ответов
+    RX_PACKED,  // приём сжатого результата в буфер соединения
+    RX_SKIP     // приём и отбрасывание результата, принимаемого от другого узла
+} RX_STATE;
+
+typedef struct WORK_CONNECTION
 {
     // Дескриптор сокета для обмена данными с клиентом.
     int client_sock_fd;
+    // Транспорт соединения (транспорт слушающего сокета Управляющего узла).
+    const CLUSTER_TRANSPORT *transport;
     // Количество ядер на рабочем узле.
     size_t n_cores;
     // Текущее состояние протокола обмена данными с данным клиентом.
     WORK_STATE state;
-    // Количество задач отправленное в последний раз
-    size_t num_last_tasks_send;
+    // Количество задач, отправленных и ещё не вернувшихся.
+    size_t num_tasks_in_flight;
+    // Узел получает новый пакет, пока задач в пути меньше refill_level (n_cores + window).
+    size_t refill_level;
+    // Задачи в пути; отправляемый пакет собирается сразу за ними.
+    TASK_ENTRY **in_flight;
+    size_t in_flight_capacity;
+    // Время отправки задач в пути (элементы соответствуют in_flight).
+    double *in_flight_sent;
+    // Номера задач завершённых заданий, ещё выполняемых узлом: их результаты отбрасываются.
+    size_t *stale_ids;
+    size_t num_stale;
+    size_t stale_capacity;
+    // Номера и записи задач отправляемого пакета (не более batch_capacity).
+    size_t *batch_ids;
+    TASK_ENTRY **batch_entries;
+    // Описание отправляемого пакета для writev (3 + 2 * batch_capacity элементов).
+    struct iovec *batch_iov;
+    size_t batch_capacity;
+    // Заголовок отправляемого пакета: num_tasks и size_data.
+    size_t tx_header[2];
+    // Неотправленный остаток пакета (tx_iovcnt == 0 - пакет отправлен целиком).
+    struct iovec *tx_iov;
+    size_t tx_iovcnt;
+    // Задание, задачи которого содержит текущий пакет (пакет собирается из задач одного задания);
+    // NULL - пакет отправлен целиком.
+    struct MANAGER_JOB *tx_job;
+    // Флаги sendmsg для отправки текущего пакета.
+    int tx_flags;
+    // Минимальный размер пакета для MSG_ZEROCOPY, 0 - копирование данных ядром.
+    size_t zerocopy_threshold;
+    // Номер уведомления следующей отправки с MSG_ZEROCOPY и номер, до которого (не включая)
+    // отправки завершены. Для TCP ядро сообщает о завершении отправок по порядку.
+    uint32_t zerocopy_seq;
+    uint32_t zerocopy_done;
+    // Незавершённые отправки с MSG_ZEROCOPY в порядке номеров: zerocopy_pins[zerocopy_first..+zerocopy_num).
+    ZEROCOPY_PIN *zerocopy_pins;
+    size_t zerocopy_first;
+    size_t zerocopy_num;
+    size_t zerocopy_capacity;
+    // Кодек сжатия, согласованный с узлом.
+    size_t codec;
+    // Разделяемая память узла на том же хосте (NULL - данные передаются через сокет).
+    CLUSTER_SHM *shm;
+    // Данные задач пакета, собранные подряд для сжатия, и сжатый пакет (size_t raw_size и сжатые данные).
+    char *tx_raw;
+    size_t tx_raw_capacity;
+    char *tx_packed;
+    size_t tx_packed_capacity;
+
+    // Состояние приёма данных.
+    RX_STATE rx_state;
+    // Принимаемый заголовок: информация об узле (GET_INFO) или заголовок результата.
+    union {
+        NODE_INFO info;
+        RESULT_HEADER result;
+    } rx_header;
+    // Количество принятых байт заголовка.
+    size_t rx_header_got;
+    // Задача, результат которой принимается.
+    TASK_ENTRY *rx_entry;
+    // Место для оставшейся части результата и её размер.
+    char *rx_dst;
+    size_t rx_left;
+    // Буфер для результатов, передаваемых приёмнику (растёт до размера наибольшего результата).
+    char *rx_buf;
+    size_t rx_buf_size;
+    // Буфер для принимаемого сжатого результата.
+    char *rx_packed;
+    size_t rx_packed_capacity;
+
+    // Сглаженная скорость выполнения задач узлом (стоимость выполненных задач в секунду;
+    // без оценок стоимости - задач в секунду), 0 - ещё не измерена.
+    double rate;
+    // Текущий интервал измерения: стоимость полученных результатов, время занятости узла
+    // в завершённых периодах и начало текущего периода (узел занят, пока у него есть задачи в пути).
+    double rate_done;
+    double rate_busy;
+    double rate_mark;
+
+    // Статистика узла (см. manager_get_stats).
+    MANAGER_WORKER_STATS stats;
+    // Время подключения узла и последнего изменения количества его задач в пути (для учёта простоя ядер).
+    double connected_at;
+    double idle_mark;
+
+    // Соседи в списке подключённых узлов.
+    struct WORK_CONNECTION *prev;
+    struct WORK_CONNECTION *next;
+    // Соседи в списке узлов со свободным окном, для которых не нашлось задач.
+    struct WORK_CONNECTION *idle_prev;
+    struct WORK_CONNECTION *idle_next;
+    bool idle;
 } WORK_CONNECTION;
 
 
@@ -69,23 +302,22 @@ char* create_task_structure(size_t num_tasks, size_t *task_sizes, char *tasks){
 }
 
 void info_manager_init(INFO_MANAGER *manager, const char *addr, const char *port, time_t seconds, int num_nodes) {
-    struct addrinfo hints, *res;
-    int status;
-
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-
-    if ((status = getaddrinfo(addr, port, &hints, &res)) != 0) {
-        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status));
+    if (!cluster_address_parse(addr, port, true, &manager->transport, &manager->listen_addr, &manager->listen_addr_len)) {
         exit(EXIT_FAILURE);
     }
-
-    manager->listen_addr = *res->ai_addr;
     manager->max_time = seconds;
     manager->num_nodes = num_nodes;
+    manager->window = MANAGER_DEFAULT_WINDOW;
+    manager->speculative = false;
+    manager->adaptive_batch = true;
+    manager->zerocopy_threshold = 0;
+    manager->codec = MANAGER_CODEC_NONE;
+    manager->shared_memory = true;
+    memset(&manager->codec_stats, 0, sizeof(manager->codec_stats));
+    manager->stats_path = NULL;
+    manager->trace_path = NULL;
+    manager->trace = NULL;
     manager->is_init = true;
-    freeaddrinfo(res);
 }
 
 static bool manager_init_socket(INFO_MANAGER* manager)
@@ -95,31 +327,12 @@ static bool manager_init_socket(INFO_MANAGER* manager)
         return false;
     }
     // Создаём сокет, слушающий подключения клиентов.
-    manager->listen_sock_fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0);
+    manager->listen_sock_fd = manager->transport->listen((struct sockaddr *)&manager->listen_addr,
+                                                         manager->listen_addr_len,
+                                                         manager->num_nodes /* Размер очереди запросов на подключение */);
     if (manager->listen_sock_fd == -1)
     {
-        fprintf(stderr, "[manager_init] Unable to create socket!\n");
-        return false;
-    }
-
-    // Запрещаем перевод слушающего сокета в состояние TIME_WAIT.
-    int setsockopt_yes = 1;
-    if (setsockopt(manager->listen_sock_fd, SOL_SOCKET, SO_REUSEADDR, &setsockopt_yes, sizeof(setsockopt_yes)) == -1)
-    {
-        fprintf(stderr, "[manager_init] Unable to set SO_REUSEADDR socket option\n");
-        return false;
-    }
-
-    if (bind(manager->listen_sock_fd, (struct sockaddr*) &(manager->listen_addr), sizeof(manager->listen_addr)) == -1)
-    {
-        fprintf(stderr, "[manager_init] Unable to bind\n");
-        return false;
-    }
-
-    // Активируем очередь запросов на подключение.
-    if (listen(manager->listen_sock_fd, manager->num_nodes /* Размер очереди запросов на подключение */) == -1)
-    {
-        fprintf(stderr, "[manager_init] Unable to listen() on a socket\n");
+        fprintf(stderr, "[manager_init] Unable to listen on %s socket\n", manager->transport->name);
         return false;
     }
     return true;
@@ -127,7 +340,8 @@ static bool manager_init_socket(INFO_MANAGER* manager)
 
 static bool manager_close_listen_socket(INFO_MANAGER* manager) {
 
-    if (close(manager->listen_sock_fd) == -1)
+    if (manager->transport->close(manager->listen_sock_fd, (struct sockaddr *)&manager->listen_addr,
+                                  manager->listen_addr_len) == -1)
     {
         fprintf(stderr, "[manager_close_listen_socket] Unable to close() listen-socket\n");
         return false;
@@ -135,147 +349,1116 @@ static bool manager_close_listen_socket(INFO_MANAGER* manager) {
     return true;
 }
 
+// Возвращает false, если очередь запросов на подключение пуста или accept() завершился ошибкой.
+// При ошибке настройки сокета соединение закрывается и переводится в состояние WORK_FAILED.
 static bool manager_accept_connection_request(INFO_MANAGER* manager, WORK_CONNECTION* conn)
 {
     DEBUG("Wait for worker_node to connect\n");
 
-    // Создаём сокет для клиента из очереди на подключение.
-    conn->client_sock_fd = accept(manager->listen_sock_fd, NULL, NULL);
+    // Создаём неблокирующий сокет для клиента из очереди на подключение и настраиваем его.
+    conn->transport = manager->transport;
+    conn->client_sock_fd = conn->transport->accept(manager->listen_sock_fd);
     if (conn->client_sock_fd == -1)
     {
-        fprintf(stderr, "[manager_accept_connection_request] Unable to accept() connection on a socket\n");
+        if (errno == ECONNABORTED) {
+            conn->state = WORK_FAILED;
+            return true;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            fprintf(stderr, "[manager_accept_connection_request] Unable to accept() connection on a socket\n");
+        }
         return false;
     }
 
-    // Disable Nagle's algorithm:
-    int setsockopt_arg = 1;
-    if (setsockopt(conn->client_sock_fd, IPPROTO_TCP, TCP_NODELAY, &setsockopt_arg, sizeof(setsockopt_arg)) == -1)
-    {
-        fprintf(stderr, "[manager_accept_connection_request] Unable to enable TCP_NODELAY socket option");
+    // Передача без копирования; если ядро её не поддерживает, пакеты отправляются обычным образом.
+    if (manager->zerocopy_threshold != 0 && conn->transport->zerocopy_enable(conn->client_sock_fd)) {
+        conn->zerocopy_threshold = manager->zerocopy_threshold;
+    }
+
+    DEBUG("Worker connected\n");
+    conn->state = GET_INFO;
+    conn->rx_state = RX_HEADER;
+    return true;
+}
+
+//============================
+// Учёт задач задания
+//============================
+
+// Источник задач из буфера в формате create_task_structure.
+typedef struct
+{
+    // Следующая задача буфера.
+    char *ptr;
+    // Количество оставшихся задач.
+    size_t left;
+} TASK_BUFFER_SOURCE;
+
+static int task_buffer_next(void *ctx, const char **data, size_t *size)
+{
+    TASK_BUFFER_SOURCE *buffer = ctx;
+    if (buffer->left == 0) {
+        return 0;
+    }
+    *size = *((size_t *)buffer->ptr);
+    *data = buffer->ptr + sizeof(size_t);
+    buffer->ptr += *size + sizeof(size_t);
+    buffer->left--;
+    return 1;
+}
+
+// Источник задач из таблицы {адрес, размер}.
+typedef struct
+{
+    // Следующая задача таблицы.
+    const struct iovec *next;
+    // Количество оставшихся задач.
+    size_t left;
+} TASK_IOV_SOURCE;
+
+static int task_iov_next(void *ctx, const char **data, size_t *size)
+{
+    TASK_IOV_SOURCE *table = ctx;
+    if (table->left == 0) {
+        return 0;
+    }
+    *data = table->next->iov_base;
+    *size = table->next->iov_len;
+    table->next++;
+    table->left--;
+    return 1;
+}
+
+// Запись для очередной задачи источника.
+// NULL, если задачи закончились (job->source_done) или произошла ошибка (job->failed).
+static TASK_ENTRY *job_new_entry(MANAGER_JOB *job)
+{
+    if (job->free_entries == NULL) {
+        TASK_ENTRY_BLOCK *block = calloc(1, sizeof(*block));
+        if (block == NULL) {
+            fprintf(stderr, "[job_new_entry] No memory for task entries\n");
+            job->failed = true;
+            return NULL;
+        }
+        block->next = job->blocks;
+        job->blocks = block;
+        for (size_t i = 0; i < TASK_ENTRY_CHUNK; ++i) {
+            block->entries[i].next = job->free_entries;
+            job->free_entries = &block->entries[i];
+        }
+    }
+    TASK_ENTRY *entry = job->free_entries;
+
+    int ret = job->source.next(job->source.ctx, &entry->data, &entry->size);
+    if (ret <= 0) {
+        entry->data = NULL;
+        if (ret < 0) {
+            fprintf(stderr, "[job_new_entry] Task source failed\n");
+            job->failed = true;
+        } else {
+            DEBUG("Task source exhausted after %lu tasks\n", job->num_tasks_send);
+        }
+        job->source_done = true;
+        return NULL;
+    }
+    job->free_entries = entry->next;
+
+    entry->index = job->order != NULL ? job->order[job->num_tasks_send] : job->num_tasks_send;
+    job->num_tasks_send++;
+    entry->task_id = ((job->id & MANAGER_JOB_ID_MASK) << MANAGER_JOB_ID_SHIFT) | entry->index;
+    entry->job = job;
+    entry->cost = job->costs != NULL ? job->costs[entry->index] : 1;
+    job->cost_send += entry->cost;
+    entry->copies = 0;
+    entry->done = false;
+    entry->retry_queued = false;
+    entry->receiving = false;
+
+    entry->next = NULL;
+    entry->prev = job->pending_last;
+    if (job->pending_last != NULL) {
+        job->pending_last->next = entry;
+    } else {
+        job->pending_first = entry;
+    }
+    job->pending_last = entry;
+    return entry;
+}
+
+// Учёт первого полученного результата задачи.
+static void job_complete_entry(MANAGER_JOB *job, TASK_ENTRY *entry)
+{
+    entry->done = true;
+    job->num_ans_get++;
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        job->pending_first = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        job->pending_last = entry->prev;
+    }
+}
+
+// Возврат записи выполненной задачи, которой больше не ждёт ни один рабочий узел
+// и данные которой ядро уже не отправляет.
+static void job_release_entry(MANAGER_JOB *job, TASK_ENTRY *entry)
+{
+    if (entry->done && entry->copies == 0 && !entry->retry_queued && entry->zerocopy_pins == 0) {
+        if (job->source.release != NULL) {
+            job->source.release(job->source.ctx, entry->data, entry->size);
+        }
+        entry->data = NULL;
+        entry->next = job->free_entries;
+        job->free_entries = entry;
+    }
+}
+
+// Постановка невыполненной задачи, не выполняющейся ни на одном узле, в очередь повторной отправки.
+static void job_retry_entry(MANAGER_JOB *job, TASK_ENTRY *entry)
+{
+    if (entry->done || entry->copies != 0 || entry->retry_queued) {
+        return;
+    }
+    entry->retry_queued = true;
+    entry->retry_next = NULL;
+    if (job->retry_last != NULL) {
+        job->retry_last->retry_next = entry;
+    } else {
+        job->retry_first = entry;
+    }
+    job->retry_last = entry;
+}
+
+// Очередная задача для повторной отправки или NULL, если очередь пуста.
+static TASK_ENTRY *job_pop_retry(MANAGER_JOB *job)
+{
+    while (job->retry_first != NULL) {
+        TASK_ENTRY *entry = job->retry_first;
+        job->retry_first = entry->retry_next;
+        if (job->retry_first == NULL) {
+            job->retry_last = NULL;
+        }
+        entry->retry_queued = false;
+        if (!entry->done) {
+            return entry;
+        }
+        job_release_entry(job, entry);
+    }
+    return NULL;
+}
+
+// Освобождение задания; задачи, ещё не возвращённые источнику (при ошибке), освобождаются здесь.
+static void job_destroy(MANAGER_JOB *job)
+{
+    for (TASK_ENTRY_BLOCK *block = job->blocks; block != NULL && job->source.release != NULL; block = block->next) {
+        for (size_t i = 0; i < TASK_ENTRY_CHUNK; ++i) {
+            if (block->entries[i].data != NULL) {
+                job->source.release(job->source.ctx, block->entries[i].data, block->entries[i].size);
+            }
+        }
+    }
+    while (job->blocks != NULL) {
+        TASK_ENTRY_BLOCK *next = job->blocks->next;
+        free(job->blocks);
+        job->blocks = next;
+    }
+}
+
+//============================
+// Обмен данными с рабочими узлами
+//============================
+
+// Расширение буфера *buf до size байт (содержимое не сохраняется, если не помещается).
+static bool manager_reserve_buffer(char **buf, size_t *capacity, size_t size)
+{
+    if (size <= *capacity) {
+        return true;
+    }
+    char *new_buf = realloc(*buf, size);
+    if (new_buf == NULL) {
         return false;
     }
+    *buf = new_buf;
+    *capacity = size;
+    return true;
+}
+
+static double manager_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Добавление статистики src к сумме dst.
+static void manager_stats_merge(MANAGER_WORKER_STATS *dst, const MANAGER_WORKER_STATS *src)
+{
+    dst->batches_sent += src->batches_sent;
+    dst->tasks_dispatched += src->tasks_dispatched;
+    dst->tasks_completed += src->tasks_completed;
+    dst->tasks_requeued += src->tasks_requeued;
+    dst->bytes_out += src->bytes_out;
+    dst->bytes_in += src->bytes_in;
+    dst->idle_core_us += src->idle_core_us;
+    cluster_hist_merge(&dst->round_trip, &src->round_trip);
+}
+
+// Простой ядер узла (в микросекундах ядро-времени) с последнего изменения количества его задач в пути до now.
+static size_t manager_idle_since(const WORK_CONNECTION *work, double now)
+{
+    size_t busy = work->num_tasks_in_flight + work->num_stale;
+    if (busy >= work->n_cores || now <= work->idle_mark) {
+        return 0;
+    }
+    return (size_t)((now - work->idle_mark) * 1e6 * (work->n_cores - busy));
+}
 
-    // Disable corking:
-    setsockopt_arg = 0;
-    if (setsockopt(conn->client_sock_fd, IPPROTO_TCP, TCP_CORK, &setsockopt_arg, sizeof(setsockopt_arg)) == -1)
+// Учёт простоя ядер узла; вызывается перед каждым изменением количества задач в пути (и устаревших задач).
+static void manager_idle_update(WORK_CONNECTION *work, double now)
+{
+    work->stats.idle_core_us += manager_idle_since(work, now);
+    work->idle_mark = now;
+}
+
+// Статистика узла на момент now.
+static void manager_worker_stats(const WORK_CONNECTION *work, double now, MANAGER_WORKER_STATS *stats)
+{
+    *stats = work->stats;
+    stats->n_cores = work->n_cores;
+    stats->idle_core_us += manager_idle_since(work, now);
+    stats->connected_us = work->state == GET_INFO ? 0 : (size_t)((now - work->connected_at) * 1e6);
+}
+
+static bool manager_get_worker_info(INFO_MANAGER *manager, WORK_CONNECTION *work)
+{
+    work->n_cores = work->rx_header.info.n_cores;
+    if (work->n_cores == 0)
     {
-        fprintf(stderr, "[manager_accept_connection_request] Unable to disable TCP_CORK socket option");
+        fprintf(stderr, "Unable to recv n_cores info from worker\n");
         return false;
     }
-    // TCP Keep-Alive
-    setsockopt_arg = 1;
-    if(setsockopt(conn->client_sock_fd, SOL_SOCKET, SO_KEEPALIVE, &setsockopt_arg, sizeof(setsockopt_arg)) == -1) {
-        fprintf(stderr, "[manager_accept_connection_request] Unable to enable TCP Keep-Alive socket option");
-        return false;
+    // Кодек Управляющего узла используется, если узел его поддерживает.
+    NODE_CONFIG config = {
+        .codec = manager->codec < 64 && (work->rx_header.info.codecs & (1UL << manager->codec)) ?
+                 manager->codec : CLUSTER_CODEC_NONE,
+        .transport = CLUSTER_TRANSPORT_SOCKET,
+        .node_id = work->stats.id,
+    };
+    // Сегмент узла удаётся открыть, только если узел работает на этом же хосте.
+    work->rx_header.info.shm_name[CLUSTER_SHM_NAME_SIZE - 1] = '\0';
+    if (manager->shared_memory && work->rx_header.info.shm_name[0] != '\0') {
+        work->shm = calloc(1, sizeof(*work->shm));
+        if (work->shm != NULL &&
+            cluster_shm_attach(work->shm, work->rx_header.info.shm_name, work->rx_header.info.shm_nonce)) {
+            work->shm->sock = work->client_sock_fd;
+            // Копирование в общую память дешевле сжатия, а MSG_ZEROCOPY к ней неприменим.
+            config.codec = CLUSTER_CODEC_NONE;
+            config.transport = CLUSTER_TRANSPORT_SHM;
+            work->zerocopy_threshold = 0;
+        } else {
+            free(work->shm);
+            work->shm = NULL;
+        }
     }
-    // TCP KeepIdle
-    setsockopt_arg = 5;
-    if(setsockopt(conn->client_sock_fd, IPPROTO_TCP, TCP_KEEPIDLE, &setsockopt_arg, sizeof(setsockopt_arg)) == -1) {
-        fprintf(stderr, "[manager_accept_connection_request] Unable to enable TCP KeepIdle socket option");
+    work->codec = config.codec;
+    config.clock_us = cluster_trace_now();
+    // Ответ - первые данные в свежем соединении, буфер сокета заведомо вмещает его целиком.
+    struct iovec config_iov = { .iov_base = &config, .iov_len = sizeof(config) };
+    struct iovec *config_rest = &config_iov;
+    size_t config_iovcnt = 1;
+    if (!work->transport->sendv_some(work->client_sock_fd, &config_rest, &config_iovcnt, 0) || config_iovcnt != 0) {
+        fprintf(stderr, "Unable to send connection config to worker\n");
         return false;
     }
-    setsockopt_arg = 1;
-    if(setsockopt(conn->client_sock_fd, IPPROTO_TCP, TCP_KEEPINTVL, &setsockopt_arg, sizeof(setsockopt_arg)) == -1) {
-        fprintf(stderr, "[manager_accept_connection_request] Unable to enable TCP KeepINTVL socket option");
+    work->refill_level = work->n_cores + manager->window;
+    work->in_flight_capacity = work->refill_level;
+    work->batch_capacity = work->n_cores;
+    work->in_flight = calloc(work->in_flight_capacity, sizeof(*work->in_flight));
+    work->in_flight_sent = calloc(work->in_flight_capacity, sizeof(*work->in_flight_sent));
+    work->batch_ids = calloc(work->batch_capacity, sizeof(*work->batch_ids));
+    work->batch_entries = calloc(work->batch_capacity, sizeof(*work->batch_entries));
+    work->batch_iov = calloc(3 + 2 * work->batch_capacity, sizeof(*work->batch_iov));
+    if (work->in_flight == NULL || work->in_flight_sent == NULL || work->batch_ids == NULL ||
+        work->batch_entries == NULL || work->batch_iov == NULL)
+    {
+        fprintf(stderr, "[manager_get_worker_info] No memory for in-flight tasks\n");
         return false;
     }
-    setsockopt_arg = 3;
-    if(setsockopt(conn->client_sock_fd, IPPROTO_TCP, TCP_KEEPCNT, &setsockopt_arg, sizeof(setsockopt_arg)) == -1) {
-        fprintf(stderr, "[manager_accept_connection_request] Unable to enable TCP TCP_KEEPCNT socket option");
+    work->connected_at = manager_now();
+    work->idle_mark = work->connected_at;
+    work->state = WAIT_TASK;
+    DEBUG("Connect worker with cores : %lu, shared memory: %d\n", work->n_cores, work->shm != NULL);
+    return true;
+}
+
+// Расширение массивов соединения под пакет из batch_size задач сверх задач в пути.
+// Вызывается только между пакетами: неотправленный остаток пакета ссылается на batch_iov.
+static bool manager_reserve_batch(WORK_CONNECTION *work, size_t batch_size)
+{
+    size_t need = work->num_tasks_in_flight + batch_size;
+    if (need > work->in_flight_capacity) {
+        if (need < 2 * work->in_flight_capacity) {
+            need = 2 * work->in_flight_capacity;
+        }
+        TASK_ENTRY **in_flight = realloc(work->in_flight, need * sizeof(*in_flight));
+        if (in_flight == NULL) {
+            fprintf(stderr, "[manager_reserve_batch] No memory for %lu tasks in flight\n", need);
+            return false;
+        }
+        work->in_flight = in_flight;
+        double *in_flight_sent = realloc(work->in_flight_sent, need * sizeof(*in_flight_sent));
+        if (in_flight_sent == NULL) {
+            fprintf(stderr, "[manager_reserve_batch] No memory for %lu tasks in flight\n", need);
+            return false;
+        }
+        work->in_flight_sent = in_flight_sent;
+        work->in_flight_capacity = need;
+    }
+    if (batch_size > work->batch_capacity) {
+        if (batch_size < 2 * work->batch_capacity) {
+            batch_size = 2 * work->batch_capacity;
+        }
+        size_t *batch_ids = realloc(work->batch_ids, batch_size * sizeof(*batch_ids));
+        if (batch_ids == NULL) {
+            fprintf(stderr, "[manager_reserve_batch] No memory for batch of %lu tasks\n", batch_size);
+            return false;
+        }
+        work->batch_ids = batch_ids;
+        TASK_ENTRY **batch_entries = realloc(work->batch_entries, batch_size * sizeof(*batch_entries));
+        if (batch_entries == NULL) {
+            fprintf(stderr, "[manager_reserve_batch] No memory for batch of %lu tasks\n", batch_size);
+            return false;
+        }
+        work->batch_entries = batch_entries;
+        struct iovec *batch_iov = realloc(work->batch_iov, (3 + 2 * batch_size) * sizeof(*batch_iov));
+        if (batch_iov == NULL) {
+            fprintf(stderr, "[manager_reserve_batch] No memory for batch of %lu tasks\n", batch_size);
+            return false;
+        }
+        work->batch_iov = batch_iov;
+        work->batch_capacity = batch_size;
+    }
+    return true;
+}
+
+// Учёт результата задачи стоимостью cost, полученного от узла, в измерении его скорости.
+// Учитывается только время, когда у узла были задачи: ожидание новых задач не снижает скорость.
+static void manager_rate_update(WORK_CONNECTION *work, double cost)
+{
+    double now = manager_now();
+    double busy = work->rate_busy + (now - work->rate_mark);
+    work->rate_done += cost;
+    if (busy >= MANAGER_RATE_INTERVAL) {
+        double sample = work->rate_done / busy;
+        work->rate = work->rate == 0 ? sample : work->rate + MANAGER_RATE_ALPHA * (sample - work->rate);
+        work->rate_done = 0;
+        work->rate_busy = 0;
+        work->rate_mark = now;
+    } else if (work->num_tasks_in_flight == 0) {
+        // Период занятости закончился: его время учитывается в следующем периоде.
+        work->rate_busy = busy;
+    }
+}
+
+// Окончание отправки текущего пакета (целиком или из-за разрыва соединения):
+// записи и данные задания пакета больше не нужны соединению.
+static void manager_tx_finished(WORK_CONNECTION *work)
+{
+    work->tx_iovcnt = 0;
+    if (work->tx_job != NULL) {
+        work->tx_job->tx_refs--;
+        work->tx_job = NULL;
+    }
+}
+
+// Завершение отправок с MSG_ZEROCOPY с номерами до done (не включая): ядро больше не читает их данные,
+// записи задач могут использоваться повторно, а задания - освобождаться.
+static void manager_zerocopy_completed(WORK_CONNECTION *work, uint32_t done)
+{
+    while (work->zerocopy_num != 0 && (int32_t)(work->zerocopy_pins[work->zerocopy_first].seq - done) < 0) {
+        TASK_ENTRY *entry = work->zerocopy_pins[work->zerocopy_first].entry;
+        work->zerocopy_first++;
+        work->zerocopy_num--;
+        entry->zerocopy_pins--;
+        entry->job->tx_refs--;
+        job_release_entry(entry->job, entry);
+    }
+    if (work->zerocopy_num == 0) {
+        work->zerocopy_first = 0;
+    }
+}
+
+// Ссылается ли соединение на данные задания job (недосланным пакетом или незавершённой отправкой
+// с MSG_ZEROCOPY).
+static bool manager_refers_job(const WORK_CONNECTION *work, const MANAGER_JOB *job)
+{
+    if (work->tx_job == job) {
+        return true;
+    }
+    for (size_t i = 0; i < work->zerocopy_num; ++i) {
+        if (work->zerocopy_pins[work->zerocopy_first + i].entry->job == job) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Место для ещё одной незавершённой отправки с MSG_ZEROCOPY.
+static bool manager_reserve_zerocopy(WORK_CONNECTION *work)
+{
+    if (work->zerocopy_first + work->zerocopy_num < work->zerocopy_capacity) {
+        return true;
+    }
+    if (work->zerocopy_first != 0) {
+        memmove(work->zerocopy_pins, work->zerocopy_pins + work->zerocopy_first,
+                work->zerocopy_num * sizeof(*work->zerocopy_pins));
+        work->zerocopy_first = 0;
+        return true;
+    }
+    size_t capacity = work->zerocopy_capacity != 0 ? 2 * work->zerocopy_capacity : 2 * work->batch_capacity;
+    ZEROCOPY_PIN *pins = realloc(work->zerocopy_pins, capacity * sizeof(*pins));
+    if (pins == NULL) {
         return false;
     }
+    work->zerocopy_pins = pins;
+    work->zerocopy_capacity = capacity;
+    return true;
+}
 
-    DEBUG("Worker connected\n");
-    conn->state = GET_INFO;
+// Отправка остатка пакета с MSG_ZEROCOPY. Без копирования передаются только данные задач: заголовок,
+// номера и размеры задач лежат в буферах соединения и записях, которые используются повторно,
+// поэтому копируются ядром. Запись задачи, данные которой отправлены вызовом с номером seq,
+// удерживается вместе с её заданием до уведомления о завершении отправки (manager_zerocopy_completed).
+// Возвращает false при ошибке соединения (errno ENOBUFS - исчерпан лимит закреплённых страниц).
+static bool manager_flush_zerocopy(WORK_CONNECTION *work)
+{
+    while (work->tx_iovcnt != 0) {
+        size_t index = work->tx_iov - work->batch_iov;
+        // Элементы 0..2 - заголовок и номера задач, далее чередуются размер и данные задачи.
+        bool payload = index >= 3 && (index - 3) % 2 == 1;
+        if (!payload || work->tx_iov->iov_len == 0 || !manager_reserve_zerocopy(work)) {
+            // Служебные данные до очередных данных задачи (или данные, которые не удалось учесть).
+            size_t count = payload ? 1 : index < 3 ? 4 - index : 1;
+            struct iovec *iov = work->tx_iov;
+            size_t iovcnt = count < work->tx_iovcnt ? count : work->tx_iovcnt;
+            if (!work->transport->sendv_some(work->client_sock_fd, &iov, &iovcnt, 0)) {
+                return false;
+            }
+            work->tx_iovcnt -= iov - work->tx_iov;
+            work->tx_iov = iov;
+            if (iovcnt != 0) {
+                return true;
+            }
+            continue;
+        }
+        ssize_t bytes_written = work->transport->zerocopy_send(work->client_sock_fd, work->tx_iov, 1);
+        if (bytes_written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        TASK_ENTRY *entry = work->batch_entries[(index - 3) / 2];
+        work->zerocopy_pins[work->zerocopy_first + work->zerocopy_num++] = (ZEROCOPY_PIN) {
+            .seq = work->zerocopy_seq++,
+            .entry = entry,
+        };
+        entry->zerocopy_pins++;
+        entry->job->tx_refs++;
+        cluster_iov_advance(&work->tx_iov, &work->tx_iovcnt, (size_t)bytes_written);
+    }
     return true;
 }
 
-static bool manager_get_worker_info(WORK_CONNECTION *work)
+// Отправка остатка текущего пакета без блокировки. Возвращает false при разрыве соединения.
+static bool manager_flush_tasks(WORK_CONNECTION *work)
 {
-    size_t bytes_read = recv(work->client_sock_fd, &(work->n_cores), sizeof(work->n_cores), 0);
-    if (bytes_read != sizeof(work->n_cores))
+    if (work->shm != NULL) {
+        if (!cluster_shm_sendv_some(work->shm, &work->tx_iov, &work->tx_iovcnt)) {
+            fprintf(stderr, "Unable to send tasks to client\n");
+            return false;
+        }
+        if (work->tx_iovcnt == 0) {
+            manager_tx_finished(work);
+        }
+        return true;
+    }
+    while (!(work->tx_flags & MSG_ZEROCOPY ? manager_flush_zerocopy(work)
+             : work->transport->sendv_some(work->client_sock_fd, &work->tx_iov, &work->tx_iovcnt, work->tx_flags)))
     {
-        fprintf(stderr, "Unable to recv n_cores info from worker\n");
+        // Исчерпан лимит памяти для закреплённых страниц: остаток пакета копируется ядром.
+        if (errno == ENOBUFS && work->tx_flags != 0) {
+            work->tx_flags = 0;
+            continue;
+        }
+        fprintf(stderr, "Unable to send tasks to client\n");
         return false;
     }
-    work->state = WAIT_TASK;
-    DEBUG("Connect worker with cores : %lu\n",work->n_cores);
+    if (work->tx_iovcnt == 0) {
+        manager_tx_finished(work);
+    }
     return true;
 }
 
-static size_t manager_send_tasks(WORK_CONNECTION *work, size_t num_tasks, char *data) {
+// Разбор очереди ошибок сокета: уведомления о завершении отправок MSG_ZEROCOPY освобождают
+// удерживаемые ими записи задач. Если ядро было вынуждено скопировать данные (например,
+// при передаче через loopback), передача без копирования для этого узла отключается.
+// Возвращает false при ошибке соединения.
+static bool manager_drain_error_queue(WORK_CONNECTION *work)
+{
+    uint32_t done;
+    bool copied;
+    int ret;
+    while ((ret = work->transport->zerocopy_completion(work->client_sock_fd, &done, &copied)) == 1) {
+        DEBUG("Zerocopy sends before %u completed\n", done);
+        if (copied) {
+            work->zerocopy_threshold = 0;
+        }
+        if ((int32_t)(done - work->zerocopy_done) > 0) {
+            work->zerocopy_done = done;
+        }
+        manager_zerocopy_completed(work, work->zerocopy_done);
+    }
+    if (ret == -1) {
+        return false;
+    }
+    int sock_err = 0;
+    socklen_t len = sizeof(sock_err);
+    if (getsockopt(work->client_sock_fd, SOL_SOCKET, SO_ERROR, &sock_err, &len) == -1 || sock_err != 0) {
+        return false;
+    }
+    return true;
+}
+
+// Сжатие данных собранного пакета (batch_iov[3..]): данные задач копируются подряд в tx_raw и сжимаются
+// в tx_packed. Возвращает размер передаваемых данных пакета; если сжатие не дало выигрыша
+// или не хватило памяти, пакет передаётся без сжатия и возвращается size_data.
+static size_t manager_pack_tasks(WORK_CONNECTION *work, size_t num_tasks, size_t size_data)
+{
+    if (!manager_reserve_buffer(&work->tx_raw, &work->tx_raw_capacity, size_data) ||
+        !manager_reserve_buffer(&work->tx_packed, &work->tx_packed_capacity, size_data)) {
+        return size_data;
+    }
+    struct iovec *iov = work->batch_iov;
+    char *raw = work->tx_raw;
+    for (size_t i = 3; i < 3 + 2 * num_tasks; ++i) {
+        memcpy(raw, iov[i].iov_base, iov[i].iov_len);
+        raw += iov[i].iov_len;
+    }
+    size_t packed = cluster_lz_compress(work->tx_raw, size_data, work->tx_packed + sizeof(size_data),
+                                        size_data - sizeof(size_data) - 1);
+    if (packed == 0) {
+        return size_data;
+    }
+    memcpy(work->tx_packed, &size_data, sizeof(size_data));
+    packed += sizeof(size_data);
+    work->tx_header[1] = packed | CLUSTER_COMPRESSED;
+    iov[3].iov_base = work->tx_packed;
+    iov[3].iov_len = packed;
+    work->tx_iovcnt = 4;
+    // Сжатый пакет уже является копией данных задач.
+    work->tx_flags = 0;
+    return packed;
+}
+
+// Отправка пакета из num_tasks задач, собранного в work->in_flight сразу за задачами в пути.
+// Задачи пакета сразу считаются находящимися в пути; то, что не поместилось в буфер сокета,
+// досылается manager_flush_tasks, когда сокет снова готов к записи.
+static bool manager_send_tasks(INFO_MANAGER *manager, WORK_CONNECTION *work, size_t num_tasks) {
 
-    work->num_last_tasks_send = num_tasks;
+    uint64_t trace_start = cluster_trace_begin(manager->trace);
+    TASK_ENTRY **batch = work->in_flight + work->num_tasks_in_flight;
     size_t size_data = 0;
-    char *data_ptr = data;
+    struct iovec *iov = work->batch_iov;
+    // Размер каждой задачи передаётся перед её данными прямо из записи задачи.
     for (size_t i = 0; i < num_tasks; ++i) {
-        size_data += *((size_t *)data_ptr) + sizeof(size_data);
-        data_ptr += sizeof(size_data) + (size_t)*data_ptr;
+        work->batch_ids[i] = batch[i]->task_id;
+        work->batch_entries[i] = batch[i];
+        iov[3 + 2 * i].iov_base = &batch[i]->size;
+        iov[3 + 2 * i].iov_len = sizeof(batch[i]->size);
+        iov[4 + 2 * i].iov_base = (char *)batch[i]->data;
+        iov[4 + 2 * i].iov_len = batch[i]->size;
+        size_data += sizeof(batch[i]->size) + batch[i]->size;
+        batch[i]->copies++;
     }
-    DEBUG("manager send num_tasks: %lu\n",num_tasks);
-    size_t bytes_written = write(work->client_sock_fd,&num_tasks,sizeof(num_tasks));
-    if (bytes_written != sizeof(num_tasks))
-    {
-        fprintf(stderr, "Unable to send num_tasks to client,\
-            Send %lu --- need %lu\n", bytes_written, sizeof(num_tasks));
-        return 0;
+    work->tx_job = batch[0]->job;
+    work->tx_job->tx_refs++;
+    work->tx_header[0] = num_tasks;
+    work->tx_header[1] = size_data;
+    iov[0].iov_base = &work->tx_header[0];
+    iov[0].iov_len = sizeof(work->tx_header[0]);
+    iov[1].iov_base = &work->tx_header[1];
+    iov[1].iov_len = sizeof(work->tx_header[1]);
+    iov[2].iov_base = work->batch_ids;
+    iov[2].iov_len = num_tasks * sizeof(*work->batch_ids);
+    work->tx_iov = iov;
+    work->tx_iovcnt = 3 + 2 * num_tasks;
+    work->tx_flags = work->zerocopy_threshold != 0 && size_data >= work->zerocopy_threshold ? MSG_ZEROCOPY : 0;
+    size_t wire_size = size_data;
+    if (work->codec == CLUSTER_CODEC_LZ && size_data >= CLUSTER_CODEC_MIN_SIZE) {
+        wire_size = manager_pack_tasks(work, num_tasks, size_data);
     }
-    DEBUG("manager send size_data: %lu\n", size_data);
-    bytes_written = write(work->client_sock_fd, &size_data, sizeof(size_data));
-    if (bytes_written != sizeof(size_data))
-    {
-        fprintf(stderr, "Unable to send size_data to client,\
-            Send %lu --- need %lu\n", bytes_written, size_data);
-        return 0;
+    manager->codec_stats.tx_raw_bytes += size_data;
+    manager->codec_stats.tx_wire_bytes += wire_size;
+    work->stats.batches_sent++;
+    work->stats.tasks_dispatched += num_tasks;
+    work->stats.bytes_out += sizeof(work->tx_header) + num_tasks * sizeof(*work->batch_ids) + wire_size;
+    double now = manager_now();
+    for (size_t i = 0; i < num_tasks; ++i) {
+        work->in_flight_sent[work->num_tasks_in_flight + i] = now;
     }
-    bytes_written = write(work->client_sock_fd, data, size_data);
-    if (bytes_written != size_data)
-    {
-        fprintf(stderr, "Unable to send tasks to client,\
-            Send %lu --- need %lu\n", bytes_written, size_data);
-        return 0;
+    manager_idle_update(work, now);
+    // Начало периода занятости узла.
+    if (work->num_tasks_in_flight == 0) {
+        work->rate_mark = now;
     }
-    DEBUG("Send data with size: %lu\n",size_data);
+    work->num_tasks_in_flight += num_tasks;
     work->state = WAIT_ANS;
-    return size_data;
+
+    DEBUG("manager send num_tasks: %lu, size_data: %lu\n", num_tasks, size_data);
+    bool sent = manager_flush_tasks(work);
+    cluster_trace_span(manager->trace, "manager_send_tasks", trace_start, "worker", work->stats.id, "tasks", num_tasks);
+    return sent;
 }
 
-static bool manager_get_worker_ans(WORK_CONNECTION *work, char **ans) {
-    for(size_t num_ans = 0; num_ans < work->num_last_tasks_send; ++num_ans){
-        size_t ans_size = 0;
-        size_t bytes_read = recv(work->client_sock_fd, &ans_size, sizeof(ans_size), 0);
-        if (bytes_read != sizeof(ans_size))
-        {
-            fprintf(stderr, "can't get size: get %lu bytes from worker, expected %ld\n",bytes_read, sizeof(ans_size));
+// Место для результата задачи entry размером size байт: для приёмника - буфер соединения,
+// с таблицей slots - ячейка задачи, иначе - очередное место в job->ans (его резервирует вызывающий).
+// Для пустого результата *dst может быть NULL. Возвращает false при ошибке задания (job->failed).
+static bool manager_result_dst(WORK_CONNECTION *work, TASK_ENTRY *entry, size_t size, char **dst)
+{
+    MANAGER_JOB *job = entry->job;
+    if (job->sink.on_result != NULL) {
+        if (!manager_reserve_buffer(&work->rx_buf, &work->rx_buf_size, size)) {
+            fprintf(stderr, "[manager_result_dst] No memory for result of %lu bytes\n", size);
+            job->failed = true;
             return false;
         }
-        bytes_read = recv(work->client_sock_fd, *ans, ans_size, MSG_WAITALL);
-        if(bytes_read == 0) {
-            fprintf(stderr, "Get %lu bytes from worker, expected %lu\n",bytes_read, ans_size);
+        *dst = work->rx_buf;
+        return true;
+    }
+    if (job->slots != NULL) {
+        if (size > job->slots[entry->index].size) {
+            fprintf(stderr, "Result of task %lu does not fit its slot: %lu > %lu\n",
+                    entry->index, size, job->slots[entry->index].size);
+            job->failed = true;
             return false;
         }
-        while (bytes_read != ans_size)
-        {
-            size_t new_bytes_read = recv(work->client_sock_fd, *ans + bytes_read, ans_size - bytes_read, 0);
-            if (new_bytes_read == 0){
-                fprintf(stderr, "Get %lu bytes from worker, expected %lu\n",bytes_read, ans_size);
-                return false;
+        *dst = job->ans + job->slots[entry->index].offset;
+        return true;
+    }
+    *dst = job->ans;
+    return true;
+}
+
+// Разбор заголовка результата: определяется, куда принимать результат.
+// Результаты приходят в порядке завершения задач. Результат для приёмника принимается в буфер
+// соединения. Без таблицы slots место в job->ans резервируется последовательно,
+// иначе результат записывается в ячейку своей задачи. Сжатый результат принимается в буфер
+// соединения, его место определяется после распаковки.
+// Результат задачи, уже полученный (или принимаемый) от другого рабочего узла, отбрасывается.
+// Ошибка задания (job->failed) не разрывает соединение: результат отбрасывается, узел продолжает
+// выполнять задачи остальных заданий. Возвращает false только при нарушении протокола.
+static bool manager_begin_worker_ans(WORK_CONNECTION *work)
+{
+    RESULT_HEADER *header = &work->rx_header.result;
+    bool packed = (header->size & CLUSTER_COMPRESSED) != 0;
+    header->size &= ~CLUSTER_COMPRESSED;
+    work->stats.bytes_in += sizeof(*header) + header->size;
+    if (packed && (work->codec == CLUSTER_CODEC_NONE || header->size < sizeof(size_t))) {
+        fprintf(stderr, "Unexpected compressed result from worker\n");
+        return false;
+    }
+
+    // Задача должна находиться среди задач в пути этого рабочего узла.
+    size_t pos = 0;
+    while (pos < work->num_tasks_in_flight && work->in_flight[pos]->task_id != header->task_id) {
+        ++pos;
+    }
+    work->rx_left = header->size;
+    if (pos == work->num_tasks_in_flight) {
+        // Результат задачи завершённого задания.
+        size_t stale = 0;
+        while (stale < work->num_stale && work->stale_ids[stale] != header->task_id) {
+            ++stale;
+        }
+        if (stale == work->num_stale) {
+            fprintf(stderr, "Unexpected task_id %lu from worker\n", header->task_id);
+            return false;
+        }
+        manager_idle_update(work, manager_now());
+        work->stale_ids[stale] = work->stale_ids[--work->num_stale];
+        DEBUG("Skip ans of finished job task %lx\n", header->task_id);
+        work->rx_entry = NULL;
+        work->rx_dst = NULL;
+        work->rx_state = RX_SKIP;
+        return true;
+    }
+    TASK_ENTRY *entry = work->in_flight[pos];
+    MANAGER_JOB *job = entry->job;
+    work->rx_entry = entry;
+    work->rx_dst = NULL;
+    work->rx_state = RX_SKIP;
+    if (entry->done || entry->receiving || job->failed) {
+        DEBUG("Skip duplicate ans of task %lu\n", entry->index);
+        return true;
+    }
+
+    if (packed) {
+        if (!manager_reserve_buffer(&work->rx_packed, &work->rx_packed_capacity, header->size)) {
+            fprintf(stderr, "[manager_begin_worker_ans] No memory for result of %lu bytes\n", header->size);
+            job->failed = true;
+            return true;
+        }
+        entry->receiving = true;
+        work->rx_dst = work->rx_packed;
+        work->rx_state = RX_PACKED;
+        return true;
+    }
+    char *dst;
+    if (!manager_result_dst(work, entry, header->size, &dst)) {
+        return true;
+    }
+    if (job->sink.on_result == NULL && job->slots == NULL) {
+        job->ans += header->size;
+    }
+    entry->receiving = true;
+    work->rx_dst = dst;
+    work->rx_state = RX_PAYLOAD;
+    return true;
+}
+
+// Распаковка принятого сжатого результата задачи entry на его место.
+// Возвращает false, если данные повреждены; *unpacked - результат распакован (иначе - отброшен
+// из-за ошибки задания).
+static bool manager_unpack_ans(WORK_CONNECTION *work, TASK_ENTRY *entry, bool *unpacked)
+{
+    MANAGER_JOB *job = entry->job;
+    size_t raw_size;
+    memcpy(&raw_size, work->rx_packed, sizeof(raw_size));
+    *unpacked = false;
+    char *dst;
+    if (job->failed || !manager_result_dst(work, entry, raw_size, &dst)) {
+        return true;
+    }
+    if (!cluster_lz_decompress(work->rx_packed + sizeof(raw_size), work->rx_header.result.size - sizeof(raw_size),
+                               dst, raw_size)) {
+        fprintf(stderr, "Corrupted compressed result of task %lu\n", entry->index);
+        return false;
+    }
+    if (job->sink.on_result == NULL && job->slots == NULL) {
+        job->ans += raw_size;
+    }
+    work->rx_header.result.size = raw_size;
+    *unpacked = true;
+    return true;
+}
+
+// Завершение приёма результата задачи work->rx_entry.
+// Ошибка приёмника результатов прерывает задание (job->failed).
+// Возвращает false только при повреждённом сжатом результате.
+static bool manager_end_worker_ans(INFO_MANAGER *manager, WORK_CONNECTION *work)
+{
+    TASK_ENTRY *entry = work->rx_entry;
+    RX_STATE rx_state = work->rx_state;
+    work->rx_state = RX_HEADER;
+    // Результат задачи завершённого задания только отбрасывается.
+    if (entry == NULL) {
+        return true;
+    }
+    MANAGER_JOB *job = entry->job;
+    size_t wire_size = work->rx_header.result.size;
+    if (rx_state == RX_PACKED) {
+        bool unpacked;
+        entry->receiving = false;
+        if (!manager_unpack_ans(work, entry, &unpacked)) {
+            return false;
+        }
+        if (unpacked) {
+            rx_state = RX_PAYLOAD;
+        }
+    }
+    size_t pos = 0;
+    while (work->in_flight[pos] != entry) {
+        ++pos;
+    }
+    // Задача считается выполненной узлом только после получения результата целиком.
+    double now = manager_now();
+    double round_trip = now - work->in_flight_sent[pos];
+    cluster_hist_add(&work->stats.round_trip, round_trip > 0 ? (size_t)(round_trip * 1e6) : 0);
+    manager_idle_update(work, now);
+    --work->num_tasks_in_flight;
+    work->in_flight[pos] = work->in_flight[work->num_tasks_in_flight];
+    work->in_flight_sent[pos] = work->in_flight_sent[work->num_tasks_in_flight];
+    entry->copies--;
+    if (work->num_tasks_in_flight == 0) {
+        work->state = WAIT_TASK;
+    }
+    manager_rate_update(work, entry->cost);
+    if (rx_state == RX_PAYLOAD) {
+        DEBUG("Get Ans from worker - task: %lu, size: %lu\n", entry->index, work->rx_header.result.size);
+        manager->codec_stats.rx_raw_bytes += work->rx_header.result.size;
+        manager->codec_stats.rx_wire_bytes += wire_size;
+        work->stats.tasks_completed++;
+        entry->receiving = false;
+        if (job->sink.on_result != NULL) {
+            if (!job->sink.on_result(job->sink.ctx, entry->index, work->rx_buf, work->rx_header.result.size)) {
+                fprintf(stderr, "Result sink failed on task %lu\n", entry->index);
+                job->failed = true;
             }
+        } else if (job->slots != NULL) {
+            job->slots[entry->index].size = work->rx_header.result.size;
         }
-        DEBUG("Get Ans from worker - size: %lu\n",ans_size);
-        *ans = *ans + bytes_read;
+        job_complete_entry(job, entry);
     }
+    job_release_entry(job, entry);
+    work->rx_entry = NULL;
     return true;
 }
 
-static bool manager_close_worker_socket(WORK_CONNECTION *work) {
-    size_t end_tasks = 0;
-    write(work->client_sock_fd,&end_tasks,sizeof(end_tasks));
-    if (close(work->client_sock_fd) == -1)
+// Приём всех доступных данных от рабочего узла (сокет неблокирующий, события - по фронту).
+// Приём продолжается с того места, где остановился в прошлый раз.
+// Возвращает false при разрыве соединения или нарушении протокола.
+// Ошибки заданий отмечаются в самих заданиях (job->failed).
+static bool manager_read_worker(INFO_MANAGER *manager, WORK_CONNECTION *work)
+{
+    char skip_buf[4096];
+    while (true) {
+        char *buf;
+        size_t len;
+        if (work->rx_state == RX_HEADER) {
+            size_t header_size = work->state == GET_INFO ? sizeof(work->rx_header.info)
+                                                         : sizeof(work->rx_header.result);
+            buf = (char *)&work->rx_header + work->rx_header_got;
+            len = header_size - work->rx_header_got;
+        } else if (work->rx_state == RX_PAYLOAD || work->rx_state == RX_PACKED) {
+            buf = work->rx_dst;
+            len = work->rx_left;
+        } else {
+            buf = skip_buf;
+            len = work->rx_left < sizeof(skip_buf) ? work->rx_left : sizeof(skip_buf);
+        }
+
+        ssize_t bytes_read = 0;
+        if (len != 0) {
+            bytes_read = work->shm != NULL ? cluster_shm_recv_some(work->shm, buf, len)
+                                           : work->transport->recv(work->client_sock_fd, buf, len, MSG_DONTWAIT);
+            if (bytes_read == 0) {
+                DEBUG("Worker closed connection\n");
+                return false;
+            }
+            if (bytes_read == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return true;
+                }
+                fprintf(stderr, "Unable to recv data from worker\n");
+                return false;
+            }
+        }
+
+        if (work->rx_state == RX_HEADER) {
+            work->rx_header_got += bytes_read;
+            if ((size_t)bytes_read != len) {
+                continue;
+            }
+            work->rx_header_got = 0;
+            if (work->state == GET_INFO) {
+                if (!manager_get_worker_info(manager, work)) {
+                    return false;
+                }
+                continue;
+            }
+            if (!manager_begin_worker_ans(work)) {
+                return false;
+            }
+        } else {
+            work->rx_left -= bytes_read;
+            if (work->rx_state == RX_PAYLOAD || work->rx_state == RX_PACKED) {
+                work->rx_dst += bytes_read;
+            }
+        }
+        if (work->rx_state != RX_HEADER && work->rx_left == 0 && !manager_end_worker_ans(manager, work)) {
+            return false;
+        }
+    }
+}
+
+// Отправка всех данных iov вне цикла событий с ожиданием не позже момента deadline (см. manager_now).
+// Возвращает false при разрыве соединения или истечении времени: узел, не принимающий данные,
+// не задерживает закрытие сессии.
+static bool manager_send_until(WORK_CONNECTION *work, struct iovec *iov, size_t iovcnt, double deadline)
+{
+    while (true) {
+        bool sent = work->shm != NULL ? cluster_shm_sendv_some(work->shm, &iov, &iovcnt)
+                                      : work->transport->sendv_some(work->client_sock_fd, &iov, &iovcnt, 0);
+        if (!sent) {
+            return false;
+        }
+        if (iovcnt == 0) {
+            return true;
+        }
+        double left = deadline - manager_now();
+        if (left <= 0) {
+            fprintf(stderr, "Worker does not accept data, close connection\n");
+            return false;
+        }
+        // Ожидание места в кольце разделяемой памяти - как в manager_handle_worker.
+        struct pollfd pollfd = {
+            .fd = work->client_sock_fd,
+            .events = work->shm != NULL ? POLLIN : POLLOUT,
+        };
+        if (poll(&pollfd, 1, (int)(left * 1000) + 1) == -1 && errno != EINTR) {
+            return false;
+        }
+        if (work->shm != NULL && (pollfd.revents & POLLIN) && !cluster_shm_drain(work->client_sock_fd)) {
+            return false;
+        }
+    }
+}
+
+// Закрытие соединения: недосланный пакет и признак завершения отправляются не позже момента deadline
+// (см. manager_now; срок общий для всех закрываемых вместе соединений, 0 - без ожидания).
+static bool manager_close_worker_socket(WORK_CONNECTION *work, double deadline) {
+    if (work->client_sock_fd != -1) {
+        // Недосланный пакет отправляется целиком, иначе рабочий узел не распознает признак завершения.
+        size_t end_tasks = 0;
+        struct iovec end_iov = { .iov_base = &end_tasks, .iov_len = sizeof(end_tasks) };
+        bool sent = manager_send_until(work, work->tx_iov, work->tx_iovcnt, deadline) &&
+                    manager_send_until(work, &end_iov, 1, deadline);
+        // Данные, отправленные без копирования, не должны меняться, пока ядро их передаёт.
+        while (sent && work->zerocopy_num != 0) {
+            double left = deadline - manager_now();
+            struct pollfd pollfd = { .fd = work->client_sock_fd, .events = 0 };
+            if (left <= 0 || poll(&pollfd, 1, (int)(left * 1000) + 1) <= 0 || (pollfd.revents & POLLHUP) ||
+                !manager_drain_error_queue(work)) {
+                break;
+            }
+        }
+    }
+    // Отправки без уведомлений (соединение разорвано или время истекло) больше не удерживают задания:
+    // ядро само держит отправляемые страницы, а их содержимое узлу уже не нужно.
+    manager_zerocopy_completed(work, work->zerocopy_seq);
+    free(work->zerocopy_pins);
+    work->zerocopy_pins = NULL;
+    work->zerocopy_num = 0;
+    work->zerocopy_capacity = 0;
+    manager_tx_finished(work);
+    if (work->shm != NULL) {
+        cluster_shm_detach(work->shm);
+        free(work->shm);
+        work->shm = NULL;
+    }
+    free(work->rx_buf);
+    work->rx_buf = NULL;
+    work->rx_buf_size = 0;
+    free(work->rx_packed);
+    work->rx_packed = NULL;
+    work->rx_packed_capacity = 0;
+    free(work->tx_raw);
+    work->tx_raw = NULL;
+    work->tx_raw_capacity = 0;
+    free(work->tx_packed);
+    work->tx_packed = NULL;
+    work->tx_packed_capacity = 0;
+    free(work->batch_ids);
+    work->batch_ids = NULL;
+    free(work->batch_entries);
+    work->batch_entries = NULL;
+    free(work->in_flight);
+    work->in_flight = NULL;
+    free(work->in_flight_sent);
+    work->in_flight_sent = NULL;
+    free(work->stale_ids);
+    work->stale_ids = NULL;
+    free(work->batch_iov);
+    work->batch_iov = NULL;
+    if (work->client_sock_fd == -1) {
+        return true;
+    }
+    if (work->transport->close(work->client_sock_fd, NULL, 0) == -1)
     {
         fprintf(stderr, "[manager_close_worker_socket] Unable to close() worker-socket\n");
         return false;
     }
     work->client_sock_fd = -1;
     return true;
-}
\ No newline at end of file
+}
+
+// Отсоединение узла от завершённого задания job: задачи задания в пути становятся устаревшими,
+// их результаты будут приняты и отброшены, а место в окне узла они занимают, пока не вернутся.
+// Недосланный пакет задания досылается циклом событий, когда сокет готов к записи:
+// до этого записи и данные задания не освобождаются (job->tx_refs).
+// Задачи остальных заданий остаются в пути. Возвращает false при нехватке памяти.
+static bool manager_detach_job(WORK_CONNECTION *work, MANAGER_JOB *job)
+{
+    // Принимаемый результат задания дочитывается и отбрасывается, его задача покидает окно узла.
+    TASK_ENTRY *rx_entry = NULL;
+    if (work->rx_state != RX_HEADER && work->rx_entry != NULL && work->rx_entry->job == job) {
+        rx_entry = work->rx_entry;
+        work->rx_entry = NULL;
+        work->rx_dst = NULL;
+        work->rx_state = RX_SKIP;
+    }
+    size_t num_job = 0;
+    for (size_t i = 0; i < work->num_tasks_in_flight; ++i) {
+        num_job += work->in_flight[i]->job == job && work->in_flight[i] != rx_entry;
+    }
+    size_t need = work->num_stale + num_job;
+    if (need > work->stale_capacity) {
+        size_t *stale_ids = realloc(work->stale_ids, need * sizeof(*stale_ids));
+        if (stale_ids == NULL) {
+            fprintf(stderr, "[manager_detach_job] No memory for %lu stale tasks\n", need);
+            return false;
+        }
+        work->stale_ids = stale_ids;
+        work->stale_capacity = need;
+    }
+    manager_idle_update(work, manager_now());
+    size_t kept = 0;
+    for (size_t i = 0; i < work->num_tasks_in_flight; ++i) {
+        if (work->in_flight[i] == rx_entry) {
+            continue;
+        }
+        if (work->in_flight[i]->job == job) {
+            work->stale_ids[work->num_stale++] = work->in_flight[i]->task_id;
+        } else {
+            work->in_flight_sent[kept] = work->in_flight_sent[i];
+            work->in_flight[kept++] = work->in_flight[i];
+        }
+    }
+    work->num_tasks_in_flight = kept;
+    return true;
+}
+
+// Отказ рабочего узла: соединение закрывается, его невыполненные задачи возвращаются в очередь.
+static void manager_worker_failed(WORK_CONNECTION *work)
+{
+    fprintf(stderr, "Worker connection lost, requeue %lu tasks\n", work->num_tasks_in_flight);
+    manager_idle_update(work, manager_now());
+    work->stats.tasks_requeued += work->num_tasks_in_flight;
+    // Недопринятый результат будет получен заново.
+    if (work->rx_state == RX_PAYLOAD || work->rx_state == RX_PACKED) {
+        work->rx_entry->receiving = false;
+    }
+    for (size_t i = 0; i < work->num_tasks_in_flight; ++i) {
+        TASK_ENTRY *entry = work->in_flight[i];
+        entry->copies--;
+        job_retry_entry(entry->job, entry);
+        job_release_entry(entry->job, entry);
+    }
+    work->num_tasks_in_flight = 0;
+    work->num_stale = 0;
+    // Соединение разорвано: досылать пакет и признак завершения некуда.
+    manager_tx_finished(work);
+    if (work->client_sock_fd != -1) {
+        work->transport->close(work->client_sock_fd, NULL, 0);
+        work->client_sock_fd = -1;
+    }
+    manager_close_worker_socket(work, 0);
+    work->state = WORK_FAILED;
+}
@@ -1,238 +1,1638 @@
 #include "manager-common.h"
 #include <memory.h>
-#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <math.h>
 #include <sched.h>
 #include <pthread.h>
+#include <limits.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 
-static void poll_server_wait_for_worker(struct pollfd* pollfds, INFO_MANAGER* server)
+// Максимальное количество событий, получаемых за один вызов epoll_wait.
+#define MANAGER_MAX_EVENTS 64
+
+// Узел получает за раз не более 1 / MANAGER_GSS_FACTOR своей доли оставшихся задач.
+#define MANAGER_GSS_FACTOR 2
+// Пакет для задания с неизвестным количеством задач рассчитан на столько секунд работы узла.
+#define MANAGER_BATCH_SECONDS 0.02
+// Наибольший размер пакета в расчёте на одно ядро узла.
+#define MANAGER_MAX_BATCH_PER_CORE 64
+
+// Состояние цикла событий Управляющего узла.
+typedef struct
 {
-    struct pollfd* pollfd = &pollfds[0U];
+    // Дескриптор epoll: слушающий сокет (data.ptr == NULL) и соединения с узлами (data.ptr - узел).
+    int epoll_fd;
+    // Подключённые узлы.
+    WORK_CONNECTION *conns;
+    // Узлы со свободным окном, для которых при последней попытке не нашлось задач.
+    WORK_CONNECTION *idle;
+    // Отказавшие узлы; освобождаются после обработки текущей порции событий.
+    WORK_CONNECTION *dead;
+    // Количество подключённых узлов.
+    size_t num_alive;
+    // Суммарное количество ядер узлов, приславших информацию о себе.
+    size_t total_cores;
+    // Суммарная скорость узлов с измеренной скоростью и количество их ядер.
+    double total_rate;
+    size_t rated_cores;
+    // Выполняемые задания по убыванию приоритета (при равном приоритете - в порядке начала).
+    MANAGER_JOB *run_first;
+    // Номер текущей раздачи задач узлу.
+    size_t dispatch_mark;
+    // Количество узлов, подключавшихся к сессии (номер следующего узла в статистике).
+    size_t num_seen;
+    // Количество отключившихся узлов и сумма их статистики.
+    size_t num_lost;
+    MANAGER_WORKER_STATS lost_stats;
+} MANAGER_LOOP;
 
-    pollfd->fd      = server->listen_sock_fd;
-    pollfd->events  = POLLIN;
-    pollfd->revents = 0U;
+// Включение задания в список выполняемых заданий. Виртуальное время задания начинается
+// с наименьшего среди заданий того же приоритета: задание не получает узлы впрок за время,
+// когда его не было, и не ждёт, пока остальные задания израсходуют накопленное время.
+static void manager_run_add(MANAGER_LOOP *loop, MANAGER_JOB *job)
+{
+    MANAGER_JOB *prev = NULL;
+    MANAGER_JOB *next = loop->run_first;
+    bool first = true;
+    while (next != NULL && next->priority >= job->priority) {
+        if (next->priority == job->priority && (first || next->vtime < job->vtime)) {
+            job->vtime = next->vtime;
+            first = false;
+        }
+        prev = next;
+        next = next->run_next;
+    }
+    job->run_prev = prev;
+    job->run_next = next;
+    if (prev != NULL) {
+        prev->run_next = job;
+    } else {
+        loop->run_first = job;
+    }
+    if (next != NULL) {
+        next->run_prev = job;
+    }
 }
 
-static void poll_server_do_not_wait_for_workers(struct pollfd* pollfds)
+static void manager_run_remove(MANAGER_LOOP *loop, MANAGER_JOB *job)
 {
-    struct pollfd* pollfd = &pollfds[0U];
+    if (job->run_prev != NULL) {
+        job->run_prev->run_next = job->run_next;
+    } else {
+        loop->run_first = job->run_next;
+    }
+    if (job->run_next != NULL) {
+        job->run_next->run_prev = job->run_prev;
+    }
+    job->run_prev = NULL;
+    job->run_next = NULL;
+}
 
-    pollfd->fd      = -1;
-    pollfd->events  = 0U;
-    pollfd->revents = 0U;
+static void manager_idle_push(MANAGER_LOOP *loop, WORK_CONNECTION *work)
+{
+    if (work->idle) {
+        return;
+    }
+    work->idle = true;
+    work->idle_prev = NULL;
+    work->idle_next = loop->idle;
+    if (loop->idle != NULL) {
+        loop->idle->idle_prev = work;
+    }
+    loop->idle = work;
 }
 
-static void poll_manager_wait_for_answer(struct pollfd* pollfds, size_t conn_i, WORK_CONNECTION *work) {
-    struct pollfd* pollfd = &pollfds[1 + conn_i];
+static void manager_idle_remove(MANAGER_LOOP *loop, WORK_CONNECTION *work)
+{
+    if (!work->idle) {
+        return;
+    }
+    work->idle = false;
+    if (work->idle_prev != NULL) {
+        work->idle_prev->idle_next = work->idle_next;
+    } else {
+        loop->idle = work->idle_next;
+    }
+    if (work->idle_next != NULL) {
+        work->idle_next->idle_prev = work->idle_prev;
+    }
+}
 
-    pollfd->fd      = work->client_sock_fd;
-    pollfd->events  = POLLIN | POLLHUP | POLLERR;
-    pollfd->revents = 0U;
+// Отказ узла: его задачи возвращаются в очередь, сам узел освобождается после обработки текущих событий.
+static void manager_connection_failed(MANAGER_LOOP *loop, WORK_CONNECTION *work)
+{
+    // Без таблицы slots место, зарезервированное под недопринятый результат, освобождается:
+    // принятые после него результаты того же задания сдвигаются, чтобы ответы шли подряд.
+    MANAGER_JOB *job = work->rx_state == RX_PAYLOAD ? work->rx_entry->job : NULL;
+    if (job != NULL && job->slots == NULL && job->sink.on_result == NULL) {
+        size_t size = work->rx_header.result.size;
+        char *start = work->rx_dst - (size - work->rx_left);
+        memmove(start, start + size, job->ans - (start + size));
+        job->ans -= size;
+        for (WORK_CONNECTION *other = loop->conns; other != NULL; other = other->next) {
+            if (other->rx_state == RX_PAYLOAD && other->rx_entry->job == job && other->rx_dst > start) {
+                other->rx_dst -= size;
+            }
+        }
+    }
+    bool counted = work->state != GET_INFO;
+    if (counted) {
+        loop->total_cores -= work->n_cores;
+        if (work->rate > 0) {
+            loop->total_rate -= work->rate;
+            loop->rated_cores -= work->n_cores;
+        }
+    }
+    manager_worker_failed(work);
+    // Статистика узла остаётся в статистике сессии.
+    if (counted) {
+        manager_stats_merge(&loop->lost_stats, &work->stats);
+        loop->num_lost++;
+    }
+    manager_idle_remove(loop, work);
+    if (work->prev != NULL) {
+        work->prev->next = work->next;
+    } else {
+        loop->conns = work->next;
+    }
+    if (work->next != NULL) {
+        work->next->prev = work->prev;
+    }
+    work->next = loop->dead;
+    loop->dead = work;
+    loop->num_alive--;
 }
 
-static void poll_manager_do_not_wait_for_ans(struct pollfd* pollfds, size_t conn_i){
-    struct pollfd* pollfd = &pollfds[conn_i + 1];
+// Закрытие и освобождение соединений списка list с общим сроком досылки deadline
+// (см. manager_close_worker_socket). Соединения отказавших узлов уже закрыты, для них deadline - 0.
+static void manager_free_connections(WORK_CONNECTION *list, double deadline)
+{
+    while (list != NULL) {
+        WORK_CONNECTION *next = list->next;
+        manager_close_worker_socket(list, deadline);
+        free(list);
+        list = next;
+    }
+}
 
-    pollfd->fd      = -1;
-    pollfd->events  = 0U;
-    pollfd->revents = 0U;
+// Приём всех ожидающих подключения рабочих узлов.
+// Ошибка подключения отдельного узла не прерывает вычисление.
+static bool manager_add_workers(INFO_MANAGER *manager, MANAGER_LOOP *loop)
+{
+    while (true) {
+        WORK_CONNECTION *work = calloc(1, sizeof(*work));
+        if (work == NULL) {
+            fprintf(stderr, "[manager_add_workers] No memory for connections\n");
+            return false;
+        }
+        if (!manager_accept_connection_request(manager, work)) {
+            free(work);
+            return true;
+        }
+        if (work->state == WORK_FAILED) {
+            free(work);
+            continue;
+        }
+        struct epoll_event event = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = work,
+        };
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, work->client_sock_fd, &event) == -1) {
+            fprintf(stderr, "[manager_add_workers] Unable to add worker to epoll\n");
+            manager_close_worker_socket(work, 0);
+            free(work);
+            continue;
+        }
+        work->next = loop->conns;
+        if (loop->conns != NULL) {
+            loop->conns->prev = work;
+        }
+        loop->conns = work;
+        loop->num_alive++;
+        work->stats.id = loop->num_seen++;
+    }
 }
 
-static void poll_manager_wait_work_info(struct pollfd* pollfds, size_t conn_i, WORK_CONNECTION *work) {
-    struct pollfd* pollfd = &pollfds[1 + conn_i];
+// Самая старая невыполненная задача, которую можно продублировать на рабочем узле work.
+// batch_len - количество задач, уже собранных в отправляемый пакет.
+static TASK_ENTRY *manager_speculative_entry(MANAGER_JOB *job, WORK_CONNECTION *work, size_t batch_len)
+{
+    for (TASK_ENTRY *entry = job->pending_first; entry != NULL; entry = entry->next) {
+        if (entry->copies >= MANAGER_MAX_COPIES || entry->receiving) {
+            continue;
+        }
+        bool taken = false;
+        for (size_t i = 0; i < work->num_tasks_in_flight + batch_len && !taken; ++i) {
+            taken = work->in_flight[i] == entry;
+        }
+        if (!taken) {
+            return entry;
+        }
+    }
+    return NULL;
+}
 
-    pollfd->fd      = work->client_sock_fd;
-    pollfd->events  = POLLIN|POLLHUP|POLLERR;
-    pollfd->revents = 0U;
+// Стоимость очередного пакета для узла work (guided self-scheduling).
+// Узел получает долю стоимости оставшихся задач, пропорциональную количеству его ядер и скорости
+// его ядра относительно средней по узлам с измеренной скоростью, делённую на MANAGER_GSS_FACTOR:
+// в начале задания пакеты крупные, к концу уменьшаются до одной задачи на ядро.
+// Если количество задач неизвестно, пакет рассчитан на MANAGER_BATCH_SECONDS работы узла,
+// чтобы мелкие задачи не отправлялись по одной на ядро.
+static double manager_batch_cost(INFO_MANAGER *manager, MANAGER_LOOP *loop, MANAGER_JOB *job, WORK_CONNECTION *work)
+{
+    if (!manager->adaptive_batch || job->source_done) {
+        return 0;
+    }
+    if (job->num_tasks_total != 0) {
+        double speed = 1;
+        if (work->rate > 0 && loop->rated_cores != 0 && loop->total_rate > 0) {
+            speed = (work->rate / work->n_cores) / (loop->total_rate / loop->rated_cores);
+        }
+        return (job->cost_total - job->cost_send) * work->n_cores * speed /
+               (MANAGER_GSS_FACTOR * loop->total_cores);
+    }
+    return work->rate * MANAGER_BATCH_SECONDS;
 }
 
-static bool wait_and_get_info_workers(INFO_MANAGER* manager, WORK_CONNECTION *works, struct pollfd *pollfds) {
-    size_t num_connected_workers = 0U;
-    size_t num_init_workers = 0U;
-    while (num_init_workers != manager->num_nodes)
-    {
-        if (num_connected_workers != manager->num_nodes) {
-            poll_server_wait_for_worker(pollfds, manager);
-        } else {
-            poll_server_do_not_wait_for_workers(pollfds);
-        }
-        int pollret = poll(pollfds, 1U + num_connected_workers, -1);
-        if (pollret == -1)
-        {
-            fprintf(stderr, "Unable to poll-wait for data on descriptors!\n");
-            goto error;
-        }
-
-        if (pollfds[0U].revents & POLLIN)
-        {
-            if(!manager_accept_connection_request(manager, &works[num_connected_workers])){
-                goto error;
-            }
+// Есть ли у задания задачи, которые можно отправить узлам.
+static bool manager_has_work(INFO_MANAGER *manager, MANAGER_JOB *job)
+{
+    return !job->failed && (job->retry_first != NULL || !job->source_done ||
+                            (manager->speculative && job->pending_first != NULL));
+}
 
-            poll_manager_wait_work_info(pollfds, num_connected_workers, &works[num_connected_workers]);
-            num_connected_workers++;
-        } 
+// Задание для очередного пакета: из заданий с задачами - задание с наибольшим приоритетом,
+// а среди заданий равного приоритета - с наименьшим виртуальным временем (взвешенное справедливое
+// разделение узлов). Задания, для которых при текущей раздаче не нашлось задач, пропускаются.
+static MANAGER_JOB *manager_pick_job(INFO_MANAGER *manager, MANAGER_LOOP *loop)
+{
+    MANAGER_JOB *best = NULL;
+    for (MANAGER_JOB *job = loop->run_first; job != NULL; job = job->run_next) {
+        if (best != NULL && job->priority < best->priority) {
+            break;
+        }
+        if (job->dispatch_mark == loop->dispatch_mark || !manager_has_work(manager, job)) {
+            continue;
+        }
+        if (best == NULL || job->vtime < best->vtime) {
+            best = job;
+        }
+    }
+    return best;
+}
 
-        for (size_t conn_i = 0U; conn_i < num_connected_workers; ++conn_i)
-        {
-            if (pollfds[1U + conn_i].revents & (POLLHUP | POLLERR))
-            {  
-                fprintf(stderr, "Unexpected POLLHUP\n");
-                goto error;
+// Дозаполнение окна рабочего узла: пока задач в пути меньше n_cores + window, узлу отправляются
+// пакеты не меньше одной задачи на ядро, в режиме adaptive_batch - стоимостью до manager_batch_cost
+// (но не больше MANAGER_MAX_BATCH_PER_CORE задач на ядро).
+// Каждый пакет собирается из задач одного задания, выбранного manager_pick_job.
+// В первую очередь отправляются задачи отказавших узлов, затем новые задачи;
+// когда новые задачи закончились, в режиме speculative отправляются копии самых старых невыполненных.
+// Пока предыдущий пакет не отправлен целиком, новый не собирается.
+// Узел со свободным окном, для которого не нашлось задач, попадает в список простаивающих.
+// Отказ узла при отправке не является ошибкой: его задачи возвращаются в очередь.
+// Ошибка задания отмечается в нём (job->failed), задание завершается циклом событий.
+static void manager_dispatch(INFO_MANAGER *manager, MANAGER_LOOP *loop, WORK_CONNECTION *work)
+{
+    manager_idle_remove(loop, work);
+    loop->dispatch_mark++;
+    // Задачи завершённых заданий, которые узел ещё выполняет, занимают место в его окне.
+    while (work->tx_iovcnt == 0 && work->num_tasks_in_flight + work->num_stale < work->refill_level) {
+        MANAGER_JOB *job = manager_pick_job(manager, loop);
+        if (job == NULL) {
+            manager_idle_push(loop, work);
+            break;
+        }
+        size_t credit = work->refill_level - work->num_tasks_in_flight - work->num_stale;
+        size_t min_batch = work->n_cores < credit ? work->n_cores : credit;
+        size_t max_batch = manager->adaptive_batch ? MANAGER_MAX_BATCH_PER_CORE * work->n_cores : min_batch;
+        double budget = manager_batch_cost(manager, loop, job, work);
+        double batch_cost = 0;
+        size_t batch_len = 0;
+        while (batch_len < min_batch || (batch_len < max_batch && batch_cost < budget)) {
+            if (!manager_reserve_batch(work, batch_len + 1)) {
+                job->failed = true;
+                break;
             }
-
-            if (pollfds[1U + conn_i].revents & POLLIN)
-            {
-                switch (works[conn_i].state)
-                {
-                case CONNECTION_EMPTY:
-                case WORK_FINISHED:
-                case WAIT_ANS:
-                    fprintf(stderr, "Unexpected state!\n");
-                    goto error;
-                case GET_INFO:
-                    if(!manager_get_worker_info(&works[conn_i])) {
-                        goto error;
-                    }
-                    num_init_workers++;
+            TASK_ENTRY *entry = job_pop_retry(job);
+            if (entry != NULL) {
+                DEBUG("Resend task %lu\n", entry->index);
+            } else if (!job->source_done) {
+                entry = job_new_entry(job);
+                if (job->failed) {
                     break;
-                case WAIT_TASK:
                 }
             }
+            if (entry == NULL && job->source_done && manager->speculative) {
+                entry = manager_speculative_entry(job, work, batch_len);
+            }
+            if (entry == NULL) {
+                break;
+            }
+            work->in_flight[work->num_tasks_in_flight + batch_len++] = entry;
+            batch_cost += entry->cost;
+        }
+        // Задачи задания с ошибкой не отправляются: задание будет завершено.
+        if (batch_len == 0 || job->failed) {
+            job->dispatch_mark = loop->dispatch_mark;
+            continue;
+        }
+        job->vtime += batch_cost / job->weight;
+        if (!manager_send_tasks(manager, work, batch_len)) {
+            manager_connection_failed(loop, work);
+            break;
         }
     }
-    return true;
-error:
-    for(size_t i = 0; i < num_connected_workers;++i) {
-        manager_close_worker_socket(&works[i]);
+}
+
+// Раздача задач простаивающим узлам (например, задач отказавшего узла или нового задания).
+// Раздача прекращается, как только очередному узлу не нашлось задач.
+static void manager_dispatch_idle(INFO_MANAGER *manager, MANAGER_LOOP *loop)
+{
+    while (loop->idle != NULL) {
+        WORK_CONNECTION *work = loop->idle;
+        manager_dispatch(manager, loop, work);
+        if (work->idle) {
+            break;
+        }
     }
-    return false;
 }
 
-int start_manager(INFO_MANAGER *manager, size_t num_tasks, char tasks[], char *ans) {
-    if (manager == NULL || tasks == NULL || ans == NULL ||
-        manager->max_time == 0 || manager->is_init == false || manager->num_nodes == 0) {
-        return -EINVAL;
+// Обработка событий одного соединения.
+static void manager_handle_worker(INFO_MANAGER *manager, MANAGER_LOOP *loop, WORK_CONNECTION *work, uint32_t events)
+{
+    // События узла, отказавшего при обработке предыдущих событий этой порции.
+    if (work->state == WORK_FAILED) {
+        return;
+    }
+    bool alive = true;
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+        bool was_new = work->state == GET_INFO;
+        double old_rate = work->rate;
+        uint64_t trace_start = cluster_trace_begin(manager->trace);
+        size_t completed = work->stats.tasks_completed;
+        alive = manager_read_worker(manager, work);
+        cluster_trace_span(manager->trace, "manager_read_worker", trace_start,
+                           "worker", work->stats.id, "results", work->stats.tasks_completed - completed);
+        // Суммы по узлам обновляются при изменении данных узла, а не пересчитываются при раздаче.
+        if (was_new && work->state != GET_INFO) {
+            loop->total_cores += work->n_cores;
+        }
+        if (work->rate != old_rate) {
+            if (old_rate == 0) {
+                loop->rated_cores += work->n_cores;
+            }
+            loop->total_rate += work->rate - old_rate;
+        }
+    }
+    // Узел с разделяемой памятью сообщает об освободившемся месте в кольце пробуждением по сокету.
+    if (alive && ((events & EPOLLOUT) || (work->shm != NULL && (events & EPOLLIN)))) {
+        alive = manager_flush_tasks(work);
+    }
+    // EPOLLERR приходит и при появлении уведомлений MSG_ZEROCOPY в очереди ошибок сокета.
+    if (alive && (events & EPOLLERR)) {
+        alive = manager_drain_error_queue(work);
     }
+    if (alive && (events & EPOLLHUP)) {
+        alive = false;
+    }
+    if (!alive) {
+        // Задачи отказавшего узла достаются оставшимся узлам.
+        manager_connection_failed(loop, work);
+        return;
+    }
+    // Освободившиеся ядра сразу получают задачи.
+    if (work->state == WAIT_TASK || work->state == WAIT_ANS) {
+        manager_dispatch(manager, loop, work);
+    }
+}
 
-    WORK_CONNECTION* works = calloc(manager->num_nodes, sizeof(WORK_CONNECTION));
-    struct pollfd* pollfds = calloc(manager->num_nodes + 1U, sizeof(struct pollfd));
+struct MANAGER_JOB_HANDLE
+{
+    MANAGER_SESSION *session;
+    MANAGER_JOB job;
+    JOB_STATUS status;
+    // Начало отсчёта max_time; started == false - ни один узел ещё не подключился.
+    time_t start_time;
+    bool started;
+    // Время начала выполнения задания (для статистики), 0 - задание не начиналось.
+    double run_start;
+    // Задание завершено, но его недосланные пакеты ещё отправляются (job.tx_refs != 0):
+    // состояние closing_status сообщается после их отправки, но не позже closing_since + MANAGER_FLUSH_SECONDS.
+    bool closing;
+    JOB_STATUS closing_status;
+    double closing_since;
+    // Следующее незавершённое задание сессии.
+    struct MANAGER_JOB_HANDLE *next;
+    // Задание отправлено manager_session_submit: описатель принадлежит сессии.
+    bool owned;
+    struct MANAGER_JOB_HANDLE *owned_next;
+    // Соседи в списке описателей сессии, ещё не освобождённых manager_job_release.
+    struct MANAGER_JOB_HANDLE *live_prev;
+    struct MANAGER_JOB_HANDLE *live_next;
+};
 
-    if (works == NULL || pollfds == NULL)
+struct MANAGER_SESSION
+{
+    INFO_MANAGER *manager;
+    MANAGER_LOOP loop;
+    // Незавершённые задания в порядке отправки: выполняемые и ещё не начатые циклом событий.
+    MANAGER_JOB_HANDLE *jobs_first;
+    MANAGER_JOB_HANDLE *jobs_last;
+    // Задания, отправленные manager_session_submit и ещё не дождавшиеся manager_session_wait.
+    MANAGER_JOB_HANDLE *owned;
+    // Все неосвобождённые описатели заданий, в том числе завершённых: при закрытии сессии
+    // они отсоединяются от неё.
+    MANAGER_JOB_HANDLE *handles;
+    // Номер следующего задания.
+    int next_job_id;
+    // eventfd для пробуждения цикла событий при отправке задания или остановке потока.
+    int wake_fd;
+    // timerfd, срабатывающий к ближайшему сроку заданий (max_time, досылка пакетов завершённого задания):
+    // дескриптор manager_session_fd становится готовым к чтению, когда пора вызвать manager_session_process.
+    int timer_fd;
+    // Поток цикла событий, запущенный manager_session_start.
+    pthread_t thread;
+    bool has_thread;
+    _Atomic bool stop;
+    // Ошибка цикла событий, после которой сессия не может выполнять задания.
+    bool broken;
+    // Защищает очередь и состояние заданий; цикл событий удерживает его на время обработки событий.
+    pthread_mutex_t lock;
+    // Сигнализирует о завершении заданий.
+    pthread_cond_t done;
+};
+
+MANAGER_SESSION *manager_session_open(INFO_MANAGER *manager)
+{
+    if (manager == NULL || !manager->is_init) {
+        return NULL;
+    }
+    MANAGER_SESSION *session = calloc(1, sizeof(*session));
+    if (session == NULL) {
+        fprintf(stderr, "[manager_session_open] No memory for session\n");
+        return NULL;
+    }
+    session->manager = manager;
+    session->wake_fd = -1;
+    session->timer_fd = -1;
+    session->loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (session->loop.epoll_fd == -1)
     {
+        fprintf(stderr, "Unable to create epoll instance!\n");
         goto error_clear;
     }
-
-    for (size_t conn_i = 0U; conn_i < manager->num_nodes; conn_i++)
-    {
-        works[conn_i].state = CONNECTION_EMPTY;
+    session->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event wake_event = {
+        .events = EPOLLIN,
+        .data.ptr = &session->wake_fd,
+    };
+    if (session->wake_fd == -1 || epoll_ctl(session->loop.epoll_fd, EPOLL_CTL_ADD, session->wake_fd, &wake_event) == -1) {
+        fprintf(stderr, "[manager_session_open] Unable to create wake-up eventfd\n");
+        goto error_clear;
+    }
+    session->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event timer_event = {
+        .events = EPOLLIN,
+        .data.ptr = &session->timer_fd,
+    };
+    if (session->timer_fd == -1 ||
+        epoll_ctl(session->loop.epoll_fd, EPOLL_CTL_ADD, session->timer_fd, &timer_event) == -1) {
+        fprintf(stderr, "[manager_session_open] Unable to create deadline timerfd\n");
+        goto error_clear;
     }
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&session->done, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutex_init(&session->lock, NULL);
 
     if (!manager_init_socket(manager)) {
-        goto error_clear;
+        goto error_destroy;
     }
-    if(!wait_and_get_info_workers(manager, works, pollfds)) {
+    // Слушающий сокет остаётся в цикле до закрытия сессии: узлы могут подключаться в любой момент.
+    struct epoll_event listen_event = {
+        .events = EPOLLIN | EPOLLET,
+        .data.ptr = NULL,
+    };
+    if (epoll_ctl(session->loop.epoll_fd, EPOLL_CTL_ADD, manager->listen_sock_fd, &listen_event) == -1) {
+        fprintf(stderr, "Unable to add listen socket to epoll!\n");
         manager_close_listen_socket(manager);
-        goto error_clear;
+        goto error_destroy;
+    }
+    // Трассировка ведётся до закрытия сессии; без неё сессия работает как обычно.
+    if (manager->trace_path != NULL) {
+        manager->trace = cluster_trace_create();
     }
-    DEBUG("All workers connected\n");
+    return session;
+error_destroy:
+    pthread_cond_destroy(&session->done);
+    pthread_mutex_destroy(&session->lock);
+error_clear:
+    if (session->timer_fd != -1) {
+        close(session->timer_fd);
+    }
+    if (session->wake_fd != -1) {
+        close(session->wake_fd);
+    }
+    if (session->loop.epoll_fd != -1) {
+        close(session->loop.epoll_fd);
+    }
+    free(session);
+    return NULL;
+}
 
-    if (!manager_close_listen_socket(manager)) {
-        goto error_close;
+// Сбор статистики сессии (под блокировкой сессии): статистика подключённых узлов записывается
+// в workers (не более max_workers). Возвращает количество подключённых узлов.
+static size_t manager_collect_stats(MANAGER_SESSION *session, MANAGER_STATS *stats,
+                                    MANAGER_WORKER_STATS *workers, size_t max_workers)
+{
+    MANAGER_LOOP *loop = &session->loop;
+    double now = manager_now();
+    memset(stats, 0, sizeof(*stats));
+    stats->workers_lost = loop->num_lost;
+    stats->total = loop->lost_stats;
+    stats->codec = session->manager->codec_stats;
+    size_t num_workers = 0;
+    for (WORK_CONNECTION *work = loop->conns; work != NULL; work = work->next) {
+        if (work->state == GET_INFO) {
+            continue;
+        }
+        MANAGER_WORKER_STATS worker;
+        manager_worker_stats(work, now, &worker);
+        manager_stats_merge(&stats->total, &worker);
+        stats->cores_alive += worker.n_cores;
+        if (num_workers < max_workers) {
+            workers[num_workers] = worker;
+        }
+        ++num_workers;
     }
-    time_t start_time = time(NULL);
-    size_t num_tasks_send = 0;
-    size_t num_ans_get = 0;
-    size_t last_num_tasks_send = 0;
-    char *ptr_tasks = tasks;
+    stats->workers_alive = num_workers;
+    return num_workers;
+}
 
-    for (size_t conn_i = 0; conn_i < manager->num_nodes; ++conn_i) {
-        size_t num_tasks_left = num_tasks - num_tasks_send;
-        size_t byte_send = 0;
-        if (!num_tasks_left) {
-            break;
+static void manager_write_worker_stats(FILE *file, const MANAGER_WORKER_STATS *stats)
+{
+    fprintf(file, "\"batches_sent\":%lu,\"tasks_dispatched\":%lu,\"tasks_completed\":%lu,\"tasks_requeued\":%lu,"
+            "\"bytes_out\":%lu,\"bytes_in\":%lu,\"idle_core_us\":%lu,",
+            stats->batches_sent, stats->tasks_dispatched, stats->tasks_completed, stats->tasks_requeued,
+            stats->bytes_out, stats->bytes_in, stats->idle_core_us);
+    cluster_hist_write(file, "round_trip", &stats->round_trip);
+}
+
+// Запись статистики завершённого задания и сессии одной строкой JSON в конец файла manager->stats_path.
+// Ошибка записи не влияет на результат задания.
+static void manager_write_stats(MANAGER_SESSION *session, MANAGER_JOB_HANDLE *handle)
+{
+    const char *path = session->manager->stats_path;
+    MANAGER_STATS stats;
+    size_t num_workers = manager_collect_stats(session, &stats, NULL, 0);
+    MANAGER_WORKER_STATS *workers = calloc(num_workers + 1, sizeof(*workers));
+    if (workers == NULL) {
+        fprintf(stderr, "[manager_write_stats] No memory for stats of %lu workers\n", num_workers);
+        return;
+    }
+    manager_collect_stats(session, &stats, workers, num_workers);
+    FILE *file = fopen(path, "a");
+    if (file == NULL) {
+        fprintf(stderr, "[manager_write_stats] Unable to open %s\n", path);
+        free(workers);
+        return;
+    }
+    MANAGER_JOB *job = &handle->job;
+    fprintf(file, "{\"job\":%lu,\"status\":\"%s\",\"tasks_sent\":%lu,\"results\":%lu,\"seconds\":%.6f,",
+            job->id, handle->status == JOB_DONE ? "done" : "failed", job->num_tasks_send, job->num_ans_get,
+            handle->run_start != 0 ? manager_now() - handle->run_start : 0.0);
+    fprintf(file, "\"session\":{\"workers_alive\":%lu,\"cores_alive\":%lu,\"workers_lost\":%lu,",
+            stats.workers_alive, stats.cores_alive, stats.workers_lost);
+    manager_write_worker_stats(file, &stats.total);
+    fprintf(file, ",\"codec\":{\"tx_raw_bytes\":%lu,\"tx_wire_bytes\":%lu,\"rx_raw_bytes\":%lu,\"rx_wire_bytes\":%lu}},",
+            stats.codec.tx_raw_bytes, stats.codec.tx_wire_bytes, stats.codec.rx_raw_bytes, stats.codec.rx_wire_bytes);
+    fprintf(file, "\"workers\":[");
+    for (size_t i = 0; i < num_workers; ++i) {
+        fprintf(file, "%s{\"id\":%lu,\"n_cores\":%lu,\"connected_us\":%lu,",
+                i == 0 ? "" : ",", workers[i].id, workers[i].n_cores, workers[i].connected_us);
+        manager_write_worker_stats(file, &workers[i]);
+        fprintf(file, "}");
+    }
+    fprintf(file, "]}\n");
+    if (fclose(file) != 0) {
+        fprintf(stderr, "[manager_write_stats] Unable to write %s\n", path);
+    }
+    free(workers);
+}
+
+// Завершение задания: узлы отсоединяются от него и продолжают выполнять остальные задания сессии.
+// Пока недосланные пакеты задания ссылаются на его данные, задание остаётся в очереди сессии
+// и завершается manager_check_jobs после их отправки.
+static void manager_finish_job(MANAGER_SESSION *session, MANAGER_JOB_HANDLE *handle, JOB_STATUS status)
+{
+    MANAGER_LOOP *loop = &session->loop;
+    MANAGER_JOB *job = &handle->job;
+    if (handle->status == JOB_RUNNING && !handle->closing) {
+        for (WORK_CONNECTION *work = loop->conns, *next; work != NULL; work = next) {
+            next = work->next;
+            if (work->state != GET_INFO && !manager_detach_job(work, job)) {
+                manager_connection_failed(loop, work);
+            }
         }
-        last_num_tasks_send = works[conn_i].n_cores > num_tasks_left ? 
-                                num_tasks_left : works[conn_i].n_cores;
+        manager_run_remove(loop, job);
+        manager_free_connections(loop->dead, 0);
+        loop->dead = NULL;
+    }
+    if (job->tx_refs != 0) {
+        if (!handle->closing) {
+            handle->closing = true;
+            handle->closing_status = status;
+            handle->closing_since = manager_now();
+        }
+        return;
+    }
+    if (handle->closing) {
+        status = handle->closing_status;
+        handle->closing = false;
+    }
+    job_destroy(job);
+    MANAGER_JOB_HANDLE **link = &session->jobs_first;
+    MANAGER_JOB_HANDLE *prev = NULL;
+    while (*link != handle) {
+        prev = *link;
+        link = &(*link)->next;
+    }
+    *link = handle->next;
+    if (session->jobs_last == handle) {
+        session->jobs_last = prev;
+    }
+    handle->next = NULL;
+    handle->status = status;
+    if (handle->run_start != 0) {
+        cluster_trace_span(session->manager->trace, "job", (uint64_t)(handle->run_start * 1e6),
+                           "job", job->id, "results", job->num_ans_get);
+    }
+    if (session->manager->stats_path != NULL) {
+        manager_write_stats(session, handle);
+    }
+    pthread_cond_broadcast(&session->done);
+}
 
-        if(!(byte_send = manager_send_tasks(&works[conn_i], last_num_tasks_send, ptr_tasks))) {
-            goto error_close;
+// Начало выполнения отправленных заданий: все они выполняются одновременно,
+// подключённые узлы со свободными ядрами сразу получают их задачи.
+static void manager_start_jobs(MANAGER_SESSION *session)
+{
+    MANAGER_LOOP *loop = &session->loop;
+    bool started = false;
+    for (MANAGER_JOB_HANDLE *handle = session->jobs_first; handle != NULL; handle = handle->next) {
+        if (handle->status != JOB_QUEUED) {
+            continue;
         }
-        poll_manager_wait_for_answer(pollfds,conn_i,&works[conn_i]);
-        num_tasks_send += last_num_tasks_send;
-        ptr_tasks += byte_send;
+        // Отсчёт времени начинается с начала задания или с подключения первого рабочего узла.
+        handle->status = JOB_RUNNING;
+        handle->start_time = time(NULL);
+        handle->started = loop->total_cores != 0;
+        handle->run_start = manager_now();
+        manager_run_add(loop, &handle->job);
+        started = true;
     }
-    while(num_ans_get != num_tasks) {
-        time_t max_wait_time = start_time - time(NULL) + manager->max_time + 1;
-        if (max_wait_time <= 0) {
-            fprintf(stderr, "Time out!\n");
-            goto error_close;
-        }
-        DEBUG("Start poll with %ld sec\n",max_wait_time);
-        int pollret = poll(pollfds, 1U + manager->num_nodes, max_wait_time * 1000);
-        if (pollret == -1)
-        {
-            fprintf(stderr, "Unable to poll-wait for data on descriptors!\n");
-            goto error_close;
-        }
-        DEBUG("End poll, pollret:%d!\n",pollret);
-        for (size_t conn_i = 0U; conn_i < manager->num_nodes; ++conn_i)
-        {
-            if (pollfds[1U + conn_i].revents & (POLLHUP | POLLERR))
-            {  
-                fprintf(stderr, "Unexpected POLLHUP\n");
-                goto error_close;
-            }
+    if (started) {
+        manager_dispatch_idle(session->manager, loop);
+        manager_free_connections(loop->dead, 0);
+        loop->dead = NULL;
+    }
+}
 
-            if (pollfds[1U + conn_i].revents & POLLIN)
-            {
-                switch (works[conn_i].state)
-                {
-                case CONNECTION_EMPTY:
-                case GET_INFO:
-                    fprintf(stderr, "Unexpected state!\n");
-                    goto error_close;
-                case WAIT_ANS:
-                    if(!manager_get_worker_ans(&works[conn_i],&ans)) {
-                        goto error_close;
-                    }
-                    num_ans_get += works->num_last_tasks_send;
-                    size_t num_tasks_left = num_tasks - num_tasks_send;
-                    size_t byte_send = 0;
-                    if (!num_tasks_left) {
-                        manager_close_worker_socket(&works[conn_i]);
-                        works[conn_i].state = WORK_FINISHED;
-                        poll_manager_do_not_wait_for_ans(pollfds,conn_i);
-                        break;
-                    }
-                    last_num_tasks_send = works[conn_i].n_cores > num_tasks_left ? 
-                                            num_tasks_left : works[conn_i].n_cores;
-                    if(!(byte_send = manager_send_tasks(&works[conn_i], last_num_tasks_send, ptr_tasks))) {
-                        goto error_close;
+// Завершение выполненных, прерванных ошибкой и не уложившихся в max_time заданий.
+static void manager_check_jobs(MANAGER_SESSION *session)
+{
+    INFO_MANAGER *manager = session->manager;
+    MANAGER_LOOP *loop = &session->loop;
+    time_t now = time(NULL);
+    for (MANAGER_JOB_HANDLE *handle = session->jobs_first, *next; handle != NULL; handle = next) {
+        next = handle->next;
+        if (handle->status != JOB_RUNNING) {
+            continue;
+        }
+        MANAGER_JOB *job = &handle->job;
+        if (handle->closing) {
+            // Узлы, не принявшие вовремя недосланные пакеты задания или не подтвердившие
+            // отправку его данных без копирования, отключаются.
+            if (job->tx_refs != 0 && manager_now() >= handle->closing_since + MANAGER_FLUSH_SECONDS) {
+                for (WORK_CONNECTION *work = loop->conns, *next_work; work != NULL; work = next_work) {
+                    next_work = work->next;
+                    if (manager_refers_job(work, job)) {
+                        fprintf(stderr, "Worker does not accept tasks, disconnect\n");
+                        manager_connection_failed(loop, work);
                     }
-                    poll_manager_wait_for_answer(pollfds,conn_i,&works[conn_i]);
-                    num_tasks_send += last_num_tasks_send;
-                    ptr_tasks += byte_send;
-                    break;
-                case WAIT_TASK:
-                case WORK_FINISHED:
                 }
+                manager_free_connections(loop->dead, 0);
+                loop->dead = NULL;
+            }
+            if (job->tx_refs == 0) {
+                manager_finish_job(session, handle, handle->closing_status);
+            }
+            continue;
+        }
+        if (!handle->started && loop->total_cores != 0) {
+            DEBUG("First worker connected, start computing\n");
+            handle->start_time = now;
+            handle->started = true;
+        }
+        // Задание выполнено, когда источник исчерпан и получены результаты всех взятых из него задач.
+        if (job->failed) {
+            manager_finish_job(session, handle, JOB_FAILED);
+        } else if (job->source_done && job->num_ans_get == job->num_tasks_send) {
+            manager_finish_job(session, handle, JOB_DONE);
+        } else if (handle->started && now > handle->start_time + manager->max_time) {
+            fprintf(stderr, "Time out!\n");
+            manager_finish_job(session, handle, JOB_FAILED);
+        } else if (handle->started && loop->num_alive == 0) {
+            DEBUG("No workers left, wait for new ones\n");
+        }
+    }
+}
+
+// Время (в миллисекундах) до ближайшего срока заданий сессии: истечения max_time задания
+// или времени на досылку пакетов завершённого задания; -1 - сроков нет. Вызывается под блокировкой сессии.
+static int manager_session_timeout(MANAGER_SESSION *session)
+{
+    int timeout_ms = -1;
+    for (MANAGER_JOB_HANDLE *handle = session->jobs_first; handle != NULL; handle = handle->next) {
+        if (handle->closing) {
+            double left = handle->closing_since + MANAGER_FLUSH_SECONDS - manager_now();
+            int left_ms = left > 0 ? (int)(left * 1000) + 1 : 0;
+            if (timeout_ms == -1 || left_ms < timeout_ms) {
+                timeout_ms = left_ms;
             }
+            continue;
+        }
+        if (handle->status != JOB_RUNNING || !handle->started) {
+            continue;
+        }
+        time_t max_wait_time = handle->start_time - time(NULL) + session->manager->max_time + 1;
+        if (max_wait_time < 0) {
+            max_wait_time = 0;
+        }
+        if (timeout_ms == -1 || max_wait_time * 1000 < timeout_ms) {
+            timeout_ms = max_wait_time * 1000;
+        }
+    }
+    return timeout_ms;
+}
+
+// Установка timerfd сессии на ближайший срок заданий (или его отключение, если сроков нет).
+// Вызывается под блокировкой сессии.
+static void manager_session_arm_timer(MANAGER_SESSION *session)
+{
+    int timeout_ms = manager_session_timeout(session);
+    struct itimerspec spec = { 0 };
+    if (timeout_ms != -1) {
+        // Нулевое значение отключает таймер, поэтому к сроку добавляется 1 нс.
+        spec.it_value.tv_sec = timeout_ms / 1000;
+        spec.it_value.tv_nsec = (timeout_ms % 1000) * 1000000L + 1;
+    }
+    timerfd_settime(session->timer_fd, 0, &spec, NULL);
+}
+
+// Одна итерация цикла событий: ожидание событий не дольше timeout_ms (-1 - без ограничения)
+// и их обработка. Вызывается без блокировки сессии. Возвращает false при ошибке цикла событий.
+static bool manager_session_poll_events(MANAGER_SESSION *session, int timeout_ms)
+{
+    INFO_MANAGER *manager = session->manager;
+    MANAGER_LOOP *loop = &session->loop;
+    pthread_mutex_lock(&session->lock);
+    manager_start_jobs(session);
+    manager_check_jobs(session);
+    // Ожидание не дольше, чем до ближайшего срока заданий.
+    int deadline_ms = manager_session_timeout(session);
+    if (timeout_ms == -1 || (deadline_ms != -1 && deadline_ms < timeout_ms)) {
+        timeout_ms = deadline_ms;
+    }
+    DEBUG("Start epoll_wait with %d ms\n", timeout_ms);
+    pthread_mutex_unlock(&session->lock);
+
+    struct epoll_event events[MANAGER_MAX_EVENTS];
+    int num_events = epoll_wait(loop->epoll_fd, events, MANAGER_MAX_EVENTS, timeout_ms);
+    if (num_events == -1)
+    {
+        if (errno == EINTR) {
+            return true;
+        }
+        fprintf(stderr, "Unable to epoll-wait for data on descriptors!\n");
+        return false;
+    }
+    DEBUG("End epoll_wait, events:%d!\n",num_events);
+
+    pthread_mutex_lock(&session->lock);
+    bool ok = true;
+    // Каждое событие обрабатывается за время, не зависящее от количества узлов.
+    for (int i = 0; i < num_events && ok; ++i) {
+        WORK_CONNECTION *work = events[i].data.ptr;
+        if (events[i].data.ptr == &session->wake_fd) {
+            eventfd_t value;
+            eventfd_read(session->wake_fd, &value);
+            continue;
+        }
+        if (events[i].data.ptr == &session->timer_fd) {
+            // Таймер только будит цикл: сроки заданий проверяются после обработки событий.
+            uint64_t expirations;
+            while (read(session->timer_fd, &expirations, sizeof(expirations)) == -1 && errno == EINTR) {
+            }
+            continue;
+        }
+        if (work == NULL) {
+            ok = manager_add_workers(manager, loop);
+            continue;
+        }
+        manager_handle_worker(manager, loop, work, events[i].events);
+    }
+
+    // Задачи отказавших узлов достаются простаивающим узлам.
+    if (ok) {
+        manager_dispatch_idle(manager, loop);
+    }
+    manager_free_connections(loop->dead, 0);
+    loop->dead = NULL;
+    manager_check_jobs(session);
+    manager_start_jobs(session);
+    manager_session_arm_timer(session);
+    pthread_mutex_unlock(&session->lock);
+    return ok;
+}
+
+// Ошибка цикла событий: все задания сессии завершаются с ошибкой.
+// Узлы отключаются: без цикла событий недосланные пакеты не будут отправлены.
+static void manager_session_fail(MANAGER_SESSION *session)
+{
+    pthread_mutex_lock(&session->lock);
+    session->broken = true;
+    while (session->loop.conns != NULL) {
+        manager_connection_failed(&session->loop, session->loop.conns);
+    }
+    manager_free_connections(session->loop.dead, 0);
+    session->loop.dead = NULL;
+    while (session->jobs_first != NULL) {
+        manager_finish_job(session, session->jobs_first, JOB_FAILED);
+    }
+    pthread_mutex_unlock(&session->lock);
+}
+
+static void *manager_session_thread(void *arg)
+{
+    MANAGER_SESSION *session = arg;
+    while (!atomic_load_explicit(&session->stop, memory_order_acquire)) {
+        if (!manager_session_poll_events(session, -1)) {
+            manager_session_fail(session);
+            break;
         }
     }
-    free(pollfds);
-    free(works);
+    return NULL;
+}
+
+int manager_session_start(MANAGER_SESSION *session)
+{
+    if (session == NULL || session->has_thread) {
+        return -EINVAL;
+    }
+    if (pthread_create(&session->thread, NULL, manager_session_thread, session) != 0) {
+        fprintf(stderr, "[manager_session_start] Unable to create event loop thread\n");
+        return -1;
+    }
+    session->has_thread = true;
     return 0;
-error_close:
-    for(size_t i = 0; i < manager->num_nodes; ++i) {
-        manager_close_worker_socket(&works[i]);
+}
+
+int manager_session_fd(MANAGER_SESSION *session)
+{
+    return session == NULL ? -EINVAL : session->loop.epoll_fd;
+}
+
+int manager_session_process(MANAGER_SESSION *session)
+{
+    if (session == NULL || session->has_thread) {
+        return -EINVAL;
     }
-    DEBUG("Fall in error_close!\n");
-error_clear:
-    free(pollfds);
-    free(works);
-    DEBUG("Fall in error_clear!\n");
-    return -1;    
+    if (session->broken) {
+        return -1;
+    }
+    if (!manager_session_poll_events(session, 0)) {
+        manager_session_fail(session);
+        return -1;
+    }
+    return 0;
+}
+
+// Постановка задания в очередь сессии.
+static MANAGER_JOB_HANDLE *manager_session_enqueue(MANAGER_SESSION *session, const MANAGER_JOB *job)
+{
+    MANAGER_JOB_HANDLE *handle = calloc(1, sizeof(*handle));
+    if (handle == NULL) {
+        fprintf(stderr, "[manager_session_enqueue] No memory for job\n");
+        return NULL;
+    }
+    handle->session = session;
+    handle->job = *job;
+    if (handle->job.weight <= 0) {
+        handle->job.weight = 1;
+    }
+    handle->status = JOB_QUEUED;
+    pthread_mutex_lock(&session->lock);
+    if (session->broken) {
+        pthread_mutex_unlock(&session->lock);
+        free(handle);
+        return NULL;
+    }
+    handle->job.id = session->next_job_id;
+    session->next_job_id = session->next_job_id == INT_MAX ? 0 : session->next_job_id + 1;
+    if (session->jobs_last != NULL) {
+        session->jobs_last->next = handle;
+    } else {
+        session->jobs_first = handle;
+    }
+    session->jobs_last = handle;
+    handle->live_next = session->handles;
+    if (session->handles != NULL) {
+        session->handles->live_prev = handle;
+    }
+    session->handles = handle;
+    pthread_mutex_unlock(&session->lock);
+    // Цикл событий (поток сессии или вызывающий manager_session_process) начинает задание.
+    eventfd_write(session->wake_fd, 1);
+    return handle;
+}
+
+MANAGER_JOB_HANDLE *manager_submit_async(MANAGER_SESSION *session, const JOB_DESC *desc)
+{
+    if (session == NULL || desc == NULL || desc->source.next == NULL ||
+        (desc->sink.on_result == NULL && desc->ans == NULL) || !isfinite(desc->weight) || desc->weight < 0) {
+        return NULL;
+    }
+    MANAGER_JOB job = {
+        .priority = desc->priority,
+        .weight = desc->weight,
+        .source = desc->source,
+        .num_tasks_total = desc->num_tasks,
+        .cost_total = desc->num_tasks,
+        .sink = desc->sink,
+        .ans = desc->ans,
+        .slots = desc->slots,
+    };
+    return manager_session_enqueue(session, &job);
+}
+
+static bool manager_job_finished(MANAGER_JOB_HANDLE *handle)
+{
+    return handle->status == JOB_DONE || handle->status == JOB_FAILED;
+}
+
+JOB_STATUS manager_job_poll(MANAGER_JOB_HANDLE *handle)
+{
+    MANAGER_SESSION *session = handle->session;
+    if (session == NULL) {
+        return handle->status;
+    }
+    pthread_mutex_lock(&session->lock);
+    JOB_STATUS status = handle->status;
+    pthread_mutex_unlock(&session->lock);
+    return status;
+}
+
+void manager_job_progress(MANAGER_JOB_HANDLE *handle, JOB_PROGRESS *progress)
+{
+    MANAGER_SESSION *session = handle->session;
+    if (session != NULL) {
+        pthread_mutex_lock(&session->lock);
+    }
+    progress->status = handle->status;
+    progress->num_tasks = handle->job.num_tasks_total;
+    progress->num_tasks_send = handle->job.num_tasks_send;
+    progress->num_ans_get = handle->job.num_ans_get;
+    if (session != NULL) {
+        pthread_mutex_unlock(&session->lock);
+    }
+}
+
+// Время в миллисекундах до момента deadline (по CLOCK_MONOTONIC), не меньше 0.
+static int manager_ms_until(const struct timespec *deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ms = (deadline->tv_sec - now.tv_sec) * 1000LL + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms < 0 ? 0 : ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+int manager_job_wait(MANAGER_JOB_HANDLE *handle, int timeout_ms)
+{
+    MANAGER_SESSION *session = handle->session;
+    if (session == NULL) {
+        return handle->status == JOB_DONE ? 0 : -1;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    if (timeout_ms > 0) {
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+    pthread_mutex_lock(&session->lock);
+    while (!manager_job_finished(handle)) {
+        if (timeout_ms == 0 || (timeout_ms > 0 && manager_ms_until(&deadline) == 0)) {
+            pthread_mutex_unlock(&session->lock);
+            return -ETIMEDOUT;
+        }
+        if (session->has_thread) {
+            if (timeout_ms < 0) {
+                pthread_cond_wait(&session->done, &session->lock);
+            } else {
+                pthread_cond_timedwait(&session->done, &session->lock, &deadline);
+            }
+            continue;
+        }
+        // Без потока сессии цикл событий выполняет ожидающий.
+        pthread_mutex_unlock(&session->lock);
+        bool ok = !session->broken && manager_session_poll_events(session, timeout_ms < 0 ? -1 : manager_ms_until(&deadline));
+        if (!ok) {
+            manager_session_fail(session);
+        }
+        pthread_mutex_lock(&session->lock);
+    }
+    JOB_STATUS status = handle->status;
+    pthread_mutex_unlock(&session->lock);
+    return status == JOB_DONE ? 0 : -1;
+}
+
+int manager_job_release(MANAGER_JOB_HANDLE *handle)
+{
+    if (handle == NULL) {
+        return 0;
+    }
+    MANAGER_SESSION *session = handle->session;
+    if (session == NULL) {
+        free(handle);
+        return 0;
+    }
+    pthread_mutex_lock(&session->lock);
+    if (!manager_job_finished(handle)) {
+        pthread_mutex_unlock(&session->lock);
+        return -EBUSY;
+    }
+    if (handle->live_prev != NULL) {
+        handle->live_prev->live_next = handle->live_next;
+    } else {
+        session->handles = handle->live_next;
+    }
+    if (handle->live_next != NULL) {
+        handle->live_next->live_prev = handle->live_prev;
+    }
+    pthread_mutex_unlock(&session->lock);
+    free(handle);
+    return 0;
+}
+
+void manager_session_codec_stats(MANAGER_SESSION *session, MANAGER_CODEC_STATS *stats)
+{
+    pthread_mutex_lock(&session->lock);
+    *stats = session->manager->codec_stats;
+    pthread_mutex_unlock(&session->lock);
+}
+
+int manager_get_stats(MANAGER_SESSION *session, MANAGER_STATS *stats, MANAGER_WORKER_STATS *workers, size_t max_workers)
+{
+    if (session == NULL || (workers == NULL && max_workers != 0)) {
+        return -EINVAL;
+    }
+    MANAGER_STATS session_stats;
+    pthread_mutex_lock(&session->lock);
+    size_t num_workers = manager_collect_stats(session, &session_stats, workers, max_workers);
+    pthread_mutex_unlock(&session->lock);
+    if (stats != NULL) {
+        *stats = session_stats;
+    }
+    return num_workers > INT_MAX ? INT_MAX : (int)num_workers;
+}
+
+int manager_session_submit(MANAGER_SESSION *session, const JOB_DESC *desc)
+{
+    if (session == NULL || desc == NULL || desc->source.next == NULL ||
+        (desc->sink.on_result == NULL && desc->ans == NULL) || !isfinite(desc->weight) || desc->weight < 0) {
+        return -EINVAL;
+    }
+    MANAGER_JOB_HANDLE *handle = manager_submit_async(session, desc);
+    if (handle == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&session->lock);
+    handle->owned = true;
+    handle->owned_next = session->owned;
+    session->owned = handle;
+    int job_id = (int)handle->job.id;
+    pthread_mutex_unlock(&session->lock);
+    return job_id;
+}
+
+int manager_session_wait(MANAGER_SESSION *session, int job_id)
+{
+    if (session == NULL) {
+        return -EINVAL;
+    }
+    pthread_mutex_lock(&session->lock);
+    MANAGER_JOB_HANDLE **link = &session->owned;
+    while (*link != NULL && (*link)->job.id != (size_t)job_id) {
+        link = &(*link)->owned_next;
+    }
+    MANAGER_JOB_HANDLE *handle = *link;
+    if (handle != NULL) {
+        *link = handle->owned_next;
+    }
+    pthread_mutex_unlock(&session->lock);
+    if (handle == NULL) {
+        return -EINVAL;
+    }
+    int ret = manager_job_wait(handle, -1);
+    manager_job_release(handle);
+    return ret;
+}
+
+void manager_session_close(MANAGER_SESSION *session)
+{
+    if (session == NULL) {
+        return;
+    }
+    if (session->has_thread) {
+        atomic_store_explicit(&session->stop, true, memory_order_release);
+        eventfd_write(session->wake_fd, 1);
+        pthread_join(session->thread, NULL);
+    }
+    // Невыполненные задания прерываются; их описатели остаются действительными до manager_job_release.
+    // Задания, пакеты которых ещё не досланы, завершаются после закрытия соединений:
+    // при закрытии узлам досылаются пакеты и признак завершения работы.
+    for (MANAGER_JOB_HANDLE *handle = session->jobs_first, *next; handle != NULL; handle = next) {
+        next = handle->next;
+        manager_finish_job(session, handle, JOB_FAILED);
+    }
+    manager_close_listen_socket(session->manager);
+    for (WORK_CONNECTION *work = session->loop.conns; work != NULL; work = work->next) {
+        work->state = WORK_FINISHED;
+    }
+    // Узлы, не принимающие данные, вместе задерживают закрытие не больше чем на MANAGER_FLUSH_SECONDS.
+    manager_free_connections(session->loop.conns, manager_now() + MANAGER_FLUSH_SECONDS);
+    manager_free_connections(session->loop.dead, 0);
+    session->loop.conns = NULL;
+    session->loop.dead = NULL;
+    while (session->jobs_first != NULL) {
+        manager_finish_job(session, session->jobs_first, JOB_FAILED);
+    }
+    // Описатели завершённых заданий тоже ссылаются на сессию: после закрытия они не обращаются к ней.
+    for (MANAGER_JOB_HANDLE *handle = session->handles, *next; handle != NULL; handle = next) {
+        next = handle->live_next;
+        handle->session = NULL;
+        handle->live_prev = NULL;
+        handle->live_next = NULL;
+    }
+    session->handles = NULL;
+    while (session->owned != NULL) {
+        MANAGER_JOB_HANDLE *next = session->owned->owned_next;
+        free(session->owned);
+        session->owned = next;
+    }
+    if (session->manager->trace != NULL) {
+        cluster_trace_write(session->manager->trace, session->manager->trace_path, 0, "manager", 0);
+        cluster_trace_destroy(session->manager->trace);
+        session->manager->trace = NULL;
+    }
+    close(session->loop.epoll_fd);
+    close(session->wake_fd);
+    close(session->timer_fd);
+    pthread_cond_destroy(&session->done);
+    pthread_mutex_destroy(&session->lock);
+    free(session);
+}
+
+// Выполнение одного задания в собственной сессии.
+static int manager_run(INFO_MANAGER *manager, MANAGER_JOB *job)
+{
+    MANAGER_SESSION *session = manager_session_open(manager);
+    if (session == NULL) {
+        job_destroy(job);
+        return -1;
+    }
+    MANAGER_JOB_HANDLE *handle = manager_session_enqueue(session, job);
+    if (handle == NULL) {
+        job_destroy(job);
+        manager_session_close(session);
+        return -1;
+    }
+    int ret = manager_job_wait(handle, -1);
+    manager_job_release(handle);
+    manager_session_close(session);
+    return ret;
+}
+
+static bool manager_check_args(INFO_MANAGER *manager, TASK_SOURCE *source)
+{
+    return manager != NULL && manager->max_time != 0 && manager->is_init != false && manager->num_nodes != 0 &&
+           source != NULL && source->next != NULL;
+}
+
+int start_manager_sink(INFO_MANAGER *manager, TASK_SOURCE *source, RESULT_SINK *sink) {
+    if (!manager_check_args(manager, source) || sink == NULL || sink->on_result == NULL) {
+        return -EINVAL;
+    }
+    MANAGER_JOB job = {
+        .source = *source,
+        .sink = *sink,
+    };
+    return manager_run(manager, &job);
+}
+
+// Задание из num_tasks задач источника (0 - количество неизвестно) с размещением результатов в ans.
+// order и costs - порядок отправки и оценки стоимости задач (см. MANAGER_JOB), могут быть NULL.
+static int manager_run_source(INFO_MANAGER *manager, TASK_SOURCE *source, size_t num_tasks,
+                              const size_t *order, const double *costs, char *ans, RESULT_SLOT *slots)
+{
+    if (!manager_check_args(manager, source) || ans == NULL) {
+        return -EINVAL;
+    }
+    MANAGER_JOB job = {
+        .source = *source,
+        .num_tasks_total = num_tasks,
+        .order = order,
+        .costs = costs,
+        .cost_total = num_tasks,
+        .ans = ans,
+        .slots = slots,
+    };
+    if (costs != NULL) {
+        job.cost_total = 0;
+        for (size_t i = 0; i < num_tasks; ++i) {
+            job.cost_total += costs[i];
+        }
+    }
+    return manager_run(manager, &job);
+}
+
+int start_manager_source(INFO_MANAGER *manager, TASK_SOURCE *source, char *ans, RESULT_SLOT *slots) {
+    return manager_run_source(manager, source, 0, NULL, NULL, ans, slots);
+}
+
+int start_manager_slots(INFO_MANAGER *manager, size_t num_tasks, char tasks[], char *ans, RESULT_SLOT *slots) {
+    TASK_BUFFER_SOURCE buffer = {
+        .ptr = tasks,
+        .left = num_tasks,
+    };
+    TASK_SOURCE source = {
+        .next = task_buffer_next,
+        .release = NULL,
+        .ctx = &buffer,
+    };
+    if (!manager_check_args(manager, &source) || tasks == NULL || ans == NULL) {
+        return -EINVAL;
+    }
+    // Пустое задание выполнено сразу, ожидать рабочие узлы не нужно.
+    if (num_tasks == 0) {
+        return 0;
+    }
+    return manager_run_source(manager, &source, num_tasks, NULL, NULL, ans, slots);
+}
+
+int start_manager_iov(INFO_MANAGER *manager, size_t num_tasks, const struct iovec *tasks, char *ans, RESULT_SLOT *slots) {
+    TASK_IOV_SOURCE table = {
+        .next = tasks,
+        .left = num_tasks,
+    };
+    TASK_SOURCE source = {
+        .next = task_iov_next,
+        .release = NULL,
+        .ctx = &table,
+    };
+    if (!manager_check_args(manager, &source) || (tasks == NULL && num_tasks != 0) || ans == NULL) {
+        return -EINVAL;
+    }
+    if (num_tasks == 0) {
+        return 0;
+    }
+    return manager_run_source(manager, &source, num_tasks, NULL, NULL, ans, slots);
+}
+
+// Источник задач из таблицы {адрес, размер} в заданном порядке.
+typedef struct
+{
+    const struct iovec *tasks;
+    // Номера задач в порядке отправки и позиция следующей задачи.
+    const size_t *order;
+    size_t pos;
+    size_t num_tasks;
+} TASK_ORDER_SOURCE;
+
+static int task_order_next(void *ctx, const char **data, size_t *size)
+{
+    TASK_ORDER_SOURCE *table = ctx;
+    if (table->pos == table->num_tasks) {
+        return 0;
+    }
+    const struct iovec *task = &table->tasks[table->order[table->pos++]];
+    *data = task->iov_base;
+    *size = task->iov_len;
+    return 1;
+}
+
+// Сравнение номеров задач по убыванию стоимости (при равной стоимости - по возрастанию номера).
+static int task_cost_compare(const void *a, const void *b, void *ctx)
+{
+    const double *costs = ctx;
+    size_t i = *(const size_t *)a, j = *(const size_t *)b;
+    if (costs[i] != costs[j]) {
+        return costs[i] > costs[j] ? -1 : 1;
+    }
+    return (i > j) - (i < j);
+}
+
+int start_manager_costs(INFO_MANAGER *manager, size_t num_tasks, const struct iovec *tasks, const double *costs,
+                        char *ans, RESULT_SLOT *slots) {
+    if (costs == NULL) {
+        return start_manager_iov(manager, num_tasks, tasks, ans, slots);
+    }
+    TASK_ORDER_SOURCE table = {
+        .tasks = tasks,
+        .num_tasks = num_tasks,
+    };
+    TASK_SOURCE source = {
+        .next = task_order_next,
+        .release = NULL,
+        .ctx = &table,
+    };
+    if (!manager_check_args(manager, &source) || (tasks == NULL && num_tasks != 0) || ans == NULL) {
+        return -EINVAL;
+    }
+    for (size_t i = 0; i < num_tasks; ++i) {
+        if (!isfinite(costs[i]) || costs[i] < 0) {
+            return -EINVAL;
+        }
+    }
+    if (num_tasks == 0) {
+        return 0;
+    }
+    size_t *order = malloc(num_tasks * sizeof(*order));
+    if (order == NULL) {
+        fprintf(stderr, "[start_manager_costs] No memory for task order\n");
+        return -1;
+    }
+    // Самые дорогие задачи отправляются первыми (longest processing time first).
+    for (size_t i = 0; i < num_tasks; ++i) {
+        order[i] = i;
+    }
+    qsort_r(order, num_tasks, sizeof(*order), task_cost_compare, (void *)costs);
+    table.order = order;
+    int ret = manager_run_source(manager, &source, num_tasks, order, costs, ans, slots);
+    free(order);
+    return ret;
+}
+
+int start_manager(INFO_MANAGER *manager, size_t num_tasks, char tasks[], char *ans) {
+    return start_manager_slots(manager, num_tasks, tasks, ans, NULL);
+}
+
+static bool result_sink_fd_write(void *ctx, size_t task_index, const char *data, size_t size)
+{
+    RESULT_HEADER header = {
+        .task_id = task_index,
+        .size = size,
+    };
+    struct iovec iov[2] = {
+        {.iov_base = &header, .iov_len = sizeof(header)},
+        {.iov_base = (char *)data, .iov_len = size},
+    };
+    size_t iovcnt = 2;
+    struct iovec *ptr = iov;
+    int fd = (int)(intptr_t)ctx;
+    while (iovcnt != 0) {
+        ssize_t bytes_written = writev(fd, ptr, iovcnt);
+        if (bytes_written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "[result_sink_fd] Unable to write result: %s\n", strerror(errno));
+            return false;
+        }
+        cluster_iov_advance(&ptr, &iovcnt, (size_t)bytes_written);
+    }
+    return true;
+}
+
+RESULT_SINK result_sink_fd(int fd) {
+    RESULT_SINK sink = {
+        .on_result = result_sink_fd_write,
+        .ctx = (void *)(intptr_t)fd,
+    };
+    return sink;
+}
+
+//============================
+// Задачи и результаты в файлах
+//============================
+
+// Минимальный прирост файлов результатов и индекса.
+#define RESULT_FILE_GROW (1U << 20)
+
+// Источник задач из отображённого в память файла в формате create_task_structure.
+typedef struct
+{
+    const char *map;
+    size_t size;
+    // Смещение следующей задачи.
+    size_t pos;
+} TASK_FILE_SOURCE;
+
+static int task_file_next(void *ctx, const char **data, size_t *size)
+{
+    TASK_FILE_SOURCE *file = ctx;
+    if (file->pos == file->size) {
+        return 0;
+    }
+    size_t task_size;
+    if (file->size - file->pos < sizeof(task_size)) {
+        fprintf(stderr, "[task_file_next] Truncated task size at offset %lu\n", file->pos);
+        return -1;
+    }
+    // Задачи в файле не выровнены.
+    memcpy(&task_size, file->map + file->pos, sizeof(task_size));
+    file->pos += sizeof(task_size);
+    if (file->size - file->pos < task_size) {
+        fprintf(stderr, "[task_file_next] Truncated task of %lu bytes at offset %lu\n", task_size, file->pos);
+        return -1;
+    }
+    *data = file->map + file->pos;
+    *size = task_size;
+    file->pos += task_size;
+    return 1;
+}
+
+// Отображённый в память файл, растущий по мере записи.
+typedef struct
+{
+    int fd;
+    char *map;
+    // Размер отображения (и файла).
+    size_t capacity;
+    // Размер записанных данных.
+    size_t size;
+} RESULT_FILE;
+
+static bool result_file_open(RESULT_FILE *file, const char *path)
+{
+    file->map = NULL;
+    file->capacity = 0;
+    file->size = 0;
+    file->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file->fd == -1) {
+        fprintf(stderr, "[result_file_open] Unable to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Расширение файла так, чтобы в него помещалось need байт.
+static bool result_file_reserve(RESULT_FILE *file, size_t need)
+{
+    if (need <= file->capacity) {
+        return true;
+    }
+    size_t capacity = file->capacity * 2;
+    if (capacity < need) {
+        capacity = need;
+    }
+    if (capacity < RESULT_FILE_GROW) {
+        capacity = RESULT_FILE_GROW;
+    }
+    if (ftruncate(file->fd, capacity) == -1) {
+        fprintf(stderr, "[result_file_reserve] Unable to grow file: %s\n", strerror(errno));
+        return false;
+    }
+    void *map;
+    if (file->map == NULL) {
+        map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+    } else {
+        map = mremap(file->map, file->capacity, capacity, MREMAP_MAYMOVE);
+    }
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "[result_file_reserve] Unable to map file: %s\n", strerror(errno));
+        return false;
+    }
+    file->map = map;
+    file->capacity = capacity;
+    return true;
+}
+
+// Закрытие файла; файл обрезается до размера записанных данных.
+static bool result_file_close(RESULT_FILE *file)
+{
+    bool ret = true;
+    if (file->map != NULL && munmap(file->map, file->capacity) == -1) {
+        ret = false;
+    }
+    if (file->fd != -1) {
+        if (ftruncate(file->fd, file->size) == -1) {
+            fprintf(stderr, "[result_file_close] Unable to truncate file: %s\n", strerror(errno));
+            ret = false;
+        }
+        close(file->fd);
+    }
+    file->map = NULL;
+    file->fd = -1;
+    return ret;
+}
+
+// Приёмник результатов в файлы результатов и индекса.
+typedef struct
+{
+    RESULT_FILE results;
+    RESULT_FILE index;
+} RESULT_FILE_SINK;
+
+static bool result_file_write(void *ctx, size_t task_index, const char *data, size_t size)
+{
+    RESULT_FILE_SINK *sink = ctx;
+    size_t index_end = (task_index + 1) * sizeof(RESULT_SLOT);
+    if (!result_file_reserve(&sink->results, sink->results.size + size) ||
+        !result_file_reserve(&sink->index, index_end)) {
+        return false;
+    }
+    // Пустой результат занимает только запись индекса (буфер данных может ещё не существовать).
+    if (size != 0) {
+        memcpy(sink->results.map + sink->results.size, data, size);
+    }
+    RESULT_SLOT slot = {
+        .offset = sink->results.size,
+        .size = size,
+    };
+    memcpy(sink->index.map + task_index * sizeof(RESULT_SLOT), &slot, sizeof(slot));
+    sink->results.size += size;
+    if (sink->index.size < index_end) {
+        sink->index.size = index_end;
+    }
+    return true;
+}
+
+int start_manager_files(INFO_MANAGER *manager, const char *tasks_path, const char *results_path, const char *index_path) {
+    TASK_FILE_SOURCE tasks = {
+        .map = NULL,
+    };
+    RESULT_FILE_SINK results = {
+        .results.fd = -1,
+        .index.fd = -1,
+    };
+    TASK_SOURCE source = {
+        .next = task_file_next,
+        .release = NULL,
+        .ctx = &tasks,
+    };
+    RESULT_SINK sink = {
+        .on_result = result_file_write,
+        .ctx = &results,
+    };
+    // Аргументы проверяются до того, как файлы результатов будут обрезаны.
+    if (!manager_check_args(manager, &source) || tasks_path == NULL || results_path == NULL || index_path == NULL) {
+        return -EINVAL;
+    }
+    int ret = -1;
+    int tasks_fd = open(tasks_path, O_RDONLY | O_CLOEXEC);
+    if (tasks_fd == -1) {
+        fprintf(stderr, "[start_manager_files] Unable to open %s: %s\n", tasks_path, strerror(errno));
+        goto clear;
+    }
+    struct stat st;
+    if (fstat(tasks_fd, &st) == -1) {
+        fprintf(stderr, "[start_manager_files] Unable to stat %s\n", tasks_path);
+        goto clear;
+    }
+    tasks.size = st.st_size;
+    if (tasks.size != 0) {
+        void *map = mmap(NULL, tasks.size, PROT_READ, MAP_PRIVATE, tasks_fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "[start_manager_files] Unable to map %s: %s\n", tasks_path, strerror(errno));
+            goto clear;
+        }
+        tasks.map = map;
+        // Задачи читаются один раз по порядку: упреждающее чтение и быстрое вытеснение прочитанного.
+        madvise(map, tasks.size, MADV_SEQUENTIAL);
+    }
+    if (!result_file_open(&results.results, results_path) || !result_file_open(&results.index, index_path)) {
+        goto clear;
+    }
+    ret = tasks.size == 0 ? 0 : start_manager_sink(manager, &source, &sink);
+clear:
+    if (!result_file_close(&results.results) || !result_file_close(&results.index)) {
+        ret = ret == 0 ? -1 : ret;
+    }
+    if (tasks.map != NULL) {
+        munmap((void *)tasks.map, tasks.size);
+    }
+    if (tasks_fd != -1) {
+        close(tasks_fd);
+    }
+    return ret;
 }
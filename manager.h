@@ -1,6 +1,8 @@
 #include <stdbool.h>
 #include <time.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include "cluster-histogram.h"
 
 #ifdef DEBUGTEST
 #define DEBUG(...) printf(__VA_ARGS__);
@@ -8,15 +10,119 @@
 #define DEBUG(...)
 #endif
 
+//! Количество задач сверх числа ядер, по умолчанию находящихся у рабочего узла.
+#define MANAGER_DEFAULT_WINDOW 4
+
+//! Максимальное количество одновременно выполняющихся копий задачи в режиме speculative.
+#define MANAGER_MAX_COPIES 2
+
+//! Кодеки сжатия данных задач и результатов (INFO_MANAGER::codec).
+#define MANAGER_CODEC_NONE 0 //!< данные передаются без сжатия
+#define MANAGER_CODEC_LZ 1   //!< быстрый словарный кодек класса LZ
+
+//! Транспорт соединений (определён в cluster-transport.h).
+struct CLUSTER_TRANSPORT;
+
+//! Трассировка выполнения (определена в cluster-trace.h).
+struct CLUSTER_TRACE;
+
+//! Статистика сжатия: сколько байт данных задач и результатов передано по сети.
+typedef struct
+{
+    //! Размер данных отправленных пакетов задач до сжатия и после него (в байтах).
+    size_t tx_raw_bytes;
+    size_t tx_wire_bytes;
+    //! Размер данных полученных результатов после распаковки и до неё (в байтах).
+    size_t rx_raw_bytes;
+    size_t rx_wire_bytes;
+} MANAGER_CODEC_STATS;
+
+//! Статистика соединения с рабочим узлом (с момента его подключения).
+typedef struct
+{
+    //! Номер узла в порядке подключения к сессии (с 0).
+    size_t id;
+    //! Количество ядер узла.
+    size_t n_cores;
+    //! Время, прошедшее с подключения узла (в микросекундах).
+    size_t connected_us;
+    //! Количество отправленных узлу пакетов задач.
+    size_t batches_sent;
+    //! Количество отправленных узлу задач (вместе с копиями в режиме speculative).
+    size_t tasks_dispatched;
+    //! Количество принятых от узла результатов (отброшенные копии и результаты завершённых заданий не учитываются).
+    size_t tasks_completed;
+    //! Количество задач, возвращённых в очередь при отказе узла.
+    size_t tasks_requeued;
+    //! Объём переданных узлу и полученных от него данных вместе с заголовками (в байтах, после сжатия).
+    size_t bytes_out;
+    size_t bytes_in;
+    //! Суммарный простой ядер узла (в микросекундах ядро-времени): время, когда у ядер узла не было
+    //! отправленных им задач. Задержки сети и очереди узла сюда не входят.
+    size_t idle_core_us;
+    //! Время от отправки задачи узлу до получения её результата.
+    CLUSTER_HISTOGRAM round_trip;
+} MANAGER_WORKER_STATS;
+
+//! Статистика сессии Управляющего узла.
+typedef struct
+{
+    //! Количество подключённых узлов и суммарное количество их ядер.
+    size_t workers_alive;
+    size_t cores_alive;
+    //! Количество узлов, отключившихся или отказавших с начала сессии.
+    size_t workers_lost;
+    //! Сумма статистики всех узлов сессии, включая отключившиеся (поля id, n_cores и connected_us не используются).
+    MANAGER_WORKER_STATS total;
+    //! Статистика сжатия (см. INFO_MANAGER::codec_stats).
+    MANAGER_CODEC_STATS codec;
+} MANAGER_STATS;
+
 //! Структура для работы Управляющего узла
 typedef struct
 {
-    //! Адрес для прослушивания запросов на подключение.
-    struct sockaddr listen_addr;
+    //! Адрес для прослушивания запросов на подключение и его длина.
+    struct sockaddr_storage listen_addr;
+    socklen_t listen_addr_len;
+    //! Транспорт соединений с рабочими узлами, выбранный по строке адреса (cluster-transport.h).
+    const struct CLUSTER_TRANSPORT *transport;
     //! Максимальное время работы в секундах.
     time_t max_time;
-    //! Количество рабочих узлов, необходимых для запуска вычисления.
+    //! Ожидаемое количество рабочих узлов (размер очереди подключений и начальный размер таблицы узлов).
     size_t num_nodes;
+    //! Количество задач сверх числа ядер, отправляемых рабочему узлу заранее (окно конвейера).
+    size_t window;
+    //! Режим дублирования: когда новые задачи закончились, простаивающие узлы получают копии
+    //! самых старых невыполненных задач; используется первый полученный результат.
+    bool speculative;
+    //! Адаптивный размер пакета: Управляющий узел измеряет скорость выполнения задач каждым узлом
+    //! и отправляет ему долю оставшихся задач (guided self-scheduling). false - одна задача на ядро.
+    bool adaptive_batch;
+    //! Минимальный размер пакета задач (в байтах), отправляемого с MSG_ZEROCOPY: данные задач
+    //! передаются сетевой карте прямо из буфера задач без копирования в ядро. 0 - не использовать.
+    size_t zerocopy_threshold;
+    //! Кодек сжатия (MANAGER_CODEC_NONE - по умолчанию, MANAGER_CODEC_LZ). Кодек согласуется с каждым
+    //! рабочим узлом при подключении; кадры меньше нескольких сотен байт и несжимаемые данные
+    //! передаются без сжатия.
+    size_t codec;
+    //! Разделяемая память для рабочих узлов на хосте Управляющего узла (по умолчанию true): пакеты задач
+    //! и результаты таких узлов передаются через кольцевые буферы в общем сегменте, а не через TCP.
+    //! Узлы на других хостах продолжают работать через TCP. Сжатие для таких узлов не используется.
+    bool shared_memory;
+    //! Статистика сжатия, накапливаемая всеми вычислениями с этой структурой
+    //! (во время работы сессии читается функцией manager_session_codec_stats).
+    MANAGER_CODEC_STATS codec_stats;
+    //! Файл, в конец которого при завершении каждого задания дописывается строка JSON со статистикой
+    //! задания и сессии (см. manager_get_stats). NULL - по умолчанию, статистика не записывается.
+    const char *stats_path;
+    //! Файл трассировки в формате Chrome trace-event (NULL - по умолчанию, трассировка выключена).
+    //! Интервалы отправки пакетов, приёма результатов и выполнения заданий записываются с открытия
+    //! сессии и сохраняются при её закрытии (файл перезаписывается). Файлы рабочих узлов
+    //! (INFO_WORKER::trace_path) записываются по часам Управляющего узла и объединяются с этим файлом
+    //! слиянием массивов traceEvents.
+    const char *trace_path;
+    //! Трассировка открытой сессии (NULL - не ведётся).
+    struct CLUSTER_TRACE *trace;
 
     //! Дескриптор слушающего сокета для первоначального подключения клиентов.
     int listen_sock_fd;
@@ -24,6 +130,88 @@ typedef struct
     bool is_init;
 } INFO_MANAGER;
 
+//! Ячейка таблицы результатов: положение результата задачи в буфере ответов.
+typedef struct
+{
+    //! Смещение результата от начала буфера ответов (в байтах).
+    size_t offset;
+    //! На входе - максимальный размер результата, на выходе - фактический размер (в байтах).
+    size_t size;
+} RESULT_SLOT;
+
+//! Источник задач, из которого Управляющий узел берёт задачи по мере освобождения окон рабочих узлов.
+typedef struct
+{
+    //! Получение очередной задачи: в *data и *size записываются данные задачи и их размер (в байтах).
+    //! Возвращает 1, если задача получена, 0, если задачи закончились, и -1 при ошибке.
+    //! Данные задачи должны оставаться доступными до вызова release для неё.
+    int (*next)(void *ctx, const char **data, size_t *size);
+    //! Освобождение задачи, которая больше не понадобится Управляющему узлу (может быть NULL).
+    void (*release)(void *ctx, const char *data, size_t size);
+    //! Пользовательский контекст, передаваемый функциям источника.
+    void *ctx;
+} TASK_SOURCE;
+
+//! Приёмник результатов, которому Управляющий узел передаёт каждый результат сразу после получения.
+typedef struct
+{
+    //! Обработка результата задачи task_index (size байт по адресу data, данные действительны
+    //! только во время вызова). Возвращает false при ошибке, вычисление при этом прерывается.
+    bool (*on_result)(void *ctx, size_t task_index, const char *data, size_t size);
+    //! Пользовательский контекст, передаваемый функции on_result.
+    void *ctx;
+} RESULT_SINK;
+
+//! Описание задания для manager_session_submit.
+typedef struct
+{
+    //! Источник задач (см. start_manager_source).
+    TASK_SOURCE source;
+    //! Количество задач источника, если оно известно заранее (0 - неизвестно); используется для размера пакетов.
+    size_t num_tasks;
+    //! Приёмник результатов (см. start_manager_sink). Если sink.on_result == NULL,
+    //! результаты записываются в ans с таблицей размещения slots (см. start_manager_source).
+    RESULT_SINK sink;
+    //! Буфер ответов.
+    char *ans;
+    //! Таблица размещения результатов или NULL.
+    RESULT_SLOT *slots;
+    //! Приоритет задания (по умолчанию 0): освобождающиеся ядра получают задачи задания
+    //! с наибольшим приоритетом, пока у него есть задачи.
+    int priority;
+    //! Вес задания среди заданий того же приоритета (0 - вес 1): задания равного приоритета
+    //! делят узлы пропорционально весам по стоимости отправленных задач.
+    double weight;
+} JOB_DESC;
+
+//! Сессия Управляющего узла: рабочие узлы остаются подключёнными между заданиями.
+typedef struct MANAGER_SESSION MANAGER_SESSION;
+
+//! Описатель задания, отправленного manager_submit_async.
+typedef struct MANAGER_JOB_HANDLE MANAGER_JOB_HANDLE;
+
+//! Состояние задания сессии.
+typedef enum
+{
+    JOB_QUEUED,  //!< отправлено, но ещё не начато циклом событий
+    JOB_RUNNING, //!< выполняется
+    JOB_DONE,    //!< выполнено
+    JOB_FAILED   //!< завершено с ошибкой или прервано закрытием сессии
+} JOB_STATUS;
+
+//! Ход выполнения задания.
+typedef struct
+{
+    //! Состояние задания.
+    JOB_STATUS status;
+    //! Количество задач задания (0 - неизвестно).
+    size_t num_tasks;
+    //! Количество задач, полученных из источника и отправленных рабочим узлам.
+    size_t num_tasks_send;
+    //! Количество полученных результатов.
+    size_t num_ans_get;
+} JOB_PROGRESS;
+
 /*!
  * \brief Функция для формирования массива для передачи задач по сети.
  *
@@ -43,13 +231,17 @@ char* create_task_structure(size_t num_tasks, size_t *task_sizes, char *tasks);
  * \brief Функция для инициализации структуры INFO_MANAGER.
  *
  * \param[out] manager Указатель на структуру INFO_MANAGER, которую необходимо инициализировать.
- * \param[in] addr Строка, содержащая адрес для Управляющего узла (например, "127.0.0.1").
- * \param[in] port Строка, содержащая номер порта для Управляющего узла (например, "8080").
+ * \param[in] addr Строка, содержащая адрес для Управляющего узла: адрес IPv4 или IPv6, имя узла
+ *                 (например, "127.0.0.1", "[::1]") или путь сокета AF_UNIX ("unix:/tmp/manager.sock").
+ * \param[in] port Строка, содержащая номер порта для Управляющего узла (например, "8080"),
+ *                 для сокета AF_UNIX не используется.
  * \param[in] seconds Максимальное время общего ожидания для Управляющего узла (в секундах).
- * \param[in] num_nodes Количество рабочих узлов, необходимых для начала вычислений.
+ * \param[in] num_nodes Ожидаемое количество рабочих узлов.
  *
  * \details Функция инициализирует структуру INFO_MANAGER, устанавливая адрес прослушивания,
- *          максимальное время ожидания и требуемое количество рабочих узлов.
+ *          максимальное время ожидания и ожидаемое количество рабочих узлов.
+ *          Окно конвейера устанавливается в MANAGER_DEFAULT_WINDOW, адаптивный размер пакета включён,
+ *          режимы speculative и zerocopy выключены; эти параметры могут быть изменены до вызова start_manager.
  *          После успешной инициализации поле is_init устанавливается в true.
  */
 void info_manager_init(INFO_MANAGER *manager, const char *addr, const char *port, time_t seconds, int num_nodes);
@@ -59,11 +251,313 @@ void info_manager_init(INFO_MANAGER *manager, const char *addr, const char *port
  * \param[in] manager Структура INFO_MANAGER, инициализированная функцией info_manager_init.
  * \param[in] num_tasks Количество задач для распределенного вычисления.
  * \param[in] tasks Указатель на задачи для передачи по сети (результат работы create_task_structure).
- * \param[out] ans Указатель на область памяти, в которую последовательно записываются результаты выполнения задач.
+ * \param[out] ans Указатель на область памяти, в которую последовательно (в порядке поступления) записываются результаты выполнения задач.
  *
  * \return Возвращает 0 в случае успеха, -EINVAL при некорректных аргументах и -1 при возникновении ошибок.
  *
- * \details Функция ожидает подключения рабочих узлов в количестве, указанном в структуре INFO_MANAGER,
- *          получает информацию о количестве их ядер и распределяет задачи по принципу "одна задача - одно ядро".
+ * \details Функция начинает распределять задачи, как только подключится первый рабочий узел;
+ *          остальные узлы могут подключаться в течение всего вычисления и сразу получают задачи.
+ *          От каждого узла получается информация о количестве его ядер, задачи распределяются
+ *          по принципу "одна задача - одно ядро". Отсчёт max_time начинается с подключения первого узла.
+ *          Каждому узлу дополнительно отправляется до window задач, чтобы ядра не простаивали,
+ *          пока ответы и новые задачи передаются по сети. В режиме adaptive_batch быстрые узлы
+ *          получают пакеты крупнее: в начале задания - большие, к концу - по одной задаче на ядро.
+ *          При отказе рабочего узла его невыполненные задачи передаются оставшимся узлам;
+ *          вычисление прерывается, только если отказали все узлы.
+ */
+int start_manager(INFO_MANAGER *manager, size_t num_tasks, char *tasks, char *ans);
+
+/*!
+ * \brief Функция для старта работы Управляющего узла с размещением результатов по номерам задач.
+ *
+ * \param[in] manager Структура INFO_MANAGER, инициализированная функцией info_manager_init.
+ * \param[in] num_tasks Количество задач для распределенного вычисления.
+ * \param[in] tasks Указатель на задачи для передачи по сети (результат работы create_task_structure).
+ * \param[out] ans Указатель на буфер ответов.
+ * \param[in,out] slots Таблица из num_tasks ячеек: результат задачи i записывается в ans + slots[i].offset,
+ *                      его размер не должен превышать slots[i].size и записывается в slots[i].size.
+ *
+ * \return Возвращает 0 в случае успеха, -EINVAL при некорректных аргументах и -1 при возникновении ошибок.
+ *
+ * \details Каждая задача передаётся по сети вместе со своим номером, поэтому результаты попадают
+ *          на свои места независимо от порядка их поступления от рабочих узлов.
+ *          При slots == NULL функция эквивалентна start_manager.
+ */
+int start_manager_slots(INFO_MANAGER *manager, size_t num_tasks, char *tasks, char *ans, RESULT_SLOT *slots);
+
+/*!
+ * \brief Функция для старта работы Управляющего узла с задачами, описанными таблицей {адрес, размер}.
+ *
+ * \param[in] manager Структура INFO_MANAGER, инициализированная функцией info_manager_init.
+ * \param[in] num_tasks Количество задач для распределенного вычисления.
+ * \param[in] tasks Таблица из num_tasks элементов: задача i - это tasks[i].iov_len байт по адресу tasks[i].iov_base.
+ * \param[out] ans Указатель на буфер ответов.
+ * \param[in,out] slots Таблица размещения результатов, как в start_manager_slots, или NULL.
+ *
+ * \return Возвращает 0 в случае успеха, -EINVAL при некорректных аргументах и -1 при возникновении ошибок.
+ *
+ * \details Задачи передаются по сети прямо из памяти пользователя: размер каждой задачи добавляется
+ *          при отправке, поэтому формировать буфер функцией create_task_structure не требуется.
+ *          Память задач должна оставаться неизменной до завершения функции.
+ */
+int start_manager_iov(INFO_MANAGER *manager, size_t num_tasks, const struct iovec *tasks, char *ans, RESULT_SLOT *slots);
+
+/*!
+ * \brief Функция для старта работы Управляющего узла с учётом оценок стоимости задач.
+ *
+ * \param[in] manager Структура INFO_MANAGER, инициализированная функцией info_manager_init.
+ * \param[in] num_tasks Количество задач для распределенного вычисления.
+ * \param[in] tasks Таблица задач, как в start_manager_iov.
+ * \param[in] costs Оценки стоимости задач (неотрицательные, в произвольных единицах, например
+ *                  ожидаемое время выполнения). При costs == NULL функция эквивалентна start_manager_iov.
+ * \param[out] ans Указатель на буфер ответов.
+ * \param[in,out] slots Таблица размещения результатов, как в start_manager_slots, или NULL.
+ *
+ * \return Возвращает 0 в случае успеха, -EINVAL при некорректных аргументах и -1 при возникновении ошибок.
+ *
+ * \details Задачи отправляются в порядке убывания стоимости (longest processing time first), поэтому
+ *          дорогая задача не оказывается в конце задания, удлиняя его. В режиме adaptive_batch пакеты
+ *          рабочих узлов набираются по стоимости, а не по количеству задач, и скорость узлов
+ *          измеряется в единицах стоимости. Номера задач (и ячейки slots) соответствуют таблице tasks.
+ */
+int start_manager_costs(INFO_MANAGER *manager, size_t num_tasks, const struct iovec *tasks, const double *costs,
+                        char *ans, RESULT_SLOT *slots);
+
+/*!
+ * \brief Функция для старта работы Управляющего узла с получением задач из источника по требованию.
+ *
+ * \param[in] manager Структура INFO_MANAGER, инициализированная функцией info_manager_init.
+ * \param[in] source Источник задач; задачи нумеруются в порядке их получения из источника, начиная с 0.
+ * \param[out] ans Указатель на буфер ответов.
+ * \param[in,out] slots Таблица размещения результатов, как в start_manager_slots, или NULL для записи
+ *                      результатов в порядке поступления. Таблица должна вмещать все задачи источника.
+ *
+ * \return Возвращает 0 в случае успеха, -EINVAL при некорректных аргументах и -1 при возникновении ошибок
+ *         (в том числе при ошибке источника).
+ *
+ * \details Задачи запрашиваются у источника только тогда, когда у какого-либо рабочего узла освобождается
+ *          место в окне, поэтому в памяти одновременно находятся лишь задачи в пути, а распределение
+ *          начинается до того, как источник сформирует все задачи. Функция next вызывается из цикла
+ *          событий Управляющего узла: пока она ожидает данные, результаты от узлов не принимаются.
+ *          Задача освобождается функцией release после получения её результата
+ *          (или при завершении работы с ошибкой).
+ */
+int start_manager_source(INFO_MANAGER *manager, TASK_SOURCE *source, char *ans, RESULT_SLOT *slots);
+
+/*!
+ * \brief Функция для старта работы Управляющего узла с передачей результатов приёмнику.
+ *
+ * \param[in] manager Структура INFO_MANAGER, инициализированная функцией info_manager_init.
+ * \param[in] source Источник задач (см. start_manager_source).
+ * \param[in] sink Приёмник результатов.
+ *
+ * \return Возвращает 0 в случае успеха, -EINVAL при некорректных аргументах и -1 при возникновении ошибок
+ *         (в том числе при ошибке источника или приёмника).
+ *
+ * \details Результат каждой задачи передаётся функции on_result ровно один раз, в порядке поступления
+ *          от рабочих узлов. Управляющий узел хранит только принимаемые в данный момент результаты,
+ *          поэтому размер вывода задания не ограничен объёмом памяти.
+ */
+int start_manager_sink(INFO_MANAGER *manager, TASK_SOURCE *source, RESULT_SINK *sink);
+
+/*!
+ * \brief Функция для получения приёмника, записывающего результаты в файловый дескриптор.
+ *
+ * \param[in] fd Файловый дескриптор (файл, канал или сокет), открытый на запись.
+ *
+ * \return Приёмник результатов для start_manager_sink.
+ *
+ * \details Каждый результат записывается в порядке поступления в формате
+ *          size_t task_index, size_t size и size байт данных.
+ */
+RESULT_SINK result_sink_fd(int fd);
+
+/*!
+ * \brief Функция для старта работы Управляющего узла с задачами и результатами в файлах.
+ *
+ * \param[in] manager Структура INFO_MANAGER, инициализированная функцией info_manager_init.
+ * \param[in] tasks_path Файл задач в формате create_task_structure (size_t size, size байт данных, ...).
+ * \param[in] results_path Файл результатов: результаты записываются подряд в порядке поступления.
+ * \param[in] index_path Файл индекса: для задачи i по смещению i * sizeof(RESULT_SLOT) записывается
+ *                       RESULT_SLOT со смещением и размером её результата в файле результатов.
+ *
+ * \return Возвращает 0 в случае успеха, -EINVAL при некорректных аргументах и -1 при возникновении ошибок
+ *         (в том числе при повреждённом файле задач).
+ *
+ * \details Файлы отображаются в память: задачи читаются с упреждающим чтением (MADV_SEQUENTIAL),
+ *          файлы результатов и индекса растут по мере поступления результатов.
+ *          Объём задания ограничен только размером диска, а не оперативной памятью Управляющего узла.
+ *          Файлы результатов и индекса создаются или перезаписываются.
+ */
+int start_manager_files(INFO_MANAGER *manager, const char *tasks_path, const char *results_path, const char *index_path);
+
+/*!
+ * \brief Функция для открытия сессии Управляющего узла.
+ *
+ * \param[in] manager Структура INFO_MANAGER, инициализированная функцией info_manager_init.
+ *                    Должна оставаться доступной до закрытия сессии.
+ *
+ * \return Указатель на сессию или NULL в случае ошибки.
+ *
+ * \details Функция начинает принимать подключения рабочих узлов. Узлы остаются подключёнными
+ *          и простаивают между заданиями, поэтому очередное задание начинается без переподключения узлов.
+ *          Подключения принимаются и обрабатываются только во время manager_session_wait.
+ */
+MANAGER_SESSION *manager_session_open(INFO_MANAGER *manager);
+
+/*!
+ * \brief Функция для отправки задания в сессию.
+ *
+ * \param[in] session Сессия, открытая функцией manager_session_open.
+ * \param[in] desc Описание задания; источник, буферы и таблицы задания должны оставаться доступными
+ *                 до завершения manager_session_wait.
+ *
+ * \return Номер задания (неотрицательный) в случае успеха, -EINVAL при некорректных аргументах
+ *         и -1 при возникновении ошибок.
+ *
+ * \details Задания выполняются одновременно на общих рабочих узлах; следующее задание можно отправить,
+ *          не дожидаясь предыдущего. Освобождающиеся ядра получают задачи задания с наибольшим приоритетом,
+ *          поэтому небольшое срочное задание не ждёт большого фонового. Уже отправленные узлам задачи
+ *          не прерываются. Задания равного приоритета делят узлы пропорционально весам.
+ *          Ошибка задания не прерывает остальные задания сессии.
+ */
+int manager_session_submit(MANAGER_SESSION *session, const JOB_DESC *desc);
+
+/*!
+ * \brief Функция для выполнения задания сессии и ожидания его результатов.
+ *
+ * \param[in] session Сессия, открытая функцией manager_session_open.
+ * \param[in] job_id Номер задания, полученный от manager_session_submit.
+ *
+ * \return Возвращает 0 в случае успеха, -EINVAL при некорректных аргументах и -1 при возникновении ошибок.
+ *
+ * \details Задачи распределяются так же, как в start_manager_source; отсчёт max_time начинается с начала
+ *          выполнения задания (или с подключения первого узла). Ошибка задания не закрывает сессию: после неё
+ *          можно отправлять следующие задания. Результаты задач задания, продолжающих выполняться
+ *          на узлах после его завершения (например, копий в режиме speculative), отбрасываются.
+ */
+int manager_session_wait(MANAGER_SESSION *session, int job_id);
+
+/*!
+ * \brief Функция для закрытия сессии.
+ *
+ * \param[in] session Сессия, открытая функцией manager_session_open, или NULL.
+ *
+ * \details Поток цикла событий останавливается, невыполненные задания прерываются (JOB_FAILED).
+ *          Рабочим узлам отправляется признак завершения работы, соединения и слушающий сокет закрываются.
+ *          Соединение с узлом, не принимающим данные несколько секунд, закрывается без признака завершения.
+ *          Описатели заданий manager_submit_async остаются действительными до вызова manager_job_release.
+ */
+void manager_session_close(MANAGER_SESSION *session);
+
+/*!
+ * \brief Функция для запуска цикла событий сессии в отдельном потоке.
+ *
+ * \param[in] session Сессия, открытая функцией manager_session_open.
+ *
+ * \return Возвращает 0 в случае успеха, -EINVAL при некорректных аргументах и -1 при возникновении ошибок.
+ *
+ * \details После запуска задания выполняются в фоне, а функции manager_job_* только ожидают их.
+ *          Функции источников и приёмников заданий вызываются из потока сессии
+ *          и не должны вызывать функции сессии и заданий.
+ */
+int manager_session_start(MANAGER_SESSION *session);
+
+/*!
+ * \brief Функция для получения дескриптора, готового к чтению при наличии событий сессии.
+ *
+ * \param[in] session Сессия, открытая функцией manager_session_open.
+ *
+ * \return Дескриптор для poll/epoll вызывающего или -EINVAL.
+ *
+ * \details Позволяет встроить сессию без потока в цикл событий приложения: когда дескриптор готов
+ *          к чтению, вызывается manager_session_process. Дескриптор становится готовым к чтению
+ *          и по истечении сроков заданий (max_time, время на досылку пакетов завершённого задания),
+ *          поэтому периодически вызывать manager_session_process не требуется.
+ */
+int manager_session_fd(MANAGER_SESSION *session);
+
+/*!
+ * \brief Функция для обработки накопившихся событий сессии без ожидания.
+ *
+ * \param[in] session Сессия, открытая функцией manager_session_open, без потока manager_session_start.
+ *
+ * \return Возвращает 0 в случае успеха, -EINVAL при некорректных аргументах и -1 при ошибке цикла событий
+ *         (все задания сессии завершаются с ошибкой).
+ */
+int manager_session_process(MANAGER_SESSION *session);
+
+/*!
+ * \brief Функция для асинхронной отправки задания в сессию.
+ *
+ * \param[in] session Сессия, открытая функцией manager_session_open.
+ * \param[in] desc Описание задания (см. manager_session_submit).
+ *
+ * \return Описатель задания или NULL в случае ошибки.
+ *
+ * \details Функция не блокируется: задание выполняется потоком сессии, вызовами manager_session_process
+ *          или внутри manager_job_wait. Описатель освобождается функцией manager_job_release.
+ */
+MANAGER_JOB_HANDLE *manager_submit_async(MANAGER_SESSION *session, const JOB_DESC *desc);
+
+/*!
+ * \brief Функция для получения состояния задания без ожидания.
+ */
+JOB_STATUS manager_job_poll(MANAGER_JOB_HANDLE *handle);
+
+/*!
+ * \brief Функция для получения хода выполнения задания.
+ *
+ * \param[in] handle Описатель задания.
+ * \param[out] progress Состояние задания и количество отправленных задач и полученных результатов.
+ */
+void manager_job_progress(MANAGER_JOB_HANDLE *handle, JOB_PROGRESS *progress);
+
+/*!
+ * \brief Функция для ожидания завершения задания.
+ *
+ * \param[in] handle Описатель задания.
+ * \param[in] timeout_ms Максимальное время ожидания в миллисекундах (-1 - без ограничения, 0 - не ждать).
+ *
+ * \return Возвращает 0, если задание выполнено, -ETIMEDOUT, если время ожидания истекло,
+ *         и -1, если задание завершено с ошибкой.
+ *
+ * \details Если поток сессии не запущен, цикл событий сессии выполняется внутри функции.
+ */
+int manager_job_wait(MANAGER_JOB_HANDLE *handle, int timeout_ms);
+
+/*!
+ * \brief Функция для освобождения описателя завершённого задания.
+ *
+ * \return Возвращает 0 в случае успеха и -EBUSY, если задание ещё не завершено.
+ */
+int manager_job_release(MANAGER_JOB_HANDLE *handle);
+
+/*!
+ * \brief Функция для получения статистики сжатия сессии.
+ *
+ * \param[in] session Сессия, открытая функцией manager_session_open.
+ * \param[out] stats Размеры данных задач и результатов до и после сжатия (см. INFO_MANAGER::codec_stats).
+ *
+ * \details Экономия трафика - разность tx_raw_bytes и tx_wire_bytes (rx_raw_bytes и rx_wire_bytes).
+ *          Функцию можно вызывать во время работы потока сессии.
+ */
+void manager_session_codec_stats(MANAGER_SESSION *session, MANAGER_CODEC_STATS *stats);
+
+/*!
+ * \brief Функция для получения статистики сессии и её рабочих узлов.
+ *
+ * \param[in] session Сессия, открытая функцией manager_session_open.
+ * \param[out] stats Статистика сессии или NULL.
+ * \param[out] workers Массив для статистики подключённых узлов или NULL.
+ * \param[in] max_workers Размер массива workers.
+ *
+ * \return Количество подключённых узлов (статистика записывается не более чем для max_workers из них)
+ *         или -EINVAL при некорректных аргументах.
+ *
+ * \details Счётчики ведутся всегда и обновляются циклом событий при отправке пакетов и приёме результатов,
+ *          поэтому по ним видно, где теряется производительность: в простое ядер узлов, в сети
+ *          (время оборота задачи) или в повторной отправке задач отказавших узлов.
+ *          Функцию можно вызывать во время работы потока сессии.
  */
-int start_manager(INFO_MANAGER *manager, size_t num_tasks, char *tasks, char *ans);
\ No newline at end of file
+int manager_get_stats(MANAGER_SESSION *session, MANAGER_STATS *stats, MANAGER_WORKER_STATS *workers, size_t max_workers);
@@ -0,0 +1,101 @@
+//================
+// Неблокирующая очередь указателей (MPMC).
+//================
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+//! Размер строки кэша, по которому выравниваются счётчики очереди.
+#define TASK_QUEUE_CACHE_LINE 64
+
+//! Ячейка очереди: номер поколения и хранимый указатель.
+typedef struct
+{
+    _Atomic size_t seq;
+    void *item;
+} TASK_QUEUE_CELL;
+
+//! Ограниченная очередь без блокировок (алгоритм Д. Вьюкова).
+typedef struct
+{
+    //! Массив ячеек, размер которого является степенью двойки.
+    TASK_QUEUE_CELL *cells;
+    //! Маска для вычисления индекса ячейки по позиции.
+    size_t mask;
+    //! Позиция для записи очередного элемента.
+    _Alignas(TASK_QUEUE_CACHE_LINE) _Atomic size_t head;
+    //! Позиция для чтения очередного элемента.
+    _Alignas(TASK_QUEUE_CACHE_LINE) _Atomic size_t tail;
+} TASK_QUEUE;
+
+static bool task_queue_init(TASK_QUEUE *queue, size_t min_capacity)
+{
+    size_t capacity = 1;
+    while (capacity < min_capacity) {
+        capacity <<= 1;
+    }
+    queue->cells = calloc(capacity, sizeof(*queue->cells));
+    if (queue->cells == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+        atomic_init(&queue->cells[i].seq, i);
+    }
+    queue->mask = capacity - 1;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    return true;
+}
+
+static void task_queue_destroy(TASK_QUEUE *queue)
+{
+    free(queue->cells);
+    queue->cells = NULL;
+}
+
+//! Возвращает false, если очередь заполнена.
+static bool task_queue_push(TASK_QUEUE *queue, void *item)
+{
+    size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    while (true) {
+        TASK_QUEUE_CELL *cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->item = item;
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+}
+
+//! Возвращает false, если очередь пуста.
+static bool task_queue_pop(TASK_QUEUE *queue, void **item)
+{
+    size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    while (true) {
+        TASK_QUEUE_CELL *cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *item = cell->item;
+                atomic_store_explicit(&cell->seq, pos + queue->mask + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+}
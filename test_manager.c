@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 
 #define NUM_TASKS 8
 #define LEFT -10000
@@ -22,9 +23,225 @@ static double get_step(double right, double precision) {
     return cbrt(24 * precision / max_derivative_2);
 }
 
+// Каждый режим проверки выполняет задачи tasks одним из способов и возвращает сумму результатов
+// или NAN при ошибке. Режим задаётся необязательным пятым аргументом, без него - start_manager.
+
+// Задачи в формате create_task_structure, результаты - в порядке поступления (start_manager).
+static double run_plain(INFO_MANAGER *info_manager, struct task_integral *tasks) {
+    size_t task_sizes[NUM_TASKS];
+    for (int i = 0; i < NUM_TASKS; ++i) {
+        task_sizes[i] = sizeof(*tasks);
+    }
+    char *tasks_prepare = create_task_structure(NUM_TASKS, task_sizes, (char *)tasks);
+    if (tasks_prepare == NULL) {
+        return NAN;
+    }
+    double ans_manager[NUM_TASKS] = { 0 };
+    double ans = NAN;
+    if (start_manager(info_manager, NUM_TASKS, tasks_prepare, (char *)ans_manager) == 0) {
+        ans = 0;
+        for (int i = 0; i < NUM_TASKS; ++i) {
+            ans += ans_manager[i];
+        }
+    }
+    free(tasks_prepare);
+    return ans;
+}
+
+// Задачи прямо из массива tasks с оценками стоимости, результаты - по номерам задач (start_manager_costs).
+static double run_costs(INFO_MANAGER *info_manager, struct task_integral *tasks) {
+    struct iovec task_table[NUM_TASKS];
+    double costs[NUM_TASKS];
+    double ans_manager[NUM_TASKS] = { 0 };
+    RESULT_SLOT slots[NUM_TASKS];
+    for (int i = 0; i < NUM_TASKS; ++i) {
+        task_table[i].iov_base = &tasks[i];
+        task_table[i].iov_len = sizeof(*tasks);
+        // Стоимость задачи пропорциональна количеству шагов интегрирования.
+        costs[i] = tasks[i].num_steps;
+        // Результат задачи i попадает в ans_manager[i] независимо от порядка поступления.
+        slots[i].offset = i * sizeof(*ans_manager);
+        slots[i].size = sizeof(*ans_manager);
+    }
+    if (start_manager_costs(info_manager, NUM_TASKS, task_table, costs, (char *)ans_manager, slots) != 0) {
+        return NAN;
+    }
+    double ans = 0;
+    for (int i = 0; i < NUM_TASKS; ++i) {
+        ans += ans_manager[i];
+    }
+    return ans;
+}
+
+// Источник задач массива tasks.
+struct tasks_source {
+    struct task_integral *tasks;
+    size_t next;
+};
+
+static int tasks_source_next(void *ctx, const char **data, size_t *size) {
+    struct tasks_source *source = ctx;
+    if (source->next == NUM_TASKS) {
+        return 0;
+    }
+    *data = (const char *)&source->tasks[source->next++];
+    *size = sizeof(*source->tasks);
+    return 1;
+}
+
+// Приёмник, складывающий результаты; каждая задача должна дать ровно один результат.
+struct sum_sink {
+    double ans;
+    size_t count[NUM_TASKS];
+};
+
+static bool sum_sink_result(void *ctx, size_t task_index, const char *data, size_t size) {
+    struct sum_sink *sink = ctx;
+    double res;
+    if (task_index >= NUM_TASKS || size != sizeof(res) || sink->count[task_index]++ != 0) {
+        return false;
+    }
+    memcpy(&res, data, sizeof(res));
+    sink->ans += res;
+    return true;
+}
+
+// Источник задач и приёмник результатов (start_manager_sink).
+static double run_sink(INFO_MANAGER *info_manager, struct task_integral *tasks) {
+    struct tasks_source tasks_source = { .tasks = tasks };
+    struct sum_sink sum_sink = { 0 };
+    TASK_SOURCE source = { .next = tasks_source_next, .ctx = &tasks_source };
+    RESULT_SINK sink = { .on_result = sum_sink_result, .ctx = &sum_sink };
+    return start_manager_sink(info_manager, &source, &sink) == 0 ? sum_sink.ans : NAN;
+}
+
+// Задание из файлов (start_manager_files). При empty_first первая задача (и её результат) пустая,
+// а остальные - задачи tasks: пустой результат, пришедший первым, не должен теряться.
+static double run_files(INFO_MANAGER *info_manager, struct task_integral *tasks, const char *port, bool empty_first) {
+    char tasks_path[64], results_path[64], index_path[64];
+    snprintf(tasks_path, sizeof(tasks_path), "/tmp/test_manager_%s.tasks", port);
+    snprintf(results_path, sizeof(results_path), "/tmp/test_manager_%s.results", port);
+    snprintf(index_path, sizeof(index_path), "/tmp/test_manager_%s.index", port);
+    size_t first = empty_first ? 1 : 0;
+    size_t num_tasks = NUM_TASKS + first;
+    size_t task_sizes[NUM_TASKS + 1] = { 0 };
+    for (size_t i = first; i < num_tasks; ++i) {
+        task_sizes[i] = sizeof(*tasks);
+    }
+    char *tasks_prepare = create_task_structure(num_tasks, task_sizes, (char *)tasks);
+    if (tasks_prepare == NULL) {
+        return NAN;
+    }
+    size_t file_size = num_tasks * sizeof(size_t) + NUM_TASKS * sizeof(*tasks);
+    FILE *file = fopen(tasks_path, "wb");
+    bool written = file != NULL && fwrite(tasks_prepare, 1, file_size, file) == file_size;
+    free(tasks_prepare);
+    if (file == NULL || fclose(file) != 0 || !written) {
+        return NAN;
+    }
+    double ans = NAN;
+    RESULT_SLOT index[NUM_TASKS + 1];
+    if (start_manager_files(info_manager, tasks_path, results_path, index_path) == 0) {
+        file = fopen(index_path, "rb");
+        FILE *results = fopen(results_path, "rb");
+        if (file != NULL && results != NULL && fread(index, sizeof(*index), num_tasks, file) == num_tasks &&
+            (!empty_first || index[0].size == 0)) {
+            ans = 0;
+            for (size_t i = first; i < num_tasks; ++i) {
+                double res;
+                if (index[i].size != sizeof(res) || fseek(results, index[i].offset, SEEK_SET) != 0 ||
+                    fread(&res, sizeof(res), 1, results) != 1) {
+                    ans = NAN;
+                    break;
+                }
+                ans += res;
+            }
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+        if (results != NULL) {
+            fclose(results);
+        }
+    }
+    remove(tasks_path);
+    remove(results_path);
+    remove(index_path);
+    return ans;
+}
+
+// Два задания одной сессии: manager_session_submit и manager_submit_async.
+// Узлы остаются подключёнными между заданиями, результаты обоих заданий должны совпасть.
+static double run_session(INFO_MANAGER *info_manager, struct task_integral *tasks) {
+    MANAGER_SESSION *session = manager_session_open(info_manager);
+    if (session == NULL) {
+        return NAN;
+    }
+    double ans[2] = { NAN, NAN };
+    struct tasks_source tasks_source = { .tasks = tasks };
+    struct sum_sink sum_sink = { 0 };
+    JOB_DESC desc = {
+        .source = { .next = tasks_source_next, .ctx = &tasks_source },
+        .num_tasks = NUM_TASKS,
+        .sink = { .on_result = sum_sink_result, .ctx = &sum_sink },
+    };
+    int job_id = manager_session_submit(session, &desc);
+    if (job_id >= 0 && manager_session_wait(session, job_id) == 0) {
+        ans[0] = sum_sink.ans;
+    }
+    double ans_manager[NUM_TASKS] = { 0 };
+    RESULT_SLOT slots[NUM_TASKS];
+    for (int i = 0; i < NUM_TASKS; ++i) {
+        slots[i].offset = i * sizeof(*ans_manager);
+        slots[i].size = sizeof(*ans_manager);
+    }
+    tasks_source.next = 0;
+    desc.sink.on_result = NULL;
+    desc.ans = (char *)ans_manager;
+    desc.slots = slots;
+    MANAGER_JOB_HANDLE *handle = manager_submit_async(session, &desc);
+    if (handle != NULL && manager_job_wait(handle, -1) == 0 && manager_job_poll(handle) == JOB_DONE) {
+        ans[1] = 0;
+        for (int i = 0; i < NUM_TASKS; ++i) {
+            ans[1] += ans_manager[i];
+        }
+    }
+    manager_session_close(session);
+    // Описатель остаётся действительным и после закрытия сессии.
+    if (handle != NULL) {
+        manager_job_release(handle);
+    }
+    // Результаты складываются в разном порядке и могут отличаться на ошибку округления.
+    return fabs(ans[0] - ans[1]) <= 1e-9 * fabs(ans[0]) ? ans[1] : NAN;
+}
+
+// Статистика и трассировка задания: оба файла должны быть записаны.
+static double run_stats(INFO_MANAGER *info_manager, struct task_integral *tasks, const char *port) {
+    char stats_path[64], trace_path[64];
+    snprintf(stats_path, sizeof(stats_path), "/tmp/test_manager_%s.stats", port);
+    snprintf(trace_path, sizeof(trace_path), "/tmp/test_manager_%s.trace", port);
+    remove(stats_path);
+    info_manager->stats_path = stats_path;
+    info_manager->trace_path = trace_path;
+    double ans = run_costs(info_manager, tasks);
+    const char *paths[] = { stats_path, trace_path };
+    for (int i = 0; i < 2; ++i) {
+        FILE *file = fopen(paths[i], "r");
+        if (file == NULL || fgetc(file) != '{') {
+            ans = NAN;
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+        remove(paths[i]);
+    }
+    return ans;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s <address> <port> <max_time> <num_nodes>\n", argv[0]);
+    if (argc != 5 && argc != 6) {
+        fprintf(stderr, "Usage: %s <address> <port> <max_time> <num_nodes> "
+                "[costs|sink|files|empty|session|tcp|stats]\n", argv[0]);
         return 1;
     }
     INFO_MANAGER info_manager;
@@ -44,16 +261,14 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Unable to parse number of workers!\n");
         return 1;
     }
+    const char *mode = argc == 6 ? argv[5] : "";
     info_manager_init(&info_manager, argv[1], argv[2], max_time, num_workers);
     double step = get_step(RIGHT, PRECISION);
     uint64_t num_count = (uint64_t)(ceil(fabs((double)RIGHT - LEFT) / step)) + 2;
     // Избавляемся от неполных шагов
     step = ((double)(RIGHT - LEFT)) / num_count;
     struct task_integral *tasks = calloc(NUM_TASKS,sizeof(*tasks));
-    size_t *task_sizes = calloc(NUM_TASKS,sizeof(*task_sizes));
-    if(tasks == NULL || task_sizes == NULL) {
-        free(tasks);
-        free(task_sizes);
+    if(tasks == NULL) {
         printf("NO MEMORY!\n");
         return 1;
     }
@@ -61,31 +276,36 @@ int main(int argc, char *argv[]) {
     for (int i = 0; i < NUM_TASKS; ++i) {
         tasks[i].left = LEFT + step * num_count_i * i;
         tasks[i].num_steps = num_count_i;
-        task_sizes[i] = sizeof(*tasks);
-        tasks[i].step = step; 
+        tasks[i].step = step;
     }
 
     tasks[NUM_TASKS - 1].num_steps += num_count % NUM_TASKS;
-    char *tasks_prepare = create_task_structure(NUM_TASKS,task_sizes,(char *)tasks);
-    free(tasks);
-    free(task_sizes);
-    if(tasks_prepare == NULL) {
-        printf("Error in task_prepare!\n");
-        return 1;
-    }
 
-    double *ans_manager = calloc (NUM_TASKS,sizeof(*ans_manager));
-    if (start_manager(&info_manager,NUM_TASKS,tasks_prepare,(char*)ans_manager) < 0) {
-        free(tasks_prepare);
-        free(ans_manager);
+    double ans = NAN;
+    if (strcmp(mode, "") == 0) {
+        ans = run_plain(&info_manager, tasks);
+    } else if (strcmp(mode, "costs") == 0) {
+        ans = run_costs(&info_manager, tasks);
+    } else if (strcmp(mode, "sink") == 0) {
+        ans = run_sink(&info_manager, tasks);
+    } else if (strcmp(mode, "files") == 0 || strcmp(mode, "empty") == 0) {
+        ans = run_files(&info_manager, tasks, argv[2], strcmp(mode, "empty") == 0);
+    } else if (strcmp(mode, "session") == 0) {
+        ans = run_session(&info_manager, tasks);
+    } else if (strcmp(mode, "tcp") == 0) {
+        // Узлы на том же хосте работают через сокет, а не через разделяемую память, со сжатием.
+        info_manager.shared_memory = false;
+        info_manager.codec = MANAGER_CODEC_LZ;
+        ans = run_costs(&info_manager, tasks);
+    } else if (strcmp(mode, "stats") == 0) {
+        ans = run_stats(&info_manager, tasks, argv[2]);
+    } else {
+        fprintf(stderr, "Unknown mode %s\n", mode);
+    }
+    free(tasks);
+    if (isnan(ans)) {
         printf("Error in start manager!\n");
         return 1;
     }
-    double ans = 0;
-    for (int i = 1; i < NUM_TASKS; ++i) {
-        ans += ans_manager[i];
-    }
-    free(tasks_prepare);
-    free(ans_manager);
     printf("ANSWER: %lf!\n",ans);
-}
\ No newline at end of file
+}
@@ -14,17 +14,26 @@ struct work_info {
 void * calculate_integral(void *buf) {
     struct work_info *task;
     size_t size_task = parse_task(buf, (void**)&task);
+    // Пустая задача - пустой результат.
+    if (size_task == 0) {
+        return worker_result_buffer(0);
+    }
     if (sizeof(*task) != size_task) {
         fprintf(stderr, "Unexpected task_size!\n");
         return NULL;
     }
-    double res = 0;
+    // Результат записывается сразу в буфер отправки.
+    double *res = worker_result_buffer(sizeof(*res));
+    if (res == NULL) {
+        return NULL;
+    }
+    *res = 0;
     double left = task->left;
     for (long long i = 0; i < task->num_steps; ++i) {
-        res += exp(left + task->step/2) * task->step;
+        *res += exp(left + task->step/2) * task->step;
         left += task->step;
     }
-    return format_ans(sizeof(res),(void *)&res);
+    return res;
 }
 
 int main(int argc, char** argv)
@@ -0,0 +1,356 @@
+//================
+// Топология процессоров рабочего узла и размещение потоков пула.
+//================
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sched.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
+#include <linux/mempolicy.h>
+
+// Топология определяется по sysfs (/sys/devices/system/cpu) для процессоров из маски sched_getaffinity;
+// если sysfs недоступна, каждый процессор считается отдельным ядром единственного NUMA-узла.
+// Потоки занимают сначала по одному процессору каждого физического ядра, чередуя NUMA-узлы,
+// затем - остальные SMT-потоки ядер. Занятые процессоры отмечаются файлами блокировки
+// (flock на /dev/shm/cluster-cpu-UID-N с правами 0600), поэтому несколько рабочих узлов одного
+// пользователя на хосте не собираются на одних и тех же процессорах; блокировки снимаются ядром
+// при завершении процесса. Пустые файлы блокировки намеренно не удаляются: если удалить файл,
+// который другой узел уже открыл, но ещё не заблокировал, два узла займут один процессор.
+
+//! Наибольший системный номер NUMA-узла, которому привязываются буферы.
+#define WORKER_TOPOLOGY_MAX_NODE 1023
+//! Буферы меньшего размера (в байтах) не привязываются к NUMA-узлу: они и так остаются в кэше.
+#define WORKER_TOPOLOGY_BIND_MIN (64 * 1024)
+
+//! Логический процессор, доступный рабочему узлу.
+typedef struct
+{
+    //! Номер процессора в системе.
+    int cpu;
+    //! Номер физического ядра - наименьший номер процессора среди его SMT-потоков.
+    int core;
+    //! Номер процессора среди SMT-потоков своего ядра (0 - первый поток ядра).
+    size_t smt;
+    //! Индекс NUMA-узла процессора в WORKER_TOPOLOGY::nodes.
+    size_t node;
+    //! Порядковый номер ядра среди ядер своего NUMA-узла.
+    size_t node_rank;
+} WORKER_CPU;
+
+//! Доступные рабочему узлу процессоры.
+typedef struct
+{
+    //! Процессоры в порядке размещения потоков.
+    WORKER_CPU *cpus;
+    size_t n_cpus;
+    //! Системные номера NUMA-узлов, которым принадлежат процессоры.
+    int *nodes;
+    size_t n_nodes;
+    //! Вычислительная мощность в процессорах с учётом квоты cgroup (не больше n_cpus).
+    size_t capacity;
+    //! Дескрипторы файлов блокировки процессоров, занятых этим узлом (-1 - процессор не занят).
+    int *locks;
+} WORKER_TOPOLOGY;
+
+// Первое целое число файла path (для списков процессоров - наименьший номер); fallback, если файла нет.
+static long topology_read_long(const char *path, long fallback)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return fallback;
+    }
+    long value;
+    if (fscanf(file, "%ld", &value) != 1) {
+        value = fallback;
+    }
+    fclose(file);
+    return value;
+}
+
+// Системный номер NUMA-узла процессора cpu (по ссылке nodeN в его каталоге sysfs), 0 - если не найден.
+static int topology_cpu_node(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+    int node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] != '\0') {
+            long value = strtol(entry->d_name + 4, &end, 10);
+            if (*end == '\0' && value >= 0 && value <= WORKER_TOPOLOGY_MAX_NODE) {
+                node = (int)value;
+                break;
+            }
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+// Ограничение квоты cgroup в каталоге dir (в процессорах, с округлением вверх); 0 - квоты нет.
+// v2 - квота в cpu.max ("max 100000" или "<квота> <период>"), иначе - в cpu.cfs_quota_us cgroup v1.
+static size_t topology_cgroup_dir_limit(const char *dir, bool v2)
+{
+    char path[4096 + 32];
+    long quota = -1, period = 0;
+    if (v2) {
+        snprintf(path, sizeof(path), "%s/cpu.max", dir);
+        FILE *file = fopen(path, "r");
+        if (file == NULL) {
+            return 0;
+        }
+        if (fscanf(file, "%ld %ld", &quota, &period) != 2) {
+            quota = -1;
+        }
+        fclose(file);
+    } else {
+        snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+        quota = topology_read_long(path, -1);
+        snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+        period = topology_read_long(path, 0);
+    }
+    if (quota <= 0 || period <= 0) {
+        return 0;
+    }
+    return (size_t)((quota + period - 1) / period);
+}
+
+// Наименьшее ограничение квоты cgroup процесса (в процессорах) по всем уровням иерархии; 0 - квоты нет.
+static size_t topology_cgroup_limit(void)
+{
+    FILE *file = fopen("/proc/self/cgroup", "r");
+    if (file == NULL) {
+        return 0;
+    }
+    size_t limit = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        // Строка "<номер>:<контроллеры>:<путь>"; у cgroup v2 список контроллеров пуст.
+        char *controllers = strchr(line, ':');
+        char *cgroup_path = controllers == NULL ? NULL : strchr(controllers + 1, ':');
+        if (cgroup_path == NULL) {
+            continue;
+        }
+        *cgroup_path++ = '\0';
+        cgroup_path[strcspn(cgroup_path, "\n")] = '\0';
+        controllers++;
+        bool v2 = controllers[0] == '\0';
+        if (!v2) {
+            // Контроллер cpu монтируется каталогом с именем списка контроллеров ("cpu" или "cpu,cpuacct").
+            char names[256], *save = NULL;
+            bool has_cpu = false;
+            snprintf(names, sizeof(names), "%s", controllers);
+            for (char *name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+                has_cpu |= strcmp(name, "cpu") == 0;
+            }
+            if (!has_cpu) {
+                continue;
+            }
+        }
+        // Путь в /proc/self/cgroup не совпадает с точкой монтирования внутри контейнера,
+        // поэтому квоты проверяются на всех уровнях вплоть до корня.
+        char dir[4096 + 32];
+        int prefix = snprintf(dir, sizeof(dir), "/sys/fs/cgroup%s%s", v2 ? "" : "/", v2 ? "" : controllers);
+        if (prefix < 0 || (size_t)prefix >= sizeof(dir)) {
+            continue;
+        }
+        snprintf(dir + prefix, sizeof(dir) - prefix, "%s", strcmp(cgroup_path, "/") == 0 ? "" : cgroup_path);
+        while (true) {
+            size_t dir_limit = topology_cgroup_dir_limit(dir, v2);
+            if (dir_limit != 0 && (limit == 0 || dir_limit < limit)) {
+                limit = dir_limit;
+            }
+            char *slash = strrchr(dir, '/');
+            if (slash == NULL || slash - dir < prefix) {
+                break;
+            }
+            *slash = '\0';
+        }
+    }
+    fclose(file);
+    return limit;
+}
+
+// Порядок размещения: первые SMT-потоки ядер раньше остальных, ядра разных NUMA-узлов чередуются.
+static int topology_cpu_compare(const void *lhs, const void *rhs)
+{
+    const WORKER_CPU *a = lhs, *b = rhs;
+    if (a->smt != b->smt) {
+        return a->smt < b->smt ? -1 : 1;
+    }
+    if (a->node_rank != b->node_rank) {
+        return a->node_rank < b->node_rank ? -1 : 1;
+    }
+    if (a->node != b->node) {
+        return a->node < b->node ? -1 : 1;
+    }
+    return (a->cpu > b->cpu) - (a->cpu < b->cpu);
+}
+
+static void worker_topology_destroy(WORKER_TOPOLOGY *topo)
+{
+    if (topo->locks != NULL) {
+        for (size_t i = 0; i < topo->n_cpus; ++i) {
+            if (topo->locks[i] != -1) {
+                close(topo->locks[i]);
+            }
+        }
+    }
+    free(topo->locks);
+    free(topo->nodes);
+    free(topo->cpus);
+    memset(topo, 0, sizeof(*topo));
+}
+
+// Определение процессоров, доступных процессу, их ядер, NUMA-узлов и квоты cgroup.
+static bool worker_topology_discover(WORKER_TOPOLOGY *topo)
+{
+    memset(topo, 0, sizeof(*topo));
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        int n_procs = get_nprocs();
+        for (int cpu = 0; cpu < n_procs && cpu < CPU_SETSIZE; ++cpu) {
+            CPU_SET(cpu, &allowed);
+        }
+    }
+    size_t n_allowed = (size_t)CPU_COUNT(&allowed);
+    topo->cpus = calloc(n_allowed == 0 ? 1 : n_allowed, sizeof(*topo->cpus));
+    topo->nodes = calloc(n_allowed == 0 ? 1 : n_allowed, sizeof(*topo->nodes));
+    topo->locks = calloc(n_allowed == 0 ? 1 : n_allowed, sizeof(*topo->locks));
+    if (topo->cpus == NULL || topo->nodes == NULL || topo->locks == NULL) {
+        fprintf(stderr, "[worker_topology_discover] No memory for topology!\n");
+        worker_topology_destroy(topo);
+        return false;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE && topo->n_cpus < n_allowed; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        char path[96];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        WORKER_CPU *info = &topo->cpus[topo->n_cpus];
+        info->cpu = cpu;
+        info->core = (int)topology_read_long(path, cpu);
+        int node = topology_cpu_node(cpu);
+        for (info->node = 0; info->node < topo->n_nodes && topo->nodes[info->node] != node; ++info->node);
+        if (info->node == topo->n_nodes) {
+            topo->nodes[topo->n_nodes++] = node;
+        }
+        topo->locks[topo->n_cpus] = -1;
+        topo->n_cpus++;
+    }
+    if (topo->n_cpus == 0) {
+        // Процессоры не определены: поток закрепляется за процессором 0, как и раньше.
+        topo->cpus[0] = (WORKER_CPU){ .cpu = 0, .core = 0 };
+        topo->locks[0] = -1;
+        topo->n_nodes = 1;
+        topo->n_cpus = 1;
+    }
+    // Номер SMT-потока внутри ядра и номер ядра внутри NUMA-узла (процессоры упорядочены по номеру).
+    for (size_t i = 0; i < topo->n_cpus; ++i) {
+        for (size_t j = 0; j < i; ++j) {
+            topo->cpus[i].smt += topo->cpus[j].core == topo->cpus[i].core;
+        }
+    }
+    for (size_t i = 0; i < topo->n_cpus; ++i) {
+        WORKER_CPU *info = &topo->cpus[i];
+        for (size_t j = 0; j < topo->n_cpus; ++j) {
+            const WORKER_CPU *other = &topo->cpus[j];
+            info->node_rank += other->smt == 0 && other->node == info->node && other->core < info->core;
+        }
+    }
+    qsort(topo->cpus, topo->n_cpus, sizeof(*topo->cpus), topology_cpu_compare);
+
+    topo->capacity = topo->n_cpus;
+    size_t limit = topology_cgroup_limit();
+    if (limit != 0 && limit < topo->capacity) {
+        topo->capacity = limit;
+    }
+    return true;
+}
+
+// Попытка занять процессор topo->cpus[index] файлом блокировки; false - процессор занят другим узлом.
+// Если файл блокировки не создаётся (нет /dev/shm) или принадлежит другому пользователю,
+// процессор считается свободным: чужой файл не должен мешать размещению.
+static bool topology_claim(WORKER_TOPOLOGY *topo, size_t index)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/cluster-cpu-%u-%d", (unsigned)getuid(), topo->cpus[index].cpu);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return true;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_uid != getuid() || (st.st_mode & 0077) != 0) {
+        close(fd);
+        return true;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        close(fd);
+        return errno != EWOULDBLOCK;
+    }
+    topo->locks[index] = fd;
+    return true;
+}
+
+// Выбор процессоров для n_threads <= topo->n_cpus потоков: сначала процессоры, не занятые другими
+// рабочими узлами хоста, в порядке размещения, затем (если свободных не хватило) остальные по порядку.
+// cpus[i] - индекс процессора потока i в topo->cpus.
+static void worker_topology_place(WORKER_TOPOLOGY *topo, size_t n_threads, size_t *cpus)
+{
+    bool *taken = calloc(topo->n_cpus, sizeof(*taken));
+    size_t n = 0;
+    for (size_t i = 0; i < topo->n_cpus && n < n_threads; ++i) {
+        // Без памяти для отметок процессоры занимаются по порядку без блокировок.
+        if (taken == NULL || topology_claim(topo, i)) {
+            cpus[n++] = i;
+            if (taken != NULL) {
+                taken[i] = true;
+            }
+        }
+    }
+    for (size_t i = 0; i < topo->n_cpus && n < n_threads; ++i) {
+        if (!taken[i]) {
+            cpus[n++] = i;
+        }
+    }
+    free(taken);
+}
+
+// Перенос страниц буфера [addr, addr + size) на NUMA-узел node (индекс в topo->nodes) и предпочтение
+// этого узла для них в дальнейшем. Имеет смысл, только если у узла несколько NUMA-узлов.
+static void worker_topology_bind(const WORKER_TOPOLOGY *topo, size_t node, void *addr, size_t size)
+{
+    if (topo->n_nodes < 2 || size < WORKER_TOPOLOGY_BIND_MIN) {
+        return;
+    }
+    // Привязываются только страницы, целиком принадлежащие буферу.
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t begin = ((uintptr_t)addr + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)addr + size) & ~(page - 1);
+    if (begin >= end) {
+        return;
+    }
+    unsigned long mask[(WORKER_TOPOLOGY_MAX_NODE + 1) / (8 * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    int id = topo->nodes[node];
+    mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+    // Привязка - только оптимизация: при ошибке буфер остаётся там, где был выделен.
+    syscall(SYS_mbind, (void *)begin, end - begin, MPOL_PREFERRED, mask, 8 * sizeof(mask) + 1, MPOL_MF_MOVE);
+}
@@ -8,11 +8,15 @@
 #include <stdbool.h>
 #include <math.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/sysinfo.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 
 #include <fcntl.h>
 #include <netdb.h>
@@ -21,39 +25,28 @@
 #include <time.h>
 #include <sched.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include "worker.h"
+#include "task-queue.h"
+#include "worker-topology.h"
+#include "cluster-protocol.h"
+#include "cluster-codec.h"
+#include "cluster-shm.h"
+#include "cluster-transport.h"
+#include "cluster-trace.h"
 
 //==================
 // Управление сетью
 //==================
 static bool worker_connect_to_manager(INFO_WORKER* worker)
 {
-    if (connect(worker->server_conn_fd, &worker->server_addr, sizeof(worker->server_addr)) == -1)
+    // Сокет, не сумевший подключиться, повторно не используется: каждая попытка создаёт новый.
+    worker->server_conn_fd = worker->transport->connect((struct sockaddr *)&worker->server_addr,
+                                                        worker->server_addr_len);
+    if (worker->server_conn_fd == -1)
     {
         return false;
     }
-    // TCP KEEP ALIVE
-    int setsockopt_arg  = 1;
-    if(setsockopt(worker->server_conn_fd, SOL_SOCKET, SO_KEEPALIVE, &setsockopt_arg, sizeof(setsockopt_arg)) == -1) {
-        fprintf(stderr, "[manager_accept_connection_request] Unable to enable TCP Keep-Alive socket option");
-        return false;
-    }
-    // TCP KeepIdle
-    setsockopt_arg = 5;
-    if(setsockopt(worker->server_conn_fd, IPPROTO_TCP, TCP_KEEPIDLE, &setsockopt_arg, sizeof(setsockopt_arg)) == -1) {
-        fprintf(stderr, "[manager_accept_connection_request] Unable to enable TCP KeepIdle socket option");
-        return false;
-    }
-    setsockopt_arg = 1;
-    if(setsockopt(worker->server_conn_fd, IPPROTO_TCP, TCP_KEEPINTVL, &setsockopt_arg, sizeof(setsockopt_arg)) == -1) {
-        fprintf(stderr, "[manager_accept_connection_request] Unable to enable TCP KeepINTVL socket option");
-        return false;
-    }
-    setsockopt_arg = 3;
-    if(setsockopt(worker->server_conn_fd, IPPROTO_TCP, TCP_KEEPCNT, &setsockopt_arg, sizeof(setsockopt_arg)) == -1) {
-        fprintf(stderr, "[manager_accept_connection_request] Unable to enable TCP TCP_KEEPCNT socket option");
-        return false;
-    }
 
     struct timeval tv;
     tv.tv_sec = 5; 
@@ -61,6 +54,8 @@ static bool worker_connect_to_manager(INFO_WORKER* worker)
     
     if (setsockopt(worker->server_conn_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv) < 0) {
         fprintf(stderr,"[get_tasks] setsockopt (SO_RCVTIMEO) failed");
+        worker->transport->close(worker->server_conn_fd, NULL, 0);
+        worker->server_conn_fd = -1;
         return false;
     }
 
@@ -69,7 +64,14 @@ static bool worker_connect_to_manager(INFO_WORKER* worker)
 
 static bool worker_close_socket(INFO_WORKER* worker)
 {
-    if (close(worker->server_conn_fd) == -1)
+    if (worker->shm != NULL) {
+        cluster_shm_detach(worker->shm);
+        free(worker->shm);
+        worker->shm = NULL;
+    }
+    int fd = worker->server_conn_fd;
+    worker->server_conn_fd = -1;
+    if (worker->transport->close(fd, NULL, 0) == -1)
     {
         fprintf(stderr, "[worker_close_socket] Unable to close() worker socket\n");
         return false;
@@ -78,16 +80,115 @@ static bool worker_close_socket(INFO_WORKER* worker)
 }
 
 
+//=================================
+// Статистика
+//=================================
+
+// Каждый счётчик статистики изменяет только один поток, а читать его может любой (worker_get_stats):
+// обновление и чтение выполняются атомарно, но без упорядочивания и без блокировок.
+_Static_assert(sizeof(CLUSTER_HISTOGRAM) % sizeof(size_t) == 0 && sizeof(WORKER_THREAD_STATS) % sizeof(size_t) == 0 &&
+               sizeof(WORKER_STATS) % sizeof(size_t) == 0 && sizeof(WORKER_CODEC_STATS) % sizeof(size_t) == 0,
+               "Stats must consist of size_t counters");
+
+static inline void worker_stat_add(size_t *counter, size_t value)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+// Копирование счётчиков структуры статистики размером size байт.
+static void worker_stat_load(void *dst, const void *src, size_t size)
+{
+    for (size_t i = 0; i < size / sizeof(size_t); ++i) {
+        ((size_t *)dst)[i] = __atomic_load_n((const size_t *)src + i, __ATOMIC_RELAXED);
+    }
+}
+
+static size_t worker_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (size_t)ts.tv_sec * 1000000 + (size_t)ts.tv_nsec / 1000;
+}
+
+// Учёт задержки us (в микросекундах) в гистограмме (как cluster_hist_add, но с атомарными счётчиками).
+static void worker_hist_add(CLUSTER_HISTOGRAM *hist, size_t us)
+{
+    size_t bucket = cluster_hist_bucket(us);
+    worker_stat_add(&hist->count, 1);
+    worker_stat_add(&hist->sum_us, us);
+    if (us > hist->max_us) {
+        __atomic_store_n(&hist->max_us, us, __ATOMIC_RELAXED);
+    }
+    worker_stat_add(&hist->buckets[bucket], 1);
+}
+
+
 //=================================
 // Передача данных по сети.
 //=================================
 
-static size_t get_tasks(INFO_WORKER* worker, char **tasks_ans)
+// Расширение буфера *buf до size байт (содержимое не сохраняется, если не помещается).
+static bool worker_reserve(char **buf, size_t *capacity, size_t size)
 {
-    int sock = worker->server_conn_fd; 
+    if (size <= *capacity) {
+        return true;
+    }
+    char *new_buf = realloc(*buf, size);
+    if (new_buf == NULL) {
+        return false;
+    }
+    *buf = new_buf;
+    *capacity = size;
+    return true;
+}
+
+// Приём size байт с учётом частичного чтения; false при разрыве соединения или ошибке.
+static bool worker_recv_all(INFO_WORKER *worker, char *buf, size_t size)
+{
+    if (worker->shm != NULL) {
+        if (!cluster_shm_recv_all(worker->shm, buf, size)) {
+            fprintf(stderr,"[worker_recv_all]: Соединение разорвано!\n");
+            return false;
+        }
+        return true;
+    }
+    int sock = worker->server_conn_fd;
+    size_t bytes_read = 0;
+    while (bytes_read < size)
+    {
+        ssize_t new_bytes_size = worker->transport->recv(sock, buf + bytes_read, size - bytes_read, 0);
+        if (new_bytes_size == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            perror("[worker_recv_all] recv failed");
+            return false;
+        } else if (new_bytes_size == 0) {
+            fprintf(stderr,"[worker_recv_all]: Соединение разорвано!\n");
+            return false;
+        }
+        bytes_read += new_bytes_size;
+    }
+    return true;
+}
 
+// Приём заголовка пакета задач: как recv, через разделяемую память - с ожиданием всех size байт.
+static ssize_t worker_recv(INFO_WORKER *worker, void *buf, size_t size)
+{
+    if (worker->shm != NULL) {
+        return cluster_shm_recv_all(worker->shm, buf, size) ? (ssize_t)size : 0;
+    }
+    return worker->transport->recv(worker->server_conn_fd, buf, size, 0);
+}
+
+// Приём пакета задач в буфер *tasks_ans ёмкостью *capacity байт; буфер расширяется при необходимости
+// и остаётся у вызывающего и при ошибке. Сжатый пакет принимается в буфер *packed ёмкостью
+// *packed_capacity и распаковывается в буфер пакета.
+// Возвращает количество задач, 0 - завершение работы или ошибка.
+static size_t get_tasks(INFO_WORKER* worker, char **tasks_ans, size_t *capacity, char **packed_buf, size_t *packed_capacity)
+{
     size_t num_of_tasks = 0;
-    ssize_t bytes_read = recv(sock, &num_of_tasks, sizeof(num_of_tasks), 0);
+    ssize_t bytes_read = worker_recv(worker, &num_of_tasks, sizeof(num_of_tasks));
 
     if (bytes_read == -1) {
         perror("[get_tasks] Unable to recv num_of_tasks from server");
@@ -108,7 +209,7 @@ static size_t get_tasks(INFO_WORKER* worker, char **tasks_ans)
     DEBUG("Worker get num_of_tasks : %lu\n", num_of_tasks);
 
     ssize_t tasks_size = 0;
-    bytes_read = recv(sock, &tasks_size, sizeof(tasks_size), 0);
+    bytes_read = worker_recv(worker, &tasks_size, sizeof(tasks_size));
     if (bytes_read == -1) {
         perror("[get_tasks]: recv failed while receiving tasks_size!");
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -120,170 +221,747 @@ static size_t get_tasks(INFO_WORKER* worker, char **tasks_ans)
         return 0;
     }
     DEBUG("Worker get tasks_size : %lu\n", tasks_size);
-    char *tasks = calloc(tasks_size,sizeof(*tasks));
-    if(tasks == NULL) {
-        fprintf(stderr,"[get_tasks]: No memory for task!\n");
+    bool packed = ((size_t)tasks_size & CLUSTER_COMPRESSED) != 0;
+    size_t size_data = (size_t)tasks_size & ~CLUSTER_COMPRESSED;
+    if (packed && (worker->codec == CLUSTER_CODEC_NONE || size_data < sizeof(size_t))) {
+        fprintf(stderr,"[get_tasks]: Unexpected compressed batch!\n");
         return 0;
     }
-    bytes_read = recv(sock, tasks, tasks_size, 0);
-
-    if (bytes_read == -1) {
-        perror("[get_tasks] recv failed while receiving tasks!");
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            fprintf(stderr, "[get_tasks] Recv timed out while receiving tasks.\n");
-        }
-        free(tasks);
+    // Номера задач передаются перед самими задачами и принимаются в тот же буфер.
+    if (num_of_tasks > (SIZE_MAX - size_data) / sizeof(size_t)) {
+        fprintf(stderr,"[get_tasks]: Invalid batch size!\n");
         return 0;
-    } else if (bytes_read == 0) {
-         fprintf(stderr,"[get_tasks]: Соединение разорвано!\n");
-        free(tasks);
+    }
+    size_t ids_size = num_of_tasks * sizeof(size_t);
+    char **recv_buf = packed ? packed_buf : tasks_ans;
+    size_t *recv_capacity = packed ? packed_capacity : capacity;
+    // Буфер пакета переиспользуется: данные полностью перезаписываются, обнулять его не нужно.
+    if (!worker_reserve(recv_buf, recv_capacity, ids_size + size_data)) {
+        fprintf(stderr,"[get_tasks]: No memory for task!\n");
         return 0;
     }
-    while (bytes_read < tasks_size)
-    {
-        ssize_t new_bytes_size = recv(sock, tasks + bytes_read, tasks_size - bytes_read, 0);
-        if (new_bytes_size == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                continue;
-            }
-            free(tasks);
+    if (!worker_recv_all(worker, *recv_buf, ids_size + size_data)) {
+        return 0;
+    }
+    size_t raw_size = size_data;
+    if (packed) {
+        const char *data = *packed_buf + ids_size;
+        memcpy(&raw_size, data, sizeof(raw_size));
+        if (raw_size > SIZE_MAX - ids_size || !worker_reserve(tasks_ans, capacity, ids_size + raw_size)) {
+            fprintf(stderr,"[get_tasks]: No memory for task!\n");
+            return 0;
+        }
+        memcpy(*tasks_ans, *packed_buf, ids_size);
+        if (!cluster_lz_decompress(data + sizeof(raw_size), size_data - sizeof(raw_size),
+                                   *tasks_ans + ids_size, raw_size)) {
+            fprintf(stderr,"[get_tasks]: Corrupted compressed batch!\n");
             return 0;
         }
-        bytes_read += new_bytes_size;
-    }
-    if (num_of_tasks == 0) {
-        DEBUG("[get_tasks] Server Disconnect!\n");
     }
-    *tasks_ans = tasks;
+    worker_stat_add(&worker->codec_stats.rx_raw_bytes, raw_size);
+    worker_stat_add(&worker->codec_stats.rx_wire_bytes, size_data);
+    worker_stat_add(&worker->stats.batches_received, 1);
+    worker_stat_add(&worker->stats.tasks_received, num_of_tasks);
+    worker_stat_add(&worker->stats.bytes_in, 2 * sizeof(size_t) + ids_size + size_data);
     return num_of_tasks;
 }
 
-static bool send_result(INFO_WORKER *worker, size_t ans_size, char *ans)
+// Отправка результатов одним вызовом sendmsg: iov содержит заголовки RESULT_HEADER и данные результатов.
+static bool send_results(INFO_WORKER *worker, struct iovec *iov, size_t iovcnt)
 {
-    size_t bytes_written = write(worker->server_conn_fd, ans, ans_size);
-    if (bytes_written != ans_size)
+    bool sent = worker->shm != NULL ? cluster_shm_sendv_all(worker->shm, iov, iovcnt)
+                                    : worker->transport->sendv_all(worker->server_conn_fd, iov, iovcnt);
+    if (!sent)
     {
-        fprintf(stderr, "Unable to send result to server\n");
+        // Сервер мог закрыть соединение, уже получив результат этой задачи от другого узла.
+        if (errno != EPIPE && errno != ECONNRESET) {
+            fprintf(stderr, "Unable to send result to server\n");
+        }
         return false;
     }
-    DEBUG("Worker send %lu bytes!\n",ans_size);
+    DEBUG("Worker send results in %lu parts!\n", iovcnt);
     return true;
 }
 
-static bool send_node_info(INFO_WORKER *worker)
+// Отправка информации об узле и получение параметров соединения, выбранных сервером.
+// n_cores - количество потоков пула, которое узел действительно может занять.
+// Узел предлагает серверу сегмент разделяемой памяти; сервер на другом хосте его не найдёт.
+static bool send_node_info(INFO_WORKER *worker, size_t n_cores)
 {
     DEBUG("Worker start send node_info!\n");
-    size_t bytes_written = write(worker->server_conn_fd, &worker->n_cores, sizeof(worker->n_cores));
-    if (bytes_written != sizeof(worker->n_cores))
+    NODE_INFO info = {
+        .n_cores = n_cores,
+        .codecs = CLUSTER_CODECS,
+    };
+    bool ret = false;
+    CLUSTER_SHM *shm = NULL;
+    if (worker->shared_memory) {
+        shm = calloc(1, sizeof(*shm));
+        if (shm != NULL && !cluster_shm_create(shm, info.shm_name, sizeof(info.shm_name), &info.shm_nonce)) {
+            info.shm_name[0] = '\0';
+            free(shm);
+            shm = NULL;
+        }
+    }
+    struct iovec info_iov = { .iov_base = &info, .iov_len = sizeof(info) };
+    uint64_t sent_us = cluster_trace_now();
+    if (!worker->transport->sendv_all(worker->server_conn_fd, &info_iov, 1))
     {
         fprintf(stderr, "Unable to send node info to server\n");
-        return false;
+        goto clear;
     }
-    DEBUG("Worker end send node_info!\n");
-    return true;
+    NODE_CONFIG config;
+    if (!worker_recv_all(worker, (char *)&config, sizeof(config)) ||
+        config.codec >= 64 || !(CLUSTER_CODECS & (1UL << config.codec)) ||
+        (config.transport != CLUSTER_TRANSPORT_SOCKET && (config.transport != CLUSTER_TRANSPORT_SHM || shm == NULL))) {
+        fprintf(stderr, "Unable to recv connection config from server\n");
+        goto clear;
+    }
+    // Ответ отправлен сервером примерно посередине между отправкой информации и получением ответа.
+    worker->clock_offset_us = (int64_t)config.clock_us - (int64_t)(sent_us + (cluster_trace_now() - sent_us) / 2);
+    worker->node_id = config.node_id;
+    worker->codec = config.codec;
+    if (config.transport == CLUSTER_TRANSPORT_SHM) {
+        shm->sock = worker->server_conn_fd;
+        worker->shm = shm;
+        shm = NULL;
+    }
+    DEBUG("Worker end send node_info, codec %lu, shared memory %d!\n", config.codec, worker->shm != NULL);
+    ret = true;
+clear:
+    // Сервер уже открыл сегмент (или отказался от него): имя больше не нужно.
+    if (info.shm_name[0] != '\0') {
+        shm_unlink(info.shm_name);
+    }
+    if (shm != NULL) {
+        cluster_shm_detach(shm);
+        free(shm);
+    }
+    return ret;
 }
 
 
 //============================
-// Распределение задач
+// Пул потоков
 //============================
-struct thread_args
+
+typedef struct WORKER_BATCH WORKER_BATCH;
+
+// Задача, передаваемая потокам пула через очередь.
+typedef struct
+{
+    // Указатель на задачу в буфере (вместе с её размером).
+    char *task;
+    // Результат, возвращённый функцией задачи.
+    void *ans;
+    // Номер задачи в исходном массиве задач сервера.
+    size_t task_id;
+    // Пакет, которому принадлежит задача.
+    WORKER_BATCH *batch;
+    // Кадр результата для worker_result_buffer: RESULT_HEADER и данные результата.
+    // Буфер принадлежит элементу пакета и переиспользуется следующими задачами.
+    char *out;
+    size_t out_capacity;
+    // Размер результата, записанного в out.
+    size_t out_size;
+    // Сжатый кадр результата: RESULT_HEADER, size_t raw_size и сжатые данные.
+    // Буфер переиспользуется, как и out; packed_size - размер данных кадра, 0 - результат не сжат.
+    char *packed;
+    size_t packed_capacity;
+    size_t packed_size;
+} WORKER_TASK;
+
+// Пакет задач, полученный от сервера одним сообщением.
+struct WORKER_BATCH
 {
-    int func_id;
-    long long parts;
-    double left;
-    double step;
-    double retval;
+    // Буфер пакета, полученный get_tasks: номера задач и сами задачи.
+    // Переиспользуется вместе с пакетом.
+    char *tasks;
+    size_t tasks_capacity;
+    // NUMA-узел (индекс в WORKER_TOPOLOGY::nodes), потокам которого передаются задачи пакета
+    // и к которому привязан буфер tasks ёмкостью bound_capacity.
+    size_t node;
+    size_t bound_capacity;
+    // Номера задач пакета.
+    size_t *task_ids;
+    // Первая задача пакета, ещё не переданная пулу.
+    char *next_task;
+    // Количество задач в пакете.
+    size_t num_tasks;
+    // Количество задач, переданных пулу.
+    size_t num_submitted;
+    // Количество выполненных задач.
+    size_t num_done;
+    // Время приёма пакета (в микросекундах, worker_now_us).
+    size_t received_us;
+    // Задачи пакета, массив переиспользуется вместе с пакетом.
+    WORKER_TASK *items;
+    size_t items_size;
+    // Следующий пакет в очереди (или в списке свободных пакетов).
+    WORKER_BATCH *next;
 };
 
+// Поток пула.
+typedef struct
+{
+    pthread_t thread;
+    WORKER_POOL *pool;
+    // NUMA-узел процессора, за которым закреплён поток.
+    size_t node;
+    // Статистика потока (элемент INFO_WORKER::thread_stats).
+    WORKER_THREAD_STATS *stats;
+} WORKER_THREAD;
+
+struct WORKER_POOL
+{
+    // Потоки пула.
+    WORKER_THREAD *threads;
+    // Количество успешно запущенных потоков.
+    size_t n_threads;
+    // Процессоры узла и занятые пулом процессоры.
+    WORKER_TOPOLOGY topology;
+    // Очереди задач, ожидающих выполнения, по одной на NUMA-узел (topology.n_nodes очередей).
+    // Поток берёт задачи сначала из очереди своего узла, затем из очередей остальных.
+    TASK_QUEUE *tasks;
+    // Количество потоков и количество принятых и ещё не выполненных задач каждого NUMA-узла.
+    size_t *node_threads;
+    size_t *node_pending;
+    // Очередь выполненных задач.
+    TASK_QUEUE done;
+    // Число задач в очереди tasks, на нём спят свободные потоки.
+    sem_t tasks_sem;
+    // eventfd, сигнализирующий о появлении задач в очереди done.
+    int done_fd;
+    // Функция, выполняющая задачу.
+    void *(*func)(void *);
+    // Флаг завершения работы пула.
+    atomic_bool stop;
+    // Количество задач, переданных пулу и ещё не забранных из очереди done.
+    size_t num_in_pool;
+    // Максимальное количество задач в пуле (ёмкость очередей).
+    size_t max_in_pool;
+    // Принятые пакеты в порядке получения.
+    WORKER_BATCH *batches_first;
+    WORKER_BATCH *batches_last;
+    // Пакеты, готовые к повторному использованию, по NUMA-узлам их буферов.
+    WORKER_BATCH **batches_free;
+    // Выполненные задачи, результаты которых отправляются одним сообщением (max_in_pool элементов).
+    WORKER_TASK **results;
+    RESULT_HEADER *result_headers;
+    // Описание отправляемых результатов для sendmsg (не более 2 * max_in_pool элементов).
+    struct iovec *result_iov;
+    // Кодек сжатия, согласованный с сервером.
+    size_t codec;
+    // Буфер для приёма сжатых пакетов задач.
+    char *packed;
+    size_t packed_capacity;
+    // Трассировка исполнителя (NULL - выключена).
+    CLUSTER_TRACE *trace;
+};
+
+// Задача, выполняемая текущим потоком пула (для worker_result_buffer).
+static _Thread_local WORKER_TASK *worker_current_task;
+
+void *worker_result_buffer(size_t size)
+{
+    WORKER_TASK *task = worker_current_task;
+    if (task == NULL) {
+        fprintf(stderr, "[worker_result_buffer] Called outside of a task function\n");
+        return NULL;
+    }
+    size_t need = sizeof(RESULT_HEADER) + size;
+    if (need > task->out_capacity) {
+        char *out = realloc(task->out, need);
+        if (out == NULL) {
+            fprintf(stderr, "[worker_result_buffer] : ENOMEM\n");
+            return NULL;
+        }
+        task->out = out;
+        task->out_capacity = need;
+    }
+    task->out_size = size;
+    return task->out + sizeof(RESULT_HEADER);
+}
+
+// Результат задачи записан в её кадр функцией worker_result_buffer (а не создан format_ans).
+static bool worker_task_in_frame(WORKER_TASK *task)
+{
+    return task->out != NULL && task->ans == task->out + sizeof(RESULT_HEADER);
+}
+
+// Сжатие результата задачи в её кадр packed (выполняется потоком пула, вычислившим задачу).
+// Небольшие и несжимаемые результаты, а также результаты при нехватке памяти отправляются без сжатия.
+static void worker_pack_result(WORKER_POOL *pool, WORKER_TASK *task)
+{
+    task->packed_size = 0;
+    if (pool->codec != CLUSTER_CODEC_LZ || task->ans == NULL) {
+        return;
+    }
+    const char *data = worker_task_in_frame(task) ? task->ans : (char *)task->ans + sizeof(size_t);
+    size_t size = worker_task_in_frame(task) ? task->out_size : *((size_t *)task->ans);
+    if (size < CLUSTER_CODEC_MIN_SIZE) {
+        return;
+    }
+    size_t need = sizeof(RESULT_HEADER) + size;
+    if (need > task->packed_capacity) {
+        char *packed = realloc(task->packed, need);
+        if (packed == NULL) {
+            return;
+        }
+        task->packed = packed;
+        task->packed_capacity = need;
+    }
+    char *dst = task->packed + sizeof(RESULT_HEADER);
+    size_t packed = cluster_lz_compress(data, size, dst + sizeof(size), size - sizeof(size) - 1);
+    if (packed != 0) {
+        memcpy(dst, &size, sizeof(size));
+        task->packed_size = sizeof(size) + packed;
+    }
+}
 
-static size_t distributed_counting(INFO_WORKER *worker, char *tasks, size_t num_of_tasks,
-    void *(func(void *)),char **ans)
+// Задача из очереди NUMA-узла node или, если она пуста, из очередей других узлов.
+static bool worker_pool_pop(WORKER_POOL *pool, size_t node, void **item)
 {
+    for (size_t i = 0; i < pool->topology.n_nodes; ++i) {
+        if (task_queue_pop(&pool->tasks[(node + i) % pool->topology.n_nodes], item)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *worker_pool_thread(void *arg)
+{
+    WORKER_THREAD *thread = arg;
+    WORKER_POOL *pool = thread->pool;
+    WORKER_THREAD_STATS *stats = thread->stats;
+    if (pool->trace != NULL) {
+        char name[CLUSTER_TRACE_NAME_SIZE];
+        snprintf(name, sizeof(name), "pool cpu %lu", stats->cpu);
+        cluster_trace_name_thread(pool->trace, name);
+    }
+    size_t mark = worker_now_us();
+    while (true) {
+        while (sem_wait(&pool->tasks_sem) == -1 && errno == EINTR);
+
+        // Семафор считает задачи всех очередей, поэтому задача найдётся в одной из них.
+        void *item = NULL;
+        while (atomic_load_explicit(&pool->stop, memory_order_acquire) ||
+               !worker_pool_pop(pool, thread->node, &item)) {
+            if (atomic_load_explicit(&pool->stop, memory_order_acquire)) {
+                return NULL;
+            }
+            sched_yield();
+        }
+        WORKER_TASK *task = item;
+        size_t start = worker_now_us();
+        worker_stat_add(&stats->idle_us, start - mark);
+        worker_hist_add(&stats->queue_wait, start - task->batch->received_us);
+        worker_current_task = task;
+        task->ans = pool->func(task->task);
+        worker_current_task = NULL;
+        cluster_trace_span(pool->trace, "task", start, "task_id", task->task_id, NULL, 0);
+        worker_hist_add(&stats->compute, worker_now_us() - start);
+        worker_pack_result(pool, task);
+        worker_stat_add(&stats->tasks_completed, 1);
+        mark = worker_now_us();
+        worker_stat_add(&stats->busy_us, mark - start);
+
+        // Очередь done вмещает все задачи, находящиеся в пуле, поэтому ожидание здесь редкость.
+        while (!task_queue_push(&pool->done, task)) {
+            sched_yield();
+        }
+        eventfd_write(pool->done_fd, 1);
+    }
+}
+
+static void worker_batch_free_list(WORKER_BATCH *batch)
+{
+    while (batch != NULL) {
+        WORKER_BATCH *next = batch->next;
+        free(batch->tasks);
+        for (size_t i = 0; i < batch->items_size; ++i) {
+            free(batch->items[i].out);
+            free(batch->items[i].packed);
+        }
+        free(batch->items);
+        free(batch);
+        batch = next;
+    }
+}
+
+static void worker_pool_destroy(WORKER_POOL *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+    uint64_t trace_start = cluster_trace_begin(pool->trace);
+    atomic_store_explicit(&pool->stop, true, memory_order_release);
+    for (size_t i = 0; i < pool->n_threads; ++i) {
+        sem_post(&pool->tasks_sem);
+    }
+    for (size_t i = 0; i < pool->n_threads; ++i) {
+        if (pthread_join(pool->threads[i].thread, NULL)) {
+            fprintf(stderr, "[worker_pool_destroy] Unable to join a thread\n");
+        }
+    }
+    cluster_trace_span(pool->trace, "worker_pool_destroy", trace_start, "threads", pool->n_threads, NULL, 0);
+    if (pool->done.cells != NULL) {
+        void *item = NULL;
+        while (task_queue_pop(&pool->done, &item)) {
+            if (!worker_task_in_frame(item)) {
+                free(((WORKER_TASK *)item)->ans);
+            }
+        }
+    }
+    worker_batch_free_list(pool->batches_first);
+    for (size_t node = 0; pool->batches_free != NULL && node < pool->topology.n_nodes; ++node) {
+        worker_batch_free_list(pool->batches_free[node]);
+    }
+    sem_destroy(&pool->tasks_sem);
+    if (pool->done_fd != -1) {
+        close(pool->done_fd);
+    }
+    for (size_t node = 0; pool->tasks != NULL && node < pool->topology.n_nodes; ++node) {
+        task_queue_destroy(&pool->tasks[node]);
+    }
+    task_queue_destroy(&pool->done);
+    free(pool->results);
+    free(pool->result_headers);
+    free(pool->result_iov);
+    free(pool->packed);
+    free(pool->tasks);
+    free(pool->node_threads);
+    free(pool->node_pending);
+    free(pool->batches_free);
+    free(pool->threads);
+    // Процессоры освобождаются для других рабочих узлов хоста после остановки потоков.
+    worker_topology_destroy(&pool->topology);
+    free(pool);
+}
+
+// Пул из не более чем worker->n_cores потоков: потоков не больше, чем процессоров, доступных узлу.
+static WORKER_POOL *worker_pool_create(INFO_WORKER *worker)
+{
+    if (worker->thread_stats == NULL) {
+        fprintf(stderr, "[worker_pool_create] Worker is not initialized!\n");
+        return NULL;
+    }
+    uint64_t trace_start = cluster_trace_begin(worker->trace);
+    WORKER_POOL *pool = calloc(1, sizeof(*pool));
+    size_t *cpus = NULL;
+    if (pool == NULL) {
+        fprintf(stderr, "[worker_pool_create] No memory for pool!\n");
+        return NULL;
+    }
+    pool->func = worker->func;
+    pool->trace = worker->trace;
+    pool->done_fd = -1;
+    atomic_init(&pool->stop, false);
+    if (!worker_topology_discover(&pool->topology)) {
+        goto error;
+    }
+
     // Проверка валидности запрашиваемого числа ядер
-    if (worker->n_cores > (size_t)get_nprocs() || num_of_tasks > (size_t)worker->n_cores) {
-        fprintf(stderr, "[distributed_counting] the number of processors currently \
-                available in the system is less than required\n");
+    size_t n_threads = worker->n_cores;
+    if (n_threads > pool->topology.capacity) {
+        fprintf(stderr, "[worker_pool_create] the number of processors currently \
+                available in the system is less than required, using %zu threads\n", pool->topology.capacity);
+        n_threads = pool->topology.capacity;
+    }
+    if (n_threads == 0) {
+        n_threads = 1;
     }
 
-    int threads_num = num_of_tasks;
-    pthread_t threads[threads_num];
+    size_t n_nodes = pool->topology.n_nodes;
+    pool->threads = calloc(n_threads, sizeof(*pool->threads));
+    pool->tasks = calloc(n_nodes, sizeof(*pool->tasks));
+    pool->node_threads = calloc(n_nodes, sizeof(*pool->node_threads));
+    pool->node_pending = calloc(n_nodes, sizeof(*pool->node_pending));
+    pool->batches_free = calloc(n_nodes, sizeof(*pool->batches_free));
+    cpus = calloc(n_threads, sizeof(*cpus));
+    if (pool->threads == NULL || pool->tasks == NULL || pool->node_threads == NULL ||
+        pool->node_pending == NULL || pool->batches_free == NULL || cpus == NULL ||
+        !task_queue_init(&pool->done, 2 * n_threads)) {
+        fprintf(stderr, "[worker_pool_create] No memory for pool!\n");
+        goto error;
+    }
+    // Задачи пакета попадают в одну очередь, поэтому каждая очередь вмещает все задачи пула.
+    for (size_t node = 0; node < n_nodes; ++node) {
+        if (!task_queue_init(&pool->tasks[node], 2 * n_threads)) {
+            fprintf(stderr, "[worker_pool_create] No memory for pool!\n");
+            goto error;
+        }
+    }
+    pool->max_in_pool = pool->tasks[0].mask + 1;
+    pool->results = calloc(pool->max_in_pool, sizeof(*pool->results));
+    pool->result_headers = calloc(pool->max_in_pool, sizeof(*pool->result_headers));
+    pool->result_iov = calloc(2 * pool->max_in_pool, sizeof(*pool->result_iov));
+    if (pool->results == NULL || pool->result_headers == NULL || pool->result_iov == NULL) {
+        fprintf(stderr, "[worker_pool_create] No memory for pool!\n");
+        goto error;
+    }
+    if (sem_init(&pool->tasks_sem, 0, 0)) {
+        fprintf(stderr, "[worker_pool_create] Unable to init semaphore\n");
+        goto error;
+    }
+    pool->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->done_fd == -1) {
+        fprintf(stderr, "[worker_pool_create] Unable to create eventfd\n");
+        goto error;
+    }
 
-    for (int i = 0; i < threads_num; ++i) {
+    worker_topology_place(&pool->topology, n_threads, cpus);
+    for (size_t i = 0; i < n_threads; ++i) {
         // Выбор ядра для выполнения потока.
+        const WORKER_CPU *cpu = &pool->topology.cpus[cpus[i]];
         cpu_set_t cpuset;
         CPU_ZERO(&cpuset);
-        CPU_SET(i, &cpuset);
+        CPU_SET(cpu->cpu, &cpuset);
 
         pthread_attr_t thread_attr;
         if(pthread_attr_init(&thread_attr)) {
             fprintf(stderr, "pthread_attr_init returns with error\n");
-            return 0;
+            goto error;
         }
 
         // Устанавливаем аффинность потока.
         if (pthread_attr_setaffinity_np(&thread_attr, sizeof(cpuset), &cpuset)) {
             fprintf(stderr, "pthread_attr_setaffinity_np returns with error\n");
-            return 0;
+            pthread_attr_destroy(&thread_attr);
+            goto error;
         }
 
+        WORKER_THREAD *thread = &pool->threads[i];
+        thread->pool = pool;
+        thread->node = cpu->node;
+        thread->stats = &worker->thread_stats[i];
+        __atomic_store_n(&thread->stats->cpu, (size_t)cpu->cpu, __ATOMIC_RELAXED);
+        int created = pthread_create(&thread->thread, &thread_attr, worker_pool_thread, thread);
 
-        if (pthread_create(&threads[i], &thread_attr, func, tasks)) {
+        // Удаляем объект аттрибутов потока.
+        pthread_attr_destroy(&thread_attr);
+        if (created) {
             fprintf(stderr, "Unable to create thread\n");
-            return 0;
+            goto error;
+        }
+        pool->node_threads[thread->node]++;
+        pool->n_threads++;
+        if (pool->n_threads > worker->n_thread_stats) {
+            __atomic_store_n(&worker->n_thread_stats, pool->n_threads, __ATOMIC_RELAXED);
         }
-        tasks += *((size_t*)tasks) + sizeof(size_t);
+    }
+    free(cpus);
+    cluster_trace_span(pool->trace, "worker_pool_create", trace_start, "threads", pool->n_threads, NULL, 0);
+    return pool;
+error:
+    free(cpus);
+    worker_pool_destroy(pool);
+    return NULL;
+}
 
-        // Удаляем объект аттрибутов потока.
-        if (pthread_attr_destroy(&thread_attr)) {
-            fprintf(stderr, "Unable to destroy a thread attributes object\n");
-            return 0;
+// Свободный пакет для приёма задач (буферы пакетов переиспользуются).
+// Пакет достаётся NUMA-узлу с наименьшим числом невыполненных задач на поток.
+static WORKER_BATCH *worker_pool_take_batch(WORKER_POOL *pool)
+{
+    size_t node = pool->topology.n_nodes;
+    for (size_t i = 0; i < pool->topology.n_nodes; ++i) {
+        if (pool->node_threads[i] != 0 &&
+            (node == pool->topology.n_nodes ||
+             pool->node_pending[i] * pool->node_threads[node] < pool->node_pending[node] * pool->node_threads[i])) {
+            node = i;
         }
+    }
+    WORKER_BATCH *batch = pool->batches_free[node];
+    if (batch != NULL) {
+        pool->batches_free[node] = batch->next;
+        return batch;
+    }
+    batch = calloc(1, sizeof(*batch));
+    if (batch == NULL) {
+        fprintf(stderr, "No memory for batch!\n");
+        return NULL;
+    }
+    batch->node = node;
+    return batch;
+}
+
+static void worker_pool_return_batch(WORKER_POOL *pool, WORKER_BATCH *batch)
+{
+    batch->next = pool->batches_free[batch->node];
+    pool->batches_free[batch->node] = batch;
+}
 
+// Постановка пакета с принятыми задачами в очередь принятых пакетов.
+static bool worker_pool_add_batch(WORKER_POOL *pool, WORKER_BATCH *batch, size_t num_of_tasks)
+{
+    if (batch->items_size < num_of_tasks) {
+        WORKER_TASK *items = realloc(batch->items, num_of_tasks * sizeof(*items));
+        if (items == NULL) {
+            fprintf(stderr, "No memory for tasks!\n");
+            worker_pool_return_batch(pool, batch);
+            return false;
+        }
+        memset(items + batch->items_size, 0, (num_of_tasks - batch->items_size) * sizeof(*items));
+        batch->items = items;
+        batch->items_size = num_of_tasks;
     }
-    
-    char *ans_total = calloc(INIT_ANS_SIZE,sizeof(*ans_total));
-    size_t ans_size = INIT_ANS_SIZE;
-    size_t current_ans_size = 0;
-    for (int i = 0; i < threads_num; ++i)
-    {
-        char *ans_task;
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        time_t start_time = ts.tv_sec;
-        ts.tv_sec += worker->max_time;
-        int wait = pthread_timedjoin_np(threads[i], (void**) &ans_task,&ts);
-        if (wait != 0) {
-            fprintf(stderr, "Unable to join a thread\n");
-            if(wait == ETIMEDOUT) {
-                fprintf(stderr, "ETIMEDOUT  - add 10 sec!!!\n");
-                worker->max_time += 10;
-                --i;
-                continue;
+    // Задачи пакета читают потоки его NUMA-узла: буфер переносится туда, когда он вырос.
+    if (batch->bound_capacity != batch->tasks_capacity) {
+        worker_topology_bind(&pool->topology, batch->node, batch->tasks, batch->tasks_capacity);
+        batch->bound_capacity = batch->tasks_capacity;
+    }
+    pool->node_pending[batch->node] += num_of_tasks;
+    batch->received_us = worker_now_us();
+    batch->task_ids = (size_t *)batch->tasks;
+    batch->next_task = batch->tasks + num_of_tasks * sizeof(size_t);
+    batch->num_tasks = num_of_tasks;
+    batch->num_submitted = 0;
+    batch->num_done = 0;
+    batch->next = NULL;
+    if (pool->batches_last != NULL) {
+        pool->batches_last->next = batch;
+    } else {
+        pool->batches_first = batch;
+    }
+    pool->batches_last = batch;
+    return true;
+}
+
+//============================
+// Распределение задач
+//============================
+
+// Передача пулу ещё не запущенных задач из принятых пакетов.
+static void distributed_counting(INFO_WORKER *worker)
+{
+    WORKER_POOL *pool = worker->pool;
+    uint64_t trace_start = cluster_trace_begin(pool->trace);
+    size_t num_in_pool = pool->num_in_pool;
+    for (WORKER_BATCH *batch = pool->batches_first;
+         batch != NULL && pool->num_in_pool < pool->max_in_pool; batch = batch->next) {
+        while (batch->num_submitted < batch->num_tasks && pool->num_in_pool < pool->max_in_pool) {
+            WORKER_TASK *item = &batch->items[batch->num_submitted];
+            item->task = batch->next_task;
+            item->ans = NULL;
+            item->task_id = batch->task_ids[batch->num_submitted];
+            item->batch = batch;
+            if (!task_queue_push(&pool->tasks[batch->node], item)) {
+                return;
             }
-            return 0;
+            sem_post(&pool->tasks_sem);
+            batch->next_task += *((size_t*)batch->next_task) + sizeof(size_t);
+            batch->num_submitted++;
+            pool->num_in_pool++;
         }
-        worker->max_time -= time(NULL) - start_time;
-        if(ans_task == NULL) {
-           continue; 
-        }
-        size_t ans_size_i = *((size_t*) ans_task);
-        size_t new_curr_sz = ans_size_i + sizeof(ans_size_i) + current_ans_size;
-        if (new_curr_sz > ans_size) {
-            ans_size = new_curr_sz > ans_size * 2 ? new_curr_sz : ans_size * 2;
-            ans_total = realloc(ans_total,ans_size);
-            if(ans_total == NULL) {
-                fprintf(stderr, "No memory for ans!\n");
-                return 0;
-            }
+    }
+    if (pool->num_in_pool != num_in_pool) {
+        cluster_trace_span(pool->trace, "distributed_counting", trace_start,
+                           "submitted", pool->num_in_pool - num_in_pool, NULL, 0);
+    }
+}
+
+// Отправка результатов выполненных задач в порядке их завершения.
+// Результаты, накопившиеся к моменту вызова, отправляются одним сообщением.
+// При закрытии соединения сервером *server_closed устанавливается в true.
+static bool worker_collect_results(INFO_WORKER *worker, bool *server_closed)
+{
+    WORKER_POOL *pool = worker->pool;
+    eventfd_t num_done = 0;
+    if (eventfd_read(pool->done_fd, &num_done) == -1) {
+        return errno == EAGAIN;
+    }
+    // Каждому увеличению счётчика соответствует элемент, запись которого может быть ещё не завершена.
+    // Выполненных задач не больше, чем задач в пуле, поэтому num_done <= max_in_pool.
+    struct iovec *iov = pool->result_iov;
+    size_t iovcnt = 0;
+    for (eventfd_t i = 0; i < num_done; ++i) {
+        void *item = NULL;
+        while (!task_queue_pop(&pool->done, &item)) {
+            sched_yield();
+        }
+        WORKER_TASK *task = item;
+        pool->num_in_pool--;
+        pool->node_pending[task->batch->node]--;
+        task->batch->num_done++;
+        pool->results[i] = task;
+        // Сжатый результат отправляется одним элементом вместе с заголовком.
+        if (task->packed_size != 0) {
+            RESULT_HEADER *header = (RESULT_HEADER *)task->packed;
+            header->task_id = task->task_id;
+            header->size = task->packed_size | CLUSTER_COMPRESSED;
+            iov[iovcnt].iov_base = task->packed;
+            iov[iovcnt].iov_len = sizeof(*header) + task->packed_size;
+            ++iovcnt;
+            size_t raw_size;
+            memcpy(&raw_size, task->packed + sizeof(*header), sizeof(raw_size));
+            worker_stat_add(&worker->codec_stats.tx_raw_bytes, raw_size);
+            worker_stat_add(&worker->codec_stats.tx_wire_bytes, task->packed_size);
+            continue;
+        }
+        // Результат из кадра задачи отправляется одним элементом вместе с заголовком.
+        if (worker_task_in_frame(task)) {
+            RESULT_HEADER *header = (RESULT_HEADER *)task->out;
+            header->task_id = task->task_id;
+            header->size = task->out_size;
+            iov[iovcnt].iov_base = task->out;
+            iov[iovcnt].iov_len = sizeof(*header) + task->out_size;
+            ++iovcnt;
+            worker_stat_add(&worker->codec_stats.tx_raw_bytes, task->out_size);
+            worker_stat_add(&worker->codec_stats.tx_wire_bytes, task->out_size);
+            continue;
+        }
+        char *ans = task->ans;
+        pool->result_headers[i].task_id = task->task_id;
+        pool->result_headers[i].size = ans == NULL ? 0 : *((size_t*) ans);
+        iov[iovcnt].iov_base = &pool->result_headers[i];
+        iov[iovcnt].iov_len = sizeof(pool->result_headers[i]);
+        iov[iovcnt + 1].iov_base = ans == NULL ? NULL : ans + sizeof(size_t);
+        iov[iovcnt + 1].iov_len = pool->result_headers[i].size;
+        iovcnt += 2;
+        worker_stat_add(&worker->codec_stats.tx_raw_bytes, pool->result_headers[i].size);
+        worker_stat_add(&worker->codec_stats.tx_wire_bytes, pool->result_headers[i].size);
+    }
+    // Отправка сдвигает элементы iov, поэтому объём результатов подсчитывается заранее.
+    size_t bytes_out = 0;
+    for (size_t i = 0; i < iovcnt; ++i) {
+        bytes_out += iov[i].iov_len;
+    }
+    uint64_t trace_start = cluster_trace_begin(pool->trace);
+    bool sent = send_results(worker, iov, iovcnt);
+    int send_errno = errno;
+    cluster_trace_span(pool->trace, "send_results", trace_start, "results", num_done, "bytes", bytes_out);
+    if (sent) {
+        size_t now = worker_now_us();
+        worker_stat_add(&worker->stats.results_sent, num_done);
+        worker_stat_add(&worker->stats.bytes_out, bytes_out);
+        for (eventfd_t i = 0; i < num_done; ++i) {
+            worker_hist_add(&worker->stats.turnaround, now - pool->results[i]->batch->received_us);
+        }
+    }
+    for (eventfd_t i = 0; i < num_done; ++i) {
+        if (!worker_task_in_frame(pool->results[i])) {
+            free(pool->results[i]->ans);
         }
-        memcpy(ans_total + current_ans_size, ans_task, ans_size_i + sizeof(ans_size_i));
-        current_ans_size += ans_size_i + sizeof(ans_size_i);
-        free(ans_task);
+        pool->results[i]->ans = NULL;
     }
-    DEBUG("Ans from worker size: %lu\n",current_ans_size);
-    *ans = ans_total;
-    return current_ans_size;
+    if (!sent) {
+        *server_closed = send_errno == EPIPE || send_errno == ECONNRESET;
+        return false;
+    }
+
+    // Буферы полностью выполненных пакетов переиспользуются.
+    while (pool->batches_first != NULL &&
+           pool->batches_first->num_done == pool->batches_first->num_tasks) {
+        WORKER_BATCH *batch = pool->batches_first;
+        pool->batches_first = batch->next;
+        if (pool->batches_first == NULL) {
+            pool->batches_last = NULL;
+        }
+        worker_pool_return_batch(pool, batch);
+    }
+    distributed_counting(worker);
+    return true;
 }
 
 //============================
@@ -295,44 +973,114 @@ int init_worker(INFO_WORKER *worker,size_t n_cores, time_t max_time, const char
     worker->n_cores = n_cores;
     worker->max_time = max_time;
 
-    worker->server_conn_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (worker->server_conn_fd == -1)
+    // Сокет создаётся при подключении; транспорт определяется строкой адреса.
+    worker->server_conn_fd = -1;
+    if (!cluster_address_parse(addr, port, false, &worker->transport, &worker->server_addr, &worker->server_addr_len))
     {
-        fprintf(stderr, "[init_worker] Unable to create socket()\n");
+        fprintf(stderr, "[init_worker] Unable to resolve server address %s\n", addr);
         return -1;
     }
 
-    // Формируем желаемый адрес для подключения.
-    struct addrinfo hints;
+    worker->func = func;
+    worker->pool = NULL;
+    worker->shared_memory = true;
+    worker->shm = NULL;
+    worker->codec = CLUSTER_CODEC_NONE;
+    memset(&worker->codec_stats, 0, sizeof(worker->codec_stats));
+    memset(&worker->stats, 0, sizeof(worker->stats));
+    worker->stats_path = NULL;
+    worker->trace_path = NULL;
+    worker->trace = NULL;
+    worker->node_id = 0;
+    worker->clock_offset_us = 0;
+    // Пул создаёт не больше n_cores потоков (и хотя бы один).
+    worker->n_thread_stats = 0;
+    worker->thread_stats = calloc(n_cores != 0 ? n_cores : 1, sizeof(*worker->thread_stats));
+    if (worker->thread_stats == NULL) {
+        fprintf(stderr, "[init_worker] No memory for thread stats\n");
+        return -1;
+    }
+    return 0;
+}
 
-    struct addrinfo* res;
+int worker_get_stats(INFO_WORKER *worker, WORKER_STATS *stats, WORKER_THREAD_STATS *threads, size_t max_threads)
+{
+    if (worker == NULL || (threads == NULL && max_threads != 0)) {
+        return -EINVAL;
+    }
+    size_t n_threads = __atomic_load_n(&worker->n_thread_stats, __ATOMIC_RELAXED);
+    WORKER_STATS total;
+    worker_stat_load(&total, &worker->stats, sizeof(total));
+    worker_stat_load(&total.codec, &worker->codec_stats, sizeof(total.codec));
+    memset(&total.threads, 0, sizeof(total.threads));
+    for (size_t i = 0; i < n_threads; ++i) {
+        WORKER_THREAD_STATS thread;
+        worker_stat_load(&thread, &worker->thread_stats[i], sizeof(thread));
+        total.threads.tasks_completed += thread.tasks_completed;
+        total.threads.busy_us += thread.busy_us;
+        total.threads.idle_us += thread.idle_us;
+        cluster_hist_merge(&total.threads.queue_wait, &thread.queue_wait);
+        cluster_hist_merge(&total.threads.compute, &thread.compute);
+        if (i < max_threads) {
+            threads[i] = thread;
+        }
+    }
+    if (stats != NULL) {
+        *stats = total;
+    }
+    return (int)n_threads;
+}
 
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family   = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags    = 0;
-    hints.ai_protocol = 0;
+static void worker_write_thread_stats(FILE *file, const WORKER_THREAD_STATS *stats)
+{
+    fprintf(file, "\"tasks_completed\":%lu,\"busy_us\":%lu,\"idle_us\":%lu,",
+            stats->tasks_completed, stats->busy_us, stats->idle_us);
+    cluster_hist_write(file, "queue_wait", &stats->queue_wait);
+    fprintf(file, ",");
+    cluster_hist_write(file, "compute", &stats->compute);
+}
 
-    if (getaddrinfo(addr, port, &hints, &res) != 0)
-    {
-        fprintf(stderr, "[init_worker] Unable to call getaddrinfo()\n");
-        return -1;
+// Запись статистики одной строкой JSON в конец файла worker->stats_path (ret - результат worker_start).
+static void worker_write_stats(INFO_WORKER *worker, int ret)
+{
+    WORKER_STATS stats;
+    size_t n_threads = (size_t)worker_get_stats(worker, &stats, NULL, 0);
+    FILE *file = fopen(worker->stats_path, "a");
+    if (file == NULL) {
+        fprintf(stderr, "[worker_write_stats] Unable to open %s\n", worker->stats_path);
+        return;
     }
+    fprintf(file, "{\"status\":%d,\"batches_received\":%lu,\"tasks_received\":%lu,\"results_sent\":%lu,"
+            "\"bytes_in\":%lu,\"bytes_out\":%lu,",
+            ret, stats.batches_received, stats.tasks_received, stats.results_sent, stats.bytes_in, stats.bytes_out);
+    cluster_hist_write(file, "turnaround", &stats.turnaround);
+    fprintf(file, ",\"codec\":{\"tx_raw_bytes\":%lu,\"tx_wire_bytes\":%lu,\"rx_raw_bytes\":%lu,\"rx_wire_bytes\":%lu},",
+            stats.codec.tx_raw_bytes, stats.codec.tx_wire_bytes, stats.codec.rx_raw_bytes, stats.codec.rx_wire_bytes);
+    fprintf(file, "\"pool\":{");
+    worker_write_thread_stats(file, &stats.threads);
+    fprintf(file, "},\"threads\":[");
+    for (size_t i = 0; i < n_threads; ++i) {
+        WORKER_THREAD_STATS thread;
+        worker_stat_load(&thread, &worker->thread_stats[i], sizeof(thread));
+        fprintf(file, "%s{\"cpu\":%lu,", i == 0 ? "" : ",", thread.cpu);
+        worker_write_thread_stats(file, &thread);
+        fprintf(file, "}");
+    }
+    fprintf(file, "]}\n");
+    if (fclose(file) != 0) {
+        fprintf(stderr, "[worker_write_stats] Unable to write %s\n", worker->stats_path);
+    }
+}
 
-    // Проверяем, что для данного запроса существует только один адрес.
-    if (res->ai_next != NULL)
+static int worker_run(INFO_WORKER *worker) {
+    // Потоки создаются один раз на всё время работы с сервером - до подключения,
+    // чтобы сообщить серверу, сколько процессоров узел действительно занял.
+    worker->pool = worker_pool_create(worker);
+    if (worker->pool == NULL)
     {
-        fprintf(stderr, "[init_worker] Ambigous result of getaddrinfo()\n");
         return -1;
     }
 
-    worker->server_addr = *res->ai_addr;
-    worker->func = func;
-    freeaddrinfo(res);
-    return 0;
-}
-
-int worker_start(INFO_WORKER *worker) {
     // Подключение к серверу.
     bool connected_to_server = worker_connect_to_manager(worker);
     while (!connected_to_server)
@@ -345,51 +1093,121 @@ int worker_start(INFO_WORKER *worker) {
     }
 
     // Отправка данных об узле.
-    bool success = send_node_info(worker);
+    bool success = send_node_info(worker, worker->pool->n_threads);
     if (!success)
     {
         goto error_close;
     }
+    // Потоки ещё не получили ни одной задачи: кодек, выбранный сервером, передаётся пулу без синхронизации.
+    worker->pool->codec = worker->codec;
 
-    char *tasks = NULL;
-    char *ans = NULL;
-    // Обработка поступающих задач, Время отслеживается в destributing_counting
+    // Приём задач продолжается, пока пул вычисляет уже полученные.
     while (true) {
-        ans = tasks = NULL;
-        size_t ans_size = 0;
-        size_t num_of_tasks = get_tasks(worker, &tasks);
-        // Сервер закрыл соединение
-        if (!num_of_tasks)
-        {
-            return 0;
+        struct pollfd pollfds[2] = {
+            {.fd = worker->server_conn_fd, .events = POLLIN},
+            {.fd = worker->pool->done_fd, .events = POLLIN},
+        };
+        bool busy = worker->pool->batches_first != NULL;
+        // Через разделяемую память пакеты приходят без данных на сокете: узел проверяет кольцо
+        // и, если оно пусто, просит сервер разбудить его по сокету.
+        bool tasks_ready = worker->shm != NULL && cluster_shm_rx_ready(worker->shm, CLUSTER_SHM_WAIT_SOCKET);
+        // Простаивающий узел ждёт задач без ограничения: живость сервера проверяет TCP Keep-Alive.
+        int pollret = poll(pollfds, 2, tasks_ready ? 0 : busy ? worker->max_time * 1000 : -1);
+        if (pollret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "[worker_start] Unable to poll-wait for data on descriptors!\n");
+            goto error_close;
+        }
+        if (pollret == 0 && !tasks_ready) {
+            fprintf(stderr, "ETIMEDOUT  - add 10 sec!!!\n");
+            worker->max_time += 10;
+            continue;
         }
 
-        // Вычисление результата.
-        if(!(ans_size = distributed_counting(worker,tasks,num_of_tasks,worker->func,&ans))) {
-            goto error_free;
+        if (pollfds[1].revents & POLLIN) {
+            bool server_closed = false;
+            if (!worker_collect_results(worker, &server_closed)) {
+                if (server_closed) {
+                    DEBUG("Server Disconnect!\n");
+                    worker_pool_destroy(worker->pool);
+                    worker->pool = NULL;
+                    return 0;
+                }
+                goto error_close;
+            }
         }
-        // Отправка результата.
-        success = send_result(worker,ans_size,ans);
-        if (!success)
-        {
-            goto error_free;
+
+        if (worker->shm != NULL && (pollfds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            // Закрытие соединения обрабатывается после того, как прочитаны все данные кольца.
+            bool closed = !cluster_shm_drain(worker->server_conn_fd);
+            tasks_ready = tasks_ready || cluster_shm_rx_ready(worker->shm, CLUSTER_SHM_AWAKE);
+            if (closed && !tasks_ready) {
+                DEBUG("Server Disconnect!\n");
+                worker_pool_destroy(worker->pool);
+                worker->pool = NULL;
+                return 0;
+            }
+        }
+        if (worker->shm != NULL ? tasks_ready : (pollfds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            WORKER_BATCH *batch = worker_pool_take_batch(worker->pool);
+            if (batch == NULL) {
+                goto error_close;
+            }
+            uint64_t trace_start = cluster_trace_begin(worker->trace);
+            size_t num_of_tasks = get_tasks(worker, &batch->tasks, &batch->tasks_capacity,
+                                            &worker->pool->packed, &worker->pool->packed_capacity);
+            cluster_trace_span(worker->trace, "get_tasks", trace_start, "tasks", num_of_tasks, NULL, 0);
+            // Сервер закрыл соединение
+            if (!num_of_tasks)
+            {
+                worker_pool_return_batch(worker->pool, batch);
+                worker_pool_destroy(worker->pool);
+                worker->pool = NULL;
+                return 0;
+            }
+            if (!worker_pool_add_batch(worker->pool, batch, num_of_tasks)) {
+                goto error_close;
+            }
+            // Вычисление результата.
+            distributed_counting(worker);
         }
-        free(ans);
-        free(tasks);
     }
-    //if we here free was!
-    goto error_close;
-error_free: 
-    free(ans);
-    free(tasks);
 error_close:
+    worker_pool_destroy(worker->pool);
+    worker->pool = NULL;
     worker_close_socket(worker);
     return -1;
 }
 
+int worker_start(INFO_WORKER *worker) {
+    if (worker->trace_path != NULL) {
+        worker->trace = cluster_trace_create();
+        cluster_trace_name_thread(worker->trace, "worker_start");
+    }
+    int ret = worker_run(worker);
+    if (worker->stats_path != NULL) {
+        worker_write_stats(worker, ret);
+    }
+    if (worker->trace != NULL) {
+        // Номер процесса 0 в объединённой трассировке занят сервером.
+        char name[CLUSTER_TRACE_NAME_SIZE];
+        snprintf(name, sizeof(name), "worker %lu", worker->node_id);
+        cluster_trace_write(worker->trace, worker->trace_path, (int)worker->node_id + 1, name,
+                            worker->clock_offset_us);
+        cluster_trace_destroy(worker->trace);
+        worker->trace = NULL;
+    }
+    return ret;
+}
+
 void worker_close(INFO_WORKER *worker)
 {
     // Освобождение сокета.
     if (worker->server_conn_fd >= 0)
         worker_close_socket(worker);
+    free(worker->thread_stats);
+    worker->thread_stats = NULL;
+    worker->n_thread_stats = 0;
 }
@@ -2,11 +2,25 @@
 // Данные исполнителя.
 //================
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 #include <arpa/inet.h>
+#include "cluster-histogram.h"
 
 #define INIT_ANS_SIZE 1024
 
+//! Пул потоков исполнителя (определён в worker.c).
+typedef struct WORKER_POOL WORKER_POOL;
+
+//! Соединение через разделяемую память (определено в cluster-shm.h).
+struct CLUSTER_SHM;
+
+//! Транспорт соединения (определён в cluster-transport.h).
+struct CLUSTER_TRANSPORT;
+
+//! Трассировка выполнения (определена в cluster-trace.h).
+struct CLUSTER_TRACE;
+
 
 #ifdef DEBUGTEST
 #define DEBUG(...) printf(__VA_ARGS__);
@@ -14,23 +28,110 @@
 #define DEBUG(...)
 #endif
 
+//! Статистика сжатия: сколько байт данных задач и результатов передано по сети.
+typedef struct
+{
+    //! Размер данных отправленных результатов до сжатия и после него (в байтах).
+    size_t tx_raw_bytes;
+    size_t tx_wire_bytes;
+    //! Размер данных полученных пакетов задач после распаковки и до неё (в байтах).
+    size_t rx_raw_bytes;
+    size_t rx_wire_bytes;
+} WORKER_CODEC_STATS;
+
+//! Статистика потока пула.
+typedef struct
+{
+    //! Процессор, за которым закреплён поток.
+    size_t cpu;
+    //! Количество выполненных потоком задач.
+    size_t tasks_completed;
+    //! Время выполнения задач (вместе со сжатием результатов) и время ожидания задач (в микросекундах).
+    size_t busy_us;
+    size_t idle_us;
+    //! Время от приёма пакета задачи до начала её выполнения.
+    CLUSTER_HISTOGRAM queue_wait;
+    //! Время выполнения функции задачи.
+    CLUSTER_HISTOGRAM compute;
+} WORKER_THREAD_STATS;
+
+//! Статистика исполнителя.
+typedef struct
+{
+    //! Количество принятых пакетов и задач.
+    size_t batches_received;
+    size_t tasks_received;
+    //! Количество отправленных результатов.
+    size_t results_sent;
+    //! Объём принятых пакетов и отправленных результатов вместе с заголовками (в байтах, после сжатия).
+    size_t bytes_in;
+    size_t bytes_out;
+    //! Время от приёма пакета задачи до отправки её результата.
+    CLUSTER_HISTOGRAM turnaround;
+    //! Сумма статистики потоков пула (поле cpu не используется).
+    WORKER_THREAD_STATS threads;
+    //! Статистика сжатия.
+    WORKER_CODEC_STATS codec;
+} WORKER_STATS;
+
 //! Структура для хранения информации о рабочем узле.
 typedef struct
 {
     //! Дескриптор сокета для подключения к серверу.
     int server_conn_fd;
 
-    //! Адрес сервера для подключения.
-    struct sockaddr server_addr;
+    //! Адрес сервера для подключения и его длина.
+    struct sockaddr_storage server_addr;
+    socklen_t server_addr_len;
+
+    //! Транспорт соединения с сервером, выбранный по строке адреса (cluster-transport.h).
+    const struct CLUSTER_TRANSPORT *transport;
 
     //! Максимальное время вычисления (в секундах).
     time_t max_time;
 
-    //! Количество ядер процессора.
+    //! Количество ядер процессора (наибольшее количество потоков пула: потоков не больше, чем процессоров,
+    //! доступных процессу с учётом маски affinity и квоты cgroup).
     size_t n_cores;
 
     //! Указатель на функцию, выполняющую задачу.
     void *(*func)(void *);
+
+    //! Пул закреплённых за ядрами потоков, создаётся один раз в worker_start.
+    WORKER_POOL *pool;
+
+    //! Предлагать серверу разделяемую память (по умолчанию true): если сервер работает на этом же
+    //! хосте, задачи и результаты передаются через общий сегмент, а не через TCP.
+    bool shared_memory;
+    //! Разделяемая память, выбранная сервером при подключении (NULL - данные передаются через сокет).
+    struct CLUSTER_SHM *shm;
+
+    //! Кодек сжатия, выбранный сервером при подключении (0 - без сжатия).
+    size_t codec;
+    //! Статистика сжатия, накапливаемая worker_start.
+    WORKER_CODEC_STATS codec_stats;
+
+    //! Статистика, накапливаемая worker_start (читается функцией worker_get_stats;
+    //! поля threads и codec заполняются только при чтении).
+    WORKER_STATS stats;
+    //! Статистика потоков пула: n_cores элементов (не меньше одного), используются первые n_thread_stats.
+    WORKER_THREAD_STATS *thread_stats;
+    size_t n_thread_stats;
+    //! Файл, в конец которого при завершении worker_start дописывается строка JSON со статистикой
+    //! (см. worker_get_stats). NULL - по умолчанию, статистика не записывается.
+    const char *stats_path;
+
+    //! Файл трассировки в формате Chrome trace-event (NULL - по умолчанию, трассировка выключена).
+    //! Интервалы приёма пакетов, передачи задач пулу, выполнения задач и отправки результатов
+    //! записываются при завершении worker_start по часам сервера, поэтому файл объединяется
+    //! с трассировкой сервера (см. INFO_MANAGER::trace_path).
+    const char *trace_path;
+    //! Трассировка, ведущаяся во время worker_start (NULL - не ведётся).
+    struct CLUSTER_TRACE *trace;
+    //! Номер узла, назначенный сервером при подключении.
+    size_t node_id;
+    //! Разность часов сервера и узла (в микросекундах), оценённая при подключении.
+    int64_t clock_offset_us;
 } INFO_WORKER;
 
 //================
@@ -43,8 +144,9 @@ typedef struct
  * \param[out] worker Указатель на структуру INFO_WORKER, которую необходимо инициализировать.
  * \param[in] n_cores Количество ядер процессора, выделенных для выполнения задач.
  * \param[in] max_time Максимальное время вычисления (в секундах).
- * \param[in] addr Строка, содержащая IP-адрес сервера (например, "127.0.0.1").
- * \param[in] port Строка, содержащая номер порта сервера (например, "8080").
+ * \param[in] addr Строка, содержащая адрес сервера: адрес IPv4 или IPv6, имя узла (например, "127.0.0.1",
+ *                 "[::1]") или путь сокета AF_UNIX ("unix:/tmp/manager.sock").
+ * \param[in] port Строка, содержащая номер порта сервера (например, "8080"), для сокета AF_UNIX не используется.
  * \param[in] func Указатель на функцию, выполняющую задачу (должна соответствовать сигнатуре `void *(void *)`).
  *
  * \return 0 в случае успеха, отрицательное значение(-1) в случае ошибки.
@@ -64,12 +166,45 @@ int init_worker(INFO_WORKER* worker, size_t n_cores, time_t max_time, const char
  * \return 0 в случае успешного завершения, отрицательное значение в случае ошибки.
  *
  * \details Функция устанавливает соединение с сервером, получает задачи, выполняет их и отправляет результаты.
+ *          Новые пакеты задач принимаются, пока пул потоков вычисляет уже полученные.
  */
 int worker_start(INFO_WORKER *worker);
 
-//! Закрытие сокета для взаимодействия с сервером.
+//! Закрытие сокета для взаимодействия с сервером и освобождение статистики потоков.
 void worker_close(INFO_WORKER *worker);
 
+/*!
+ * \brief Возвращает статистику исполнителя и потоков его пула.
+ *
+ * \param[in] worker Указатель на структуру INFO_WORKER, инициализированную init_worker.
+ * \param[out] stats Статистика исполнителя или NULL.
+ * \param[out] threads Массив для статистики потоков пула или NULL.
+ * \param[in] max_threads Размер массива threads.
+ *
+ * \return Количество потоков пула (статистика записывается не более чем для max_threads из них)
+ *          или -EINVAL при некорректных аргументах.
+ *
+ * \details Счётчики ведутся всегда и накапливаются всеми вызовами worker_start. Каждый счётчик изменяет
+ *          только один поток, поэтому они обновляются без блокировок, а функцию можно вызывать
+ *          из другого потока во время работы worker_start (значения разных счётчиков могут
+ *          относиться к немного разным моментам).
+ */
+int worker_get_stats(INFO_WORKER *worker, WORKER_STATS *stats, WORKER_THREAD_STATS *threads, size_t max_threads);
+
+/*!
+ * \brief Выделяет место под результат текущей задачи прямо в буфере отправки.
+ *
+ * \param[in] size Размер результата (в байтах).
+ *
+ * \return Указатель на область из size байт для записи результата. Возвращает NULL в случае ошибки.
+ *
+ * \details Функция вызывается из функции, выполняющей задачу, которая должна вернуть этот же указатель.
+ *          Результат отправляется серверу из того места, где он был записан, без копирования;
+ *          буфер принадлежит исполнителю и переиспользуется следующими задачами, освобождать его не нужно.
+ *          Альтернатива format_ans, не требующая выделения памяти на каждую задачу.
+ */
+void *worker_result_buffer(size_t size);
+
 /*!
  * \brief Извлекает задачу из буфера.
  *